@@ -77,14 +77,98 @@ long pfn_alloc_alloc(pfn_alloc_env_t *env, unsigned long addr)
 	return pfn_to_mfn(virt_to_pfn(va));
 }
 
-static void new_pt_frame(unsigned long pt_mfn_for_pfn, unsigned long prev_l_mfn, unsigned long offset, unsigned long level)
+/*
+ * Page table construction queues its work and issues it as one multicall:
+ * new frames are made read-only, pinned and linked into their parents, then
+ * the leaf entries are written. Frames that are queued but not yet linked
+ * are remembered per level so that later addresses in the same batch reuse
+ * them instead of allocating duplicates.
+ */
+
+#define PT_BATCH_FRAMES 8
+
+struct pt_batch
+{
+	mmu_update_t protect[PT_BATCH_FRAMES];
+	struct mmuext_op pin[PT_BATCH_FRAMES];
+	mmu_update_t link[PT_BATCH_FRAMES];
+	mmu_update_t leaf[L1_PAGETABLE_ENTRIES];
+	int nr_frames;
+	int nr_leaves;
+	unsigned long pending_mfn[L3_FRAME + 1];
+	unsigned long pending_index[L3_FRAME + 1];
+};
+
+static const int pt_frame_shift[L3_FRAME + 1] = {
+	0, L2_PAGETABLE_SHIFT, L3_PAGETABLE_SHIFT, L4_PAGETABLE_SHIFT
+};
+
+static unsigned long pt_hypercalls;
+static unsigned long pt_frames;
+static unsigned long pt_pages_mapped;
+
+void pagetable_stats(unsigned long *hypercalls, unsigned long *frames, unsigned long *pages_mapped)
+{
+	*hypercalls = pt_hypercalls;
+	*frames = pt_frames;
+	*pages_mapped = pt_pages_mapped;
+}
+
+static void pt_batch_call(multicall_entry_t *call, unsigned long op, void *requests, int count)
+{
+	call->op = op;
+	call->args[0] = (unsigned long)requests;
+	call->args[1] = count;
+	call->args[2] = 0;
+	call->args[3] = DOMID_SELF;
+}
+
+/* Returns -1 if the leaf updates were refused; failures on new frames are fatal */
+static int flush_pt_batch(struct pt_batch *batch)
+{
+	multicall_entry_t call[4];
+	int i, n = 0, result = 0;
+
+	if (batch->nr_frames > 0)
+	{
+		pt_batch_call(&call[n++], __HYPERVISOR_mmu_update, batch->protect, batch->nr_frames);
+		pt_batch_call(&call[n++], __HYPERVISOR_mmuext_op, batch->pin, batch->nr_frames);
+		pt_batch_call(&call[n++], __HYPERVISOR_mmu_update, batch->link, batch->nr_frames);
+	}
+	if (batch->nr_leaves > 0)
+	{
+		pt_batch_call(&call[n++], __HYPERVISOR_mmu_update, batch->leaf, batch->nr_leaves);
+	}
+	if (n == 0) return 0;
+
+	if (HYPERVISOR_multicall(call, n))
+	{
+		crash();
+	}
+	pt_hypercalls++;
+
+	for (i = 0; i < n; i++)
+	{
+		if ((long)call[i].result < 0)
+		{
+			if (batch->nr_leaves == 0 || i != n - 1) crash();
+			result = -1;
+		}
+	}
+
+	batch->nr_frames = 0;
+	batch->nr_leaves = 0;
+	memset(batch->pending_mfn, 0, sizeof(batch->pending_mfn));
+	return result;
+}
+
+static void new_pt_frame(struct pt_batch *batch, unsigned long pt_mfn_for_pfn, unsigned long prev_l_mfn, unsigned long offset, unsigned long level, unsigned long va)
 {
 	pgentry_t *tab = (pgentry_t *)start_info.pt_base;
 	unsigned long pt_pfn = mfn_to_pfn(pt_mfn_for_pfn);
 	unsigned long pt_page = (unsigned long)pfn_to_virt(pt_pfn);
 	unsigned long prot_e, prot_t, pincmd;
-	mmu_update_t mmu_updates[1];
-	struct mmuext_op pin_request;
+	int i;
 	prot_e = prot_t = pincmd = 0;
 	memset((unsigned long*)pfn_to_virt(pt_pfn), 0, PAGE_SIZE);
 	switch ( level )
@@ -116,108 +200,121 @@ static void new_pt_frame(unsigned long pt_mfn_for_pfn, unsigned long prev_l_mfn,
 	tab = pte_to_virt(tab[l4_table_offset(pt_page)]);
 	tab = pte_to_virt(tab[l3_table_offset(pt_page)]);
 #endif
-	mmu_updates[0].ptr = ((pgentry_t)tab[l2_table_offset(pt_page)] & PAGE_MASK) + sizeof(pgentry_t) * l1_table_offset(pt_page);
-	mmu_updates[0].val = (pgentry_t)pfn_to_mfn(pt_pfn) << PAGE_SHIFT | (prot_e & ~_PAGE_RW);
-	if(HYPERVISOR_mmu_update(mmu_updates, 1, NULL, DOMID_SELF) < 0)
+	if (batch->nr_frames == PT_BATCH_FRAMES)
 	{
-		crash();
+		flush_pt_batch(batch);
 	}
-	pin_request.cmd = pincmd;
-	pin_request.arg1.mfn = pfn_to_mfn(pt_pfn);
-	if(HYPERVISOR_mmuext_op(&pin_request, 1, NULL, DOMID_SELF) < 0)
-	{
-		crash();
+	i = batch->nr_frames++;
+	batch->protect[i].ptr = ((pgentry_t)tab[l2_table_offset(pt_page)] & PAGE_MASK) + sizeof(pgentry_t) * l1_table_offset(pt_page);
+	batch->protect[i].val = (pgentry_t)pfn_to_mfn(pt_pfn) << PAGE_SHIFT | (prot_e & ~_PAGE_RW);
+	batch->pin[i].cmd = pincmd;
+	batch->pin[i].arg1.mfn = pfn_to_mfn(pt_pfn);
+	batch->link[i].ptr = ((pgentry_t)prev_l_mfn << PAGE_SHIFT) + sizeof(pgentry_t) * offset;
+	batch->link[i].val = (pgentry_t)pfn_to_mfn(pt_pfn) << PAGE_SHIFT | prot_t;
+	batch->pending_mfn[level] = pfn_to_mfn(pt_pfn);
+	batch->pending_index[level] = va >> pt_frame_shift[level];
+	pt_frames++;
+}
+
+/* Returns the mfn of the next level table for va, queueing a new frame if there is none */
+static unsigned long next_pt_level(struct pt_batch *batch, pgentry_t *tab, unsigned long mfn, unsigned long offset, unsigned long level, unsigned long va, pfn_alloc_env_t *env_npf)
+{
+	if (tab[offset] & _PAGE_PRESENT) {
+		return pte_to_mfn(tab[offset]);
 	}
-	mmu_updates[0].ptr = ((pgentry_t)prev_l_mfn << PAGE_SHIFT) + sizeof(pgentry_t) * offset;
-	mmu_updates[0].val = (pgentry_t)pfn_to_mfn(pt_pfn) << PAGE_SHIFT | prot_t;
-	if(HYPERVISOR_mmu_update(mmu_updates, 1, NULL, DOMID_SELF) < 0)
-	{
-		crash();
+	if (batch->pending_mfn[level] && batch->pending_index[level] == va >> pt_frame_shift[level]) {
+		return batch->pending_mfn[level];
 	}
+	long npf_pfn = env_npf->pfn_alloc(env_npf, va);
+	if (npf_pfn < 0) {
+		return 0;
+	}
+	new_pt_frame(batch, npf_pfn, mfn, offset, level, va);
+	return batch->pending_mfn[level];
 }
 
 static int build_pagetable_vs(unsigned long start_address, unsigned long end_address, int page_size, pfn_alloc_env_t *env_pfn, pfn_alloc_env_t *env_npf)
 {
-	mmu_update_t mmu_updates[L1_PAGETABLE_ENTRIES + 1];
-	pgentry_t *tab = (pgentry_t *)start_info.pt_base, page;
+	struct pt_batch batch;
+	pgentry_t *tab;
 	unsigned long mfn;
 	unsigned long offset;
-	int count = 0;
+	batch.nr_frames = 0;
+	batch.nr_leaves = 0;
+	memset(batch.pending_mfn, 0, sizeof(batch.pending_mfn));
 	while(start_address < end_address)
 	{
 		tab = (pgentry_t *)start_info.pt_base;
 		mfn = pfn_to_mfn(virt_to_pfn(start_info.pt_base));
 #if defined(__x86_64__)
 		offset = l4_table_offset(start_address);
-		if(!(tab[offset] & _PAGE_PRESENT)) {
-			/* Need new L3 pt frame */
-			long npf_pfn = env_npf->pfn_alloc(env_npf, start_address);
-			if (npf_pfn < 0) {
-				return 0;
-			} else {
-				new_pt_frame(npf_pfn, mfn, offset, L3_FRAME);
-			}
+		mfn = next_pt_level(&batch, tab, mfn, offset, L3_FRAME, start_address, env_npf);
+		if (mfn == 0) {
+			flush_pt_batch(&batch);
+			return 0;
 		}
-
-		page = tab[offset];
-		mfn = pte_to_mfn(page);
 		tab = to_virt(mfn_to_pfn(mfn) << PAGE_SHIFT);
 #endif
 #if defined(__x86_64__) || defined(CONFIG_X86_PAE)
 		offset = l3_table_offset(start_address);
-		if(!(tab[offset] & _PAGE_PRESENT)) {
-			/* Need new L2 pt frame */
-			long npf_pfn = env_npf->pfn_alloc(env_npf, start_address);
-			if (npf_pfn < 0) {
-				return 0;
-			} else {
-				new_pt_frame(npf_pfn, mfn, offset, L2_FRAME);
-			}
+		mfn = next_pt_level(&batch, tab, mfn, offset, L2_FRAME, start_address, env_npf);
+		if (mfn == 0) {
+			flush_pt_batch(&batch);
+			return 0;
 		}
-
-		page = tab[offset];
-		mfn = pte_to_mfn(page);
 		tab = to_virt(mfn_to_pfn(mfn) << PAGE_SHIFT);
 #endif
 		offset = l2_table_offset(start_address);
 
+		if (page_size != PAGE_SIZE && (tab[offset] & _PAGE_PRESENT)) {
+			flush_pt_batch(&batch);
+			return 0;
+		}
+
 		if (page_size == PAGE_SIZE) {
-			if(!(tab[offset] & _PAGE_PRESENT)) {
-				/* Need new L1 pt frame */
-				long npf_pfn = env_npf->pfn_alloc(env_npf, start_address);
-				if (npf_pfn < 0) {
-					return 0;
-				} else {
-					new_pt_frame(npf_pfn, mfn, offset, L1_FRAME);
-				}
+			mfn = next_pt_level(&batch, tab, mfn, offset, L1_FRAME, start_address, env_npf);
+			if (mfn == 0) {
+				flush_pt_batch(&batch);
+				return 0;
 			}
-			page = tab[offset];
-			mfn = pte_to_mfn(page);
 			offset = l1_table_offset(start_address);
 		}
 
 		long mfn_for_pfn = env_pfn->pfn_alloc(env_pfn, start_address);
 		if (mfn_for_pfn < 0) {
+			flush_pt_batch(&batch);
 			return 0;
 		}
 
+		if (page_size != PAGE_SIZE) {
+			/* Large pages are only built from linear environments */
+			env_pfn->pfn += (page_size >> PAGE_SHIFT) - 1;
+			if (mfn_for_pfn & ((page_size >> PAGE_SHIFT) - 1)) {
+				flush_pt_batch(&batch);
+				return 0;
+			}
+		}
+
 		if (mfn_for_pfn > 0) {
-			mmu_updates[count].ptr = ((pgentry_t)mfn << PAGE_SHIFT) + sizeof(pgentry_t) * offset;
+			mmu_update_t *leaf = &batch.leaf[batch.nr_leaves++];
+			leaf->ptr = ((pgentry_t)mfn << PAGE_SHIFT) + sizeof(pgentry_t) * offset;
 			if (page_size == PAGE_SIZE) {
-				mmu_updates[count].val = (pgentry_t)mfn_for_pfn << L1_PAGETABLE_SHIFT | L1_PROT;
+				leaf->val = (pgentry_t)mfn_for_pfn << L1_PAGETABLE_SHIFT | L1_PROT;
 			} else {
-				mmu_updates[count].val = (pgentry_t)mfn_for_pfn << L2_PAGETABLE_SHIFT | L1_PROT | _PAGE_PSE;
+				leaf->val = (pgentry_t)mfn_for_pfn << L1_PAGETABLE_SHIFT | L1_PROT | _PAGE_PSE;
 			}
-			count++;
+			pt_pages_mapped += page_size >> PAGE_SHIFT;
 		}
 		start_address += page_size;
-		if (count == L1_PAGETABLE_ENTRIES || start_address == end_address)
+		if (batch.nr_leaves == L1_PAGETABLE_ENTRIES || start_address == end_address)
 		{
-			if(HYPERVISOR_mmu_update(mmu_updates, count, NULL, DOMID_SELF) < 0)
+			if (flush_pt_batch(&batch) < 0)
 			{
+				if (page_size != PAGE_SIZE) {
+					return 0;
+				}
 				crash();
 			}
-			count = 0;
 		}
 	}
 	return 1;
@@ -228,6 +325,48 @@ int build_pagetable(unsigned long start_address, unsigned long end_address, pfn_
 	return build_pagetable_vs(start_address, end_address, PAGE_SIZE, env_pfn, env_npf);
 }
 
+static int superpages_supported = 1;
+
+/*
+ * Maps machine-contiguous memory with 2MB entries where the hypervisor allows
+ * it. Once a superpage mapping is refused, this and all later ranges are
+ * mapped with 4K pages.
+ */
+static int l2_entry_present(unsigned long va)
+{
+	pgentry_t *tab = (pgentry_t *)start_info.pt_base;
+	if (!(tab[l4_table_offset(va)] & _PAGE_PRESENT)) return 0;
+	tab = pte_to_virt(tab[l4_table_offset(va)]);
+	if (!(tab[l3_table_offset(va)] & _PAGE_PRESENT)) return 0;
+	tab = pte_to_virt(tab[l3_table_offset(va)]);
+	return (tab[l2_table_offset(va)] & _PAGE_PRESENT) != 0;
+}
+
+int build_superpage_pagetable(unsigned long start_address, unsigned long end_address, pfn_alloc_env_t *env_pfn, pfn_alloc_env_t *env_npf)
+{
+	while (superpages_supported && start_address + SUPERPAGE_SIZE <= end_address)
+	{
+		long pfn = env_pfn->pfn;
+		if (l2_entry_present(start_address))
+		{
+			/* An L1 table is left over from an earlier 4K mapping of this range */
+			if (!build_pagetable(start_address, start_address + SUPERPAGE_SIZE, env_pfn, env_npf)) return 0;
+			start_address += SUPERPAGE_SIZE;
+			continue;
+		}
+		if (build_pagetable_vs(start_address, start_address + SUPERPAGE_SIZE, SUPERPAGE_SIZE, env_pfn, env_npf))
+		{
+			start_address += SUPERPAGE_SIZE;
+			continue;
+		}
+		env_pfn->pfn = pfn;
+		superpages_supported = 0;
+		printk("Superpage mappings are not available, using 4K pages\n");
+	}
+	if (start_address >= end_address) return 1;
+	return build_pagetable(start_address, end_address, env_pfn, env_npf);
+}
+
 static void demolish_pagetable_vs(unsigned long start_address, unsigned long end_address, int page_size)
 {
 	int i = 0;
@@ -294,6 +433,7 @@ void arch_init_mm(unsigned long* free_pfn_ptr, unsigned long* max_pfn_ptr)
 	pfn_linear_tomap_env.pfn = start_pfn;
 	build_pagetable(pfn_to_virtu(start_pfn), pfn_to_virtu(*max_pfn_ptr), &pfn_linear_tomap_env, &pfn_frame_alloc_env);
 	*free_pfn_ptr = pfn_frame_alloc_env.pfn;
+	printk("    pt_build    : %ld hypercalls, %ld frames for %ld MB\n", pt_hypercalls, pt_frames, pt_pages_mapped >> (20 - PAGE_SHIFT));
 }
 
 int unmap_page_pfn(unsigned long addr, unsigned long pfn)
@@ -342,6 +482,10 @@ long not11_virt_to_pfn(unsigned long addr, unsigned long *pte_ptr)
 			return -1;
 		}
 		pfn = mfn_to_pfn(pte_to_mfn(pte));
+		if (level == 2 && (pte & _PAGE_PSE)) {
+			pfn += l1_table_offset(addr);
+			break;
+		}
 		tab = to_virt(pfn << PAGE_SHIFT);
 		level--;
 	}
@@ -105,32 +105,108 @@ void backtrace(void **bp, void *ip)
     }
 }
 
+#define XSTATE_FP	(1UL << 0)
+#define XSTATE_SSE	(1UL << 1)
+#define XSTATE_YMM	(1UL << 2)
+
+unsigned long fp_area_size = sizeof(struct fp_regs);
+
+/* Components saved with XSAVE, zero when falling back to FXSAVE */
+static u64 xsave_mask;
+static int xsaveopt;
+
+static inline void cpuid_count(unsigned int op, unsigned int count, unsigned int *eax, unsigned int *ebx, unsigned int *ecx, unsigned int *edx)
+{
+    __asm__ __volatile__("cpuid"
+                         : "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx)
+                         : "0" (op), "2" (count));
+}
+
+static inline u64 xgetbv(unsigned int index)
+{
+    unsigned int eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a" (eax), "=d" (edx) : "c" (index));
+    return eax | ((u64)edx << 32);
+}
+
+/* Privileged, emulated by Xen for PV guests */
+static inline void xsetbv(unsigned int index, u64 value)
+{
+    __asm__ __volatile__("xsetbv" : : "c" (index), "a" ((unsigned int)value), "d" ((unsigned int)(value >> 32)));
+}
+
+/* Pick FXSAVE or XSAVE, and enable AVX state if the processor has it */
+void fpu_init(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    u64 supported;
+
+    cpuid_count(1, 0, &eax, &ebx, &ecx, &edx);
+    /* XSAVE and OSXSAVE */
+    if ((ecx & (3U << 26)) != (3U << 26))
+        return;
+
+    cpuid_count(0xd, 0, &eax, &ebx, &ecx, &edx);
+    supported = eax | ((u64)edx << 32);
+    xsave_mask = supported & (XSTATE_FP | XSTATE_SSE | XSTATE_YMM);
+    if (xgetbv(0) != xsave_mask)
+        xsetbv(0, xsave_mask);
+
+    /* EBX now covers the components just enabled */
+    cpuid_count(0xd, 0, &eax, &ebx, &ecx, &edx);
+    fp_area_size = ebx;
+    BUG_ON(fp_area_size < sizeof(struct fp_regs) || fp_area_size > PAGE_SIZE);
+
+    cpuid_count(0xd, 1, &eax, &ebx, &ecx, &edx);
+    xsaveopt = eax & 1;
+
+    printk("FPU: xsave features %lx, %lu byte save area%s\n", xsave_mask, fp_area_size, xsaveopt ? ", xsaveopt" : "");
+}
+
+/* Called by each processor's idle thread as it starts */
+void fpu_init_cpu(void)
+{
+    if (xsave_mask != 0 && xgetbv(0) != xsave_mask)
+        xsetbv(0, xsave_mask);
+}
+
+void fpu_save(struct fp_regs *fpregs)
+{
+    unsigned int lo = xsave_mask, hi = xsave_mask >> 32;
+
+    if (xsave_mask == 0)
+        __asm__ __volatile__("fxsave (%0)" : : "r" (fpregs) : "memory");
+    else if (xsaveopt)
+        __asm__ __volatile__("xsaveopt (%0)" : : "r" (fpregs), "a" (lo), "d" (hi) : "memory");
+    else
+        __asm__ __volatile__("xsave (%0)" : : "r" (fpregs), "a" (lo), "d" (hi) : "memory");
+}
+
+void fpu_restore(struct fp_regs *fpregs)
+{
+    unsigned int lo = xsave_mask, hi = xsave_mask >> 32;
+
+    if (xsave_mask == 0)
+        __asm__ __volatile__("fxrstor (%0)" : : "r" (fpregs) : "memory");
+    else
+        __asm__ __volatile__("xrstor (%0)" : : "r" (fpregs), "a" (lo), "d" (hi) : "memory");
+}
+
 extern void thread_starter(void);
 extern void idle_thread_starter(void);
 
 struct thread* arch_create_thread(char *name, void (*function)(void *), void *stack, unsigned long stack_size, void *data)
 {
     struct thread *thread;
-    thread = xmalloc(struct thread);
+    thread = sched_alloc_thread(stack == NULL);
     if (thread == NULL) {
     	return NULL;
     }
     if(stack != NULL)
     {
         thread->stack = (char *)stack;
-        thread->stack_allocated = 0;
         thread->stack_size = stack_size;
     }
-    else
-    {
-        thread->stack = (char *)alloc_pages(STACK_SIZE_PAGE_ORDER);
-        if (thread->stack == NULL) {
-        	xfree(thread);
-        	return NULL;
-        }
-        thread->stack_allocated = 1;
-        thread->stack_size = STACK_SIZE;
-    }
     thread->specific = NULL;
     thread->name = name;
     thread->sp = (unsigned long)thread->stack + thread->stack_size;
@@ -183,16 +183,59 @@ int gettimeofday(struct timeval *tv)
 	return 0;
 }
 
+#ifdef ENABLE_TICKLESS
+/* Deadline the one-shot timer is programmed for on each processor, 0 once it fired */
+static s_time_t timer_deadline[MAX_VIRT_CPUS];
+
+/* Xen keeps a single one-shot timer per processor, so a later deadline must
+ * never replace an earlier one that has yet to fire, nor be armed past the
+ * first sleeper due on this processor */
+void set_timer_deadline(s_time_t deadline)
+{
+	int cpu = smp_processor_id();
+	s_time_t armed = timer_deadline[cpu];
+	s_time_t expiry = sched_next_expiry();
+
+	if (expiry < deadline && deadline - expiry > TIMER_SLACK)
+	{
+		deadline = expiry;
+	}
+
+	/* Already due before, or just after, this deadline */
+	if (armed != 0 && armed > NOW() && (armed <= deadline || armed - deadline <= TIMER_SLACK))
+	{
+		return;
+	}
+
+	timer_deadline[cpu] = deadline;
+	BUG_ON(HYPERVISOR_set_timer_op(deadline - time_addend));
+}
+
+void stop_periodic_timer(int cpu)
+{
+	BUG_ON(HYPERVISOR_vcpu_op(VCPUOP_stop_periodic_timer, cpu, NULL));
+}
+#endif
+
 void set_timer_interrupt(u64 delta)
 {
+#ifdef ENABLE_TICKLESS
+	set_timer_deadline(NOW() + delta);
+#else
 	if(delta < MILLISECS(1)) delta = MILLISECS(1);
 	BUG_ON(HYPERVISOR_set_timer_op(monotonic_clock() + delta));
+#endif
 }
 
 void block_domain(s_time_t until)
 {
 	if(NOW() < until) {
+#ifdef ENABLE_TICKLESS
+		/* LLONG_MAX: nothing to wait for but an event */
+		if (until != LLONG_MAX) set_timer_deadline(until);
+#else
 		HYPERVISOR_set_timer_op(until - time_addend);
+#endif
 		this_cpu(cpu_state) = CPU_SLEEPING;
 		HYPERVISOR_sched_op(SCHEDOP_block, 0);
 		this_cpu(cpu_state) = CPU_UP;
@@ -201,6 +244,13 @@ void block_domain(s_time_t until)
 	BUG_ON(irqs_disabled());
 }
 
+/* Converts a TSC delta measured on the given processor into nanoseconds */
+u64 tsc_to_nsec(int cpu, u64 cycles)
+{
+	struct shadow_time_info *shadow = &per_cpu(cpu, shadow_time);
+	return scale_delta(cycles, shadow->tsc_to_nsec_mul, shadow->tsc_shift);
+}
+
 u64 get_cpu_running_time(int cpu)
 {
 	vcpu_runstate_info_t runstate;
@@ -216,6 +266,14 @@ void check_need_resched(void)
 
 	if(current_thread != NULL)
 	{
+#ifdef ENABLE_TICKLESS
+		/* Sleepers are only woken from schedule() */
+		if (sched_timers_due())
+		{
+			set_need_resched(current_thread);
+			return;
+		}
+#endif
 		resched_time = current_thread->resched_running_time;
 		if(resched_time == 0ULL)
 		{
@@ -234,6 +292,10 @@ void check_need_resched(void)
 
 void timer_handler(evtchn_port_t ev, void *ign)
 {
+#ifdef ENABLE_TICKLESS
+	int cpu = smp_processor_id();
+	if (timer_deadline[cpu] != 0 && NOW() >= timer_deadline[cpu]) timer_deadline[cpu] = 0;
+#endif
 	get_time_values_from_xen();
 	update_wallclock();
 	check_need_resched();
@@ -185,8 +185,7 @@ void do_spurious_interrupt_bug(struct pt_regs * regs)
 void do_int3(struct pt_regs *regs)
 {
 	struct thread *thread = current;
-	struct fp_regs *fpregs = thread->fpregs;
-	asm (save_fp_regs_asm : : [fpr] "r" (fpregs));
+	fpu_save(thread->fpregs);
 	BUG_ON(!is_preemptible(thread));
 	set_need_resched(thread);
 }
@@ -195,8 +194,7 @@ void do_int3(struct pt_regs *regs)
 void do_debug(struct pt_regs *regs)
 {
 	struct thread *thread = current;
-	struct fp_regs *fpregs = thread->fpregs;
-	asm (save_fp_regs_asm : : [fpr] "r" (fpregs));
+	fpu_save(thread->fpregs);
 	BUG_ON(thread->regs != regs);
 	set_need_resched(thread);
 	regs->eflags &= ~0x00000100;
@@ -0,0 +1,134 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * The balloon thread keeps the number of free pages between the low and high
+ * watermarks by populating memory ahead of demand, so that allocations rarely
+ * have to grow the reservation themselves. It also follows the memory/target
+ * node in xenstore: a target below the current reservation releases idle
+ * pages back to the hypervisor and stops further growth until the target is
+ * raised again.
+ */
+
+#include <os/config.h>
+
+#ifdef ENABLE_BALLOON
+
+#include <os/kernel.h>
+#include <os/hypervisor.h>
+#include <os/mm.h>
+#include <os/sched.h>
+#include <os/xenbus.h>
+#include <os/xmalloc.h>
+#include <os/balloon.h>
+#include <public/memory.h>
+
+static struct thread *balloon_thread;
+
+/* Reservation cap in pages, zero while no lower target is in force */
+static unsigned long balloon_target;
+
+/* Set by the first kick, so that allocations do not keep waking the thread
+ * while it cannot grow memory any further */
+static volatile int balloon_kicked;
+
+static unsigned long current_reservation(void)
+{
+	domid_t domid = DOMID_SELF;
+	return HYPERVISOR_memory_op(XENMEM_current_reservation, &domid);
+}
+
+void balloon_kick(unsigned long free_pages)
+{
+	if (free_pages < BALLOON_LOW_WATERMARK && balloon_thread != NULL && !balloon_kicked)
+	{
+		/* Racing kicks at worst wake the thread twice */
+		balloon_kicked = 1;
+		wake(balloon_thread);
+	}
+}
+
+/* Returns 0 if memory is short but could not be grown */
+static int balloon_adjust(void)
+{
+	unsigned long reservation = current_reservation();
+	unsigned long free_pages = free_page_count();
+	unsigned long n;
+
+	if (balloon_target != 0 && reservation > balloon_target)
+	{
+		if (free_pages <= BALLOON_LOW_WATERMARK) return 0;
+		n = reservation - balloon_target;
+		if (n > free_pages - BALLOON_LOW_WATERMARK) n = free_pages - BALLOON_LOW_WATERMARK;
+		if (n > BALLOON_STEP_PAGES) n = BALLOON_STEP_PAGES;
+		shrink_reservation(n);
+	}
+	else if (free_pages < BALLOON_LOW_WATERMARK)
+	{
+		n = BALLOON_HIGH_WATERMARK - free_pages;
+		if (balloon_target != 0 && reservation + n > balloon_target) n = balloon_target - reservation;
+		if (n > BALLOON_STEP_PAGES) n = BALLOON_STEP_PAGES;
+		if (n == 0 || grow_reservation(n) <= 0) return 0;
+	}
+	return 1;
+}
+
+static void balloon_thread_fn(void *data)
+{
+	for (;;)
+	{
+		/* Kicks stay off while growing fails, the periodic poll retries */
+		if (balloon_adjust()) balloon_kicked = 0;
+		sleep(BALLOON_POLL_MS);
+	}
+}
+
+static void balloon_watch_fn(void *data)
+{
+	char *path;
+	int target_kb;
+
+	xenbus_watch_path(XBT_NIL, "memory/target", "balloon");
+	for (;;)
+	{
+		path = xenbus_read_watch("balloon");
+		xfree(path);
+		target_kb = xenbus_read_integer("memory/target");
+		if (target_kb <= 0) continue;
+		if ((unsigned long)target_kb >> (PAGE_SHIFT - 10) < current_reservation())
+		{
+			balloon_target = (unsigned long)target_kb >> (PAGE_SHIFT - 10);
+		}
+		else
+		{
+			balloon_target = 0;
+		}
+		balloon_kicked = 0;
+		wake(balloon_thread);
+	}
+}
+
+USED static int init_balloon(void)
+{
+	balloon_thread = create_thread("balloon", balloon_thread_fn, UKERNEL_FLAG, NULL);
+	create_thread("balloon_watch", balloon_watch_fn, UKERNEL_FLAG, NULL);
+	return 0;
+}
+
+DECLARE_INIT(init_balloon);
+
+#endif
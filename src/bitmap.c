@@ -0,0 +1,128 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <os/bitmap.h>
+
+#define BITMAP_WORD(_s) ((_s) / ENTRIES_PER_MAPWORD)
+#define BITMAP_OFFSET(_s) ((_s) & (ENTRIES_PER_MAPWORD - 1))
+
+#ifdef __SSE2__
+
+/* Four map words, i.e. 256 entries, are compared per step */
+#define BITMAP_BLOCK_WORDS 4
+
+typedef char bitmap_vec_t __attribute__((vector_size(16), aligned(8)));
+
+static inline int bitmap_block_uniform(const unsigned long *map, char pattern)
+{
+	const bitmap_vec_t *v = (const bitmap_vec_t *)map;
+	bitmap_vec_t p = (bitmap_vec_t){ 0 } + pattern;
+	return __builtin_ia32_pmovmskb128((v[0] == p) & (v[1] == p)) == 0xffff;
+}
+
+#endif
+
+/*
+ * Returns the first entry in [start, end) whose bit differs from the skip
+ * pattern, or end. Words that consist entirely of the pattern are skipped
+ * without examining individual bits.
+ */
+static inline unsigned long bitmap_find(const unsigned long *map, unsigned long start, unsigned long end, unsigned long skip)
+{
+	unsigned long idx, last, word;
+
+	if (start >= end) return end;
+	idx = BITMAP_WORD(start);
+	last = BITMAP_WORD(end - 1);
+	word = (map[idx] ^ skip) & (~0UL << BITMAP_OFFSET(start));
+
+	while (word == 0)
+	{
+		if (++idx > last) return end;
+#ifdef __SSE2__
+		while (idx + BITMAP_BLOCK_WORDS <= last && bitmap_block_uniform(&map[idx], (char)skip))
+		{
+			idx += BITMAP_BLOCK_WORDS;
+		}
+#endif
+		word = map[idx] ^ skip;
+	}
+
+	start = idx * ENTRIES_PER_MAPWORD + __builtin_ctzl(word);
+	return start < end ? start : end;
+}
+
+unsigned long bitmap_find_next_zero(const unsigned long *map, unsigned long start, unsigned long end)
+{
+	return bitmap_find(map, start, end, ~0UL);
+}
+
+unsigned long bitmap_find_next_set(const unsigned long *map, unsigned long start, unsigned long end)
+{
+	return bitmap_find(map, start, end, 0);
+}
+
+unsigned long bitmap_find_zero_run(const unsigned long *map, unsigned long start, unsigned long end, unsigned long n)
+{
+	unsigned long next;
+
+	while (start < end && end - start >= n)
+	{
+		start = bitmap_find_next_zero(map, start, end);
+		if (end - start < n) break;
+		next = bitmap_find_next_set(map, start, start + n);
+		if (next == start + n) return start;
+		start = next + 1;
+	}
+	return end;
+}
+
+void bitmap_set_range(unsigned long *map, unsigned long start, unsigned long n)
+{
+	unsigned long idx = BITMAP_WORD(start);
+	unsigned long last = BITMAP_WORD(start + n - 1);
+	unsigned long first_mask = ~0UL << BITMAP_OFFSET(start);
+	unsigned long last_mask = ~0UL >> (ENTRIES_PER_MAPWORD - 1 - BITMAP_OFFSET(start + n - 1));
+
+	if (n == 0) return;
+	if (idx == last)
+	{
+		map[idx] |= first_mask & last_mask;
+		return;
+	}
+	map[idx++] |= first_mask;
+	while (idx < last) map[idx++] = ~0UL;
+	map[last] |= last_mask;
+}
+
+void bitmap_clear_range(unsigned long *map, unsigned long start, unsigned long n)
+{
+	unsigned long idx = BITMAP_WORD(start);
+	unsigned long last = BITMAP_WORD(start + n - 1);
+	unsigned long first_mask = ~0UL << BITMAP_OFFSET(start);
+	unsigned long last_mask = ~0UL >> (ENTRIES_PER_MAPWORD - 1 - BITMAP_OFFSET(start + n - 1));
+
+	if (n == 0) return;
+	if (idx == last)
+	{
+		map[idx] &= ~(first_mask & last_mask);
+		return;
+	}
+	map[idx++] &= ~first_mask;
+	while (idx < last) map[idx++] = 0;
+	map[last] &= ~last_mask;
+}
@@ -0,0 +1,469 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Allocator micro-benchmarks for the hosted build. Every result is printed
+ * on stdout as one JSON object per line; allocator messages go to stderr.
+ *
+ *   pages       alloc/free throughput of allocate_pages by size
+ *   xmalloc     alloc/free throughput of xmalloc by size
+ *   contention  mixed xmalloc and page traffic from 1 to --threads threads
+ *   replay      replays a trace and reports the fragmentation it leaves
+ *
+ * A trace is a text file with one operation per line:
+ *
+ *   a <id> <bytes>    xmalloc
+ *   f <id>            xfree
+ *   p <id> <pages>    allocate_pages
+ *   P <id>            deallocate_pages
+ *
+ * Without --trace, replay runs a synthetic workload, which --write-trace
+ * saves in the same format.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "hosted.h"
+
+#define BENCH_BATCH 256
+#define BENCH_SLOTS 64
+
+static unsigned long bench_initial_pages = 65536;
+static unsigned long bench_max_pages = 262144;
+static unsigned long bench_iterations = 200000;
+static unsigned long bench_seed = 1;
+static int bench_max_threads;
+static const char *bench_trace;
+static const char *bench_write_trace;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned long next_random(unsigned long *state)
+{
+	unsigned long x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+static void report(const char *bench, const char *param, unsigned long value, int threads, unsigned long ops, double seconds, struct hosted_stats *before)
+{
+	struct hosted_stats stats;
+
+	hosted_read_stats(&stats);
+	printf("{\"bench\":\"%s\",\"%s\":%lu,\"threads\":%d,\"ops\":%lu,\"seconds\":%.6f,\"ns_per_op\":%.2f,"
+			"\"lock_waits\":%lu,\"lock_wait_cycles\":%lu,\"free_pages\":%lu,\"fragmentation\":%lu}\n",
+			bench, param, value, threads, ops, seconds, seconds * 1e9 / ops,
+			stats.lock_waits - before->lock_waits, stats.lock_wait_cycles - before->lock_wait_cycles,
+			stats.free_pages, stats.fragmentation);
+	fflush(stdout);
+}
+
+static void bench_pages(void)
+{
+	static const int sizes[] = { 1, 2, 4, 8, 16, 64, 512 };
+	void *objects[BENCH_BATCH];
+	struct hosted_stats before;
+	unsigned long rounds, batch, r, i;
+	unsigned int s;
+	double start;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		batch = BENCH_BATCH;
+		if (batch * sizes[s] > bench_max_pages / 4) batch = bench_max_pages / 4 / sizes[s];
+		rounds = bench_iterations / batch + 1;
+		hosted_read_stats(&before);
+		start = now();
+		for (r = 0; r < rounds; r++)
+		{
+			for (i = 0; i < batch; i++)
+			{
+				objects[i] = hosted_alloc_pages(sizes[s]);
+			}
+			for (i = 0; i < batch; i++)
+			{
+				hosted_free_pages(objects[i], sizes[s]);
+			}
+		}
+		report("pages", "pages", sizes[s], 1, 2 * rounds * batch, now() - start, &before);
+	}
+}
+
+static void bench_xmalloc(void)
+{
+	static const unsigned long sizes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 16384, 65536 };
+	void *objects[BENCH_BATCH];
+	struct hosted_stats before;
+	unsigned long rounds, r, i;
+	unsigned int s;
+	double start;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		rounds = bench_iterations / BENCH_BATCH + 1;
+		hosted_read_stats(&before);
+		start = now();
+		for (r = 0; r < rounds; r++)
+		{
+			for (i = 0; i < BENCH_BATCH; i++)
+			{
+				objects[i] = hosted_xmalloc(sizes[s]);
+			}
+			for (i = 0; i < BENCH_BATCH; i++)
+			{
+				hosted_xfree(objects[i]);
+			}
+		}
+		report("xmalloc", "bytes", sizes[s], 1, 2 * rounds * BENCH_BATCH, now() - start, &before);
+	}
+}
+
+struct worker
+{
+	pthread_t thread;
+	int cpu;
+	unsigned long ops;
+};
+
+static pthread_barrier_t workers_ready;
+
+static void *contention_worker(void *data)
+{
+	struct worker *worker = data;
+	void *slots[BENCH_SLOTS];
+	char pages[BENCH_SLOTS];
+	unsigned long state = bench_seed * 0x9e3779b97f4a7c15UL + worker->cpu;
+	unsigned long i, r;
+	int slot;
+
+	hosted_attach_cpu(worker->cpu);
+	memset(slots, 0, sizeof(slots));
+	pthread_barrier_wait(&workers_ready);
+
+	for (i = 0; i < bench_iterations; i++)
+	{
+		r = next_random(&state);
+		slot = r % BENCH_SLOTS;
+		if (slots[slot] != NULL)
+		{
+			if (pages[slot]) hosted_free_pages(slots[slot], 1);
+			else hosted_xfree(slots[slot]);
+			worker->ops++;
+		}
+		pages[slot] = (r >> 8) % 8 == 0;
+		slots[slot] = pages[slot] ? hosted_alloc_pages(1) : hosted_xmalloc(16UL << ((r >> 16) % 8));
+		worker->ops++;
+	}
+
+	for (slot = 0; slot < BENCH_SLOTS; slot++)
+	{
+		if (slots[slot] == NULL) continue;
+		if (pages[slot]) hosted_free_pages(slots[slot], 1);
+		else hosted_xfree(slots[slot]);
+	}
+	return NULL;
+}
+
+static void bench_contention(void)
+{
+	struct worker workers[HOSTED_MAX_CPUS];
+	struct hosted_stats before;
+	unsigned long ops;
+	int threads, next, i;
+	double start;
+
+	for (threads = 1; threads <= bench_max_threads; threads = next)
+	{
+		pthread_barrier_init(&workers_ready, NULL, threads + 1);
+		memset(workers, 0, sizeof(workers));
+		for (i = 0; i < threads; i++)
+		{
+			/* The main thread keeps cpu 0 */
+			workers[i].cpu = i + 1;
+			pthread_create(&workers[i].thread, NULL, contention_worker, &workers[i]);
+		}
+		hosted_read_stats(&before);
+		pthread_barrier_wait(&workers_ready);
+		start = now();
+		ops = 0;
+		for (i = 0; i < threads; i++)
+		{
+			pthread_join(workers[i].thread, NULL);
+			ops += workers[i].ops;
+		}
+		report("contention", "slots", BENCH_SLOTS, threads, ops, now() - start, &before);
+		pthread_barrier_destroy(&workers_ready);
+		next = threads * 2;
+		if (threads < bench_max_threads && next > bench_max_threads) next = bench_max_threads;
+	}
+}
+
+struct replay_object
+{
+	void *pointer;
+	unsigned long size;
+	char pages;
+};
+
+struct replay
+{
+	struct replay_object *objects;
+	unsigned long nr_objects;
+	unsigned long ops;
+	unsigned long live_bytes;
+	unsigned long peak_live_bytes;
+	unsigned long peak_fragmentation;
+	FILE *out;
+};
+
+static struct replay_object *replay_object(struct replay *replay, unsigned long id)
+{
+	unsigned long n = replay->nr_objects;
+
+	if (id >= n)
+	{
+		while (id >= n) n = n ? n * 2 : 4096;
+		replay->objects = realloc(replay->objects, n * sizeof(struct replay_object));
+		memset(replay->objects + replay->nr_objects, 0, (n - replay->nr_objects) * sizeof(struct replay_object));
+		replay->nr_objects = n;
+	}
+	return &replay->objects[id];
+}
+
+static void replay_op(struct replay *replay, char op, unsigned long id, unsigned long size)
+{
+	struct replay_object *object = replay_object(replay, id);
+
+	if (replay->out != NULL)
+	{
+		if (op == 'a' || op == 'p') fprintf(replay->out, "%c %lu %lu\n", op, id, size);
+		else fprintf(replay->out, "%c %lu\n", op, id);
+	}
+
+	switch (op)
+	{
+	case 'a':
+	case 'p':
+		if (object->pointer != NULL) return;
+		object->pages = op == 'p';
+		object->size = size;
+		object->pointer = object->pages ? hosted_alloc_pages(size) : hosted_xmalloc(size);
+		replay->live_bytes += object->pages ? size * 4096 : size;
+		if (replay->live_bytes > replay->peak_live_bytes) replay->peak_live_bytes = replay->live_bytes;
+		break;
+	case 'f':
+	case 'P':
+		if (object->pointer == NULL) return;
+		if (object->pages) hosted_free_pages(object->pointer, object->size);
+		else hosted_xfree(object->pointer);
+		replay->live_bytes -= object->pages ? object->size * 4096 : object->size;
+		object->pointer = NULL;
+		break;
+	default:
+		return;
+	}
+
+	if (++replay->ops % 4096 == 0)
+	{
+		struct hosted_stats stats;
+		hosted_read_stats(&stats);
+		if (stats.fragmentation > replay->peak_fragmentation) replay->peak_fragmentation = stats.fragmentation;
+	}
+}
+
+static int replay_trace(struct replay *replay, const char *path)
+{
+	FILE *trace = fopen(path, "r");
+	char line[128], op;
+	unsigned long id, size;
+
+	if (trace == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), trace) != NULL)
+	{
+		size = 0;
+		if (sscanf(line, " %c %lu %lu", &op, &id, &size) < 2) continue;
+		replay_op(replay, op, id, size);
+	}
+	fclose(trace);
+	return 0;
+}
+
+/*
+ * A mix of short-lived small objects, medium buffers and page runs, with one
+ * object in sixteen kept until the end, which is what fragments the heap.
+ */
+static void replay_synthetic(struct replay *replay)
+{
+	unsigned long state = bench_seed * 0x9e3779b97f4a7c15UL + 1;
+	unsigned long *live = malloc(4096 * sizeof(unsigned long));
+	unsigned long nr_live = 0, next_id = 0, i, r, victim;
+
+	for (i = 0; i < bench_iterations; i++)
+	{
+		r = next_random(&state);
+		if (nr_live == 4096 || (nr_live > 0 && r % 3 == 0))
+		{
+			victim = (r >> 8) % nr_live;
+			replay_op(replay, replay->objects[live[victim]].pages ? 'P' : 'f', live[victim], 0);
+			live[victim] = live[--nr_live];
+			continue;
+		}
+		switch ((r >> 8) % 10)
+		{
+		case 0:
+			replay_op(replay, 'p', next_id, 1 + (r >> 16) % 64);
+			break;
+		case 1:
+			replay_op(replay, 'a', next_id, 4096 + (r >> 16) % 61440);
+			break;
+		default:
+			replay_op(replay, 'a', next_id, 16 + (r >> 16) % 1024);
+			break;
+		}
+		if ((r >> 32) % 16 != 0) live[nr_live++] = next_id;
+		next_id++;
+	}
+	free(live);
+}
+
+static void bench_replay(void)
+{
+	struct replay replay;
+	struct hosted_stats before, stats;
+	unsigned long id;
+	double start, seconds;
+
+	memset(&replay, 0, sizeof(replay));
+	if (bench_write_trace != NULL)
+	{
+		replay.out = fopen(bench_write_trace, "w");
+		if (replay.out == NULL) perror(bench_write_trace);
+	}
+
+	hosted_read_stats(&before);
+	start = now();
+	if (bench_trace != NULL)
+	{
+		if (replay_trace(&replay, bench_trace) != 0) return;
+	}
+	else
+	{
+		replay_synthetic(&replay);
+	}
+	seconds = now() - start;
+	if (replay.out != NULL)
+	{
+		fclose(replay.out);
+		replay.out = NULL;
+	}
+
+	hosted_read_stats(&stats);
+	printf("{\"bench\":\"replay\",\"trace\":\"%s\",\"ops\":%lu,\"seconds\":%.6f,\"ns_per_op\":%.2f,"
+			"\"live_bytes\":%lu,\"peak_live_bytes\":%lu,\"reservation_pages\":%lu,\"free_pages\":%lu,"
+			"\"largest_free_extent\":%lu,\"fragmentation\":%lu,\"peak_fragmentation\":%lu,"
+			"\"xmalloc_free_chunks\":%lu,\"xmalloc_free_bytes\":%lu,\"xmalloc_slabs\":%lu,"
+			"\"lock_waits\":%lu}\n",
+			bench_trace != NULL ? bench_trace : "synthetic", replay.ops, seconds, replay.ops ? seconds * 1e9 / replay.ops : 0.0,
+			replay.live_bytes, replay.peak_live_bytes, stats.reservation_pages, stats.free_pages,
+			stats.largest_free_extent, stats.fragmentation,
+			stats.fragmentation > replay.peak_fragmentation ? stats.fragmentation : replay.peak_fragmentation,
+			stats.xmalloc_free_chunks, stats.xmalloc_free_bytes, stats.xmalloc_slabs,
+			stats.lock_waits - before.lock_waits);
+	fflush(stdout);
+
+	for (id = 0; id < replay.nr_objects; id++)
+	{
+		if (replay.objects[id].pointer != NULL) replay_op(&replay, replay.objects[id].pages ? 'P' : 'f', id, 0);
+	}
+	free(replay.objects);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [options] [pages|xmalloc|contention|replay]...\n"
+			"  --initial-mb N     memory populated at start (default %lu)\n"
+			"  --max-mb N         maximum reservation (default %lu)\n"
+			"  --iterations N     operations per run (default %lu)\n"
+			"  --threads N        most threads for contention (default: online cpus, at least 2)\n"
+			"  --seed N           seed for the random workloads (default %lu)\n"
+			"  --trace FILE       replay FILE instead of the synthetic workload\n"
+			"  --write-trace FILE save the replayed operations to FILE\n",
+			name, bench_initial_pages >> 8, bench_max_pages >> 8, bench_iterations, bench_seed);
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	const char *benches[4];
+	int nr_benches = 0, i;
+
+	bench_max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (bench_max_threads < 2) bench_max_threads = 2;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--initial-mb") == 0 && i + 1 < argc) bench_initial_pages = strtoul(argv[++i], NULL, 0) << 8;
+		else if (strcmp(argv[i], "--max-mb") == 0 && i + 1 < argc) bench_max_pages = strtoul(argv[++i], NULL, 0) << 8;
+		else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) bench_iterations = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) bench_max_threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) bench_seed = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) bench_trace = argv[++i];
+		else if (strcmp(argv[i], "--write-trace") == 0 && i + 1 < argc) bench_write_trace = argv[++i];
+		else if (argv[i][0] != '-' && nr_benches < 4) benches[nr_benches++] = argv[i];
+		else usage(argv[0]);
+	}
+	if (bench_max_threads < 1) bench_max_threads = 1;
+	if (bench_max_threads > HOSTED_MAX_CPUS - 1) bench_max_threads = HOSTED_MAX_CPUS - 1;
+	if (bench_initial_pages > bench_max_pages || bench_initial_pages < 4096 || bench_seed == 0) usage(argv[0]);
+
+	hosted_init(bench_initial_pages, bench_max_pages);
+
+	if (nr_benches == 0)
+	{
+		bench_pages();
+		bench_xmalloc();
+		bench_contention();
+		bench_replay();
+		return 0;
+	}
+	for (i = 0; i < nr_benches; i++)
+	{
+		if (strcmp(benches[i], "pages") == 0) bench_pages();
+		else if (strcmp(benches[i], "xmalloc") == 0) bench_xmalloc();
+		else if (strcmp(benches[i], "contention") == 0) bench_contention();
+		else if (strcmp(benches[i], "replay") == 0) bench_replay();
+		else usage(argv[0]);
+	}
+	return 0;
+}
@@ -0,0 +1,374 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Stub hypervisor layer for the hosted build. It is compiled with the kernel
+ * headers and stands in for the parts of the kernel that the page allocator
+ * and xmalloc expect: the hypercall page, the per-CPU block addressed through
+ * %gs, the start of day memory layout and a few services.
+ *
+ * Guest physical memory is a range of host virtual memory starting at _text,
+ * and machine frames are identical to physical frames. memory_op populates
+ * and releases frames within that range, so reservation growth, superpage
+ * extents and ballooning run through the real code paths.
+ */
+
+#include <os/config.h>
+#include <os/kernel.h>
+#include <os/hypervisor.h>
+#include <os/mm.h>
+#include <os/xmalloc.h>
+#include <os/sched.h>
+#include <os/smp.h>
+#include <os/xenbus.h>
+#include <os/balloon.h>
+#include <os/mmstats.h>
+#include <public/memory.h>
+#include <errno.h>
+#include "hosted.h"
+
+int smp_init_completed = 1;
+
+struct cpu_private percpu[MAX_VIRT_CPUS];
+
+static struct thread hosted_threads[MAX_VIRT_CPUS];
+
+union start_info_union start_info_union;
+
+static shared_info_t hosted_shared_info;
+
+shared_info_t *HYPERVISOR_shared_info = &hosted_shared_info;
+
+static unsigned long hosted_initial_pages;
+
+static unsigned long hosted_max_pages;
+
+static unsigned long hosted_reservation;
+
+/*
+ * Every hypercall slot loads its number and jumps to a common entry, which
+ * preserves everything the hypercall macros do not list as clobbered.
+ */
+asm(
+	".pushsection .text\n"
+	".balign 4096\n"
+	".globl hypercall_page\n"
+	"hypercall_page:\n"
+	".set hosted_op, 0\n"
+	".rept 128\n"
+	"movl $hosted_op, %eax\n"
+	"jmp hosted_hypercall_entry\n"
+	".balign 32, 0xcc\n"
+	".set hosted_op, hosted_op + 1\n"
+	".endr\n"
+	"hosted_hypercall_entry:\n"
+	"push %rbp\n"
+	"mov %rsp, %rbp\n"
+	"push %rcx\n"
+	"push %r8\n"
+	"push %r9\n"
+	"push %r10\n"
+	"push %r11\n"
+	"and $-16, %rsp\n"
+	"sub $256, %rsp\n"
+	"movdqu %xmm0, 0(%rsp)\n"
+	"movdqu %xmm1, 16(%rsp)\n"
+	"movdqu %xmm2, 32(%rsp)\n"
+	"movdqu %xmm3, 48(%rsp)\n"
+	"movdqu %xmm4, 64(%rsp)\n"
+	"movdqu %xmm5, 80(%rsp)\n"
+	"movdqu %xmm6, 96(%rsp)\n"
+	"movdqu %xmm7, 112(%rsp)\n"
+	"movdqu %xmm8, 128(%rsp)\n"
+	"movdqu %xmm9, 144(%rsp)\n"
+	"movdqu %xmm10, 160(%rsp)\n"
+	"movdqu %xmm11, 176(%rsp)\n"
+	"movdqu %xmm12, 192(%rsp)\n"
+	"movdqu %xmm13, 208(%rsp)\n"
+	"movdqu %xmm14, 224(%rsp)\n"
+	"movdqu %xmm15, 240(%rsp)\n"
+	"mov %r10, %rcx\n"
+	"mov %rax, %r9\n"
+	"call hosted_hypercall\n"
+	"movdqu 0(%rsp), %xmm0\n"
+	"movdqu 16(%rsp), %xmm1\n"
+	"movdqu 32(%rsp), %xmm2\n"
+	"movdqu 48(%rsp), %xmm3\n"
+	"movdqu 64(%rsp), %xmm4\n"
+	"movdqu 80(%rsp), %xmm5\n"
+	"movdqu 96(%rsp), %xmm6\n"
+	"movdqu 112(%rsp), %xmm7\n"
+	"movdqu 128(%rsp), %xmm8\n"
+	"movdqu 144(%rsp), %xmm9\n"
+	"movdqu 160(%rsp), %xmm10\n"
+	"movdqu 176(%rsp), %xmm11\n"
+	"movdqu 192(%rsp), %xmm12\n"
+	"movdqu 208(%rsp), %xmm13\n"
+	"movdqu 224(%rsp), %xmm14\n"
+	"movdqu 240(%rsp), %xmm15\n"
+	"lea -40(%rbp), %rsp\n"
+	"pop %r11\n"
+	"pop %r10\n"
+	"pop %r9\n"
+	"pop %r8\n"
+	"pop %rcx\n"
+	"pop %rbp\n"
+	"ret\n"
+	".popsection\n");
+
+static long hosted_memory_op(int cmd, void *arg)
+{
+	struct xen_memory_reservation *reservation = arg;
+	unsigned long *extents, pages, i;
+
+	switch (cmd)
+	{
+	case XENMEM_maximum_reservation:
+	case XENMEM_maximum_ram_page:
+		return hosted_max_pages;
+	case XENMEM_current_reservation:
+		return hosted_reservation;
+	case XENMEM_populate_physmap:
+		extents = reservation->extent_start.p;
+		pages = 1UL << reservation->extent_order;
+		for (i = 0; i < reservation->nr_extents; i++)
+		{
+			if (hosted_reservation + pages > hosted_max_pages || extents[i] + pages > hosted_max_pages) break;
+			host_populate(pfn_to_virtu(extents[i]), pages << PAGE_SHIFT);
+			atomic_exchange_add_x86_64(&hosted_reservation, pages);
+		}
+		return i;
+	case XENMEM_decrease_reservation:
+		extents = reservation->extent_start.p;
+		pages = 1UL << reservation->extent_order;
+		for (i = 0; i < reservation->nr_extents; i++)
+		{
+			host_release(pfn_to_virtu(extents[i]), pages << PAGE_SHIFT);
+			atomic_exchange_add_x86_64(&hosted_reservation, -pages);
+		}
+		return i;
+	default:
+		return -ENOSYS;
+	}
+}
+
+USED long hosted_hypercall(long a1, long a2, long a3, long a4, long a5, long op)
+{
+	multicall_entry_t *call;
+	long i;
+
+	switch (op)
+	{
+	case __HYPERVISOR_memory_op:
+		return hosted_memory_op(a1, (void *)a2);
+	case __HYPERVISOR_mmu_update:
+	case __HYPERVISOR_mmuext_op:
+	case __HYPERVISOR_update_va_mapping:
+		return 0;
+	case __HYPERVISOR_sched_op:
+		/* Spinlock waiters yield to the host scheduler */
+		host_yield();
+		return 0;
+	case __HYPERVISOR_multicall:
+		call = (multicall_entry_t *)a1;
+		for (i = 0; i < a2; i++)
+		{
+			call[i].result = 0;
+		}
+		return 0;
+	default:
+		return -ENOSYS;
+	}
+}
+
+/* The first pages stand in for the kernel image and hold the initial p2m */
+void arch_init_mm(unsigned long *start_pfn_p, unsigned long *max_pfn_p)
+{
+	unsigned long pfn;
+
+	phys_to_machine_mapping = (unsigned long *)pfn_to_virt(1);
+	for (pfn = 0; pfn < hosted_initial_pages; pfn++)
+	{
+		phys_to_machine_mapping[pfn] = pfn;
+	}
+	*start_pfn_p = 1 + PFN_UP(hosted_initial_pages * sizeof(unsigned long));
+	*max_pfn_p = hosted_initial_pages;
+}
+
+/* Frames are mapped by the host as soon as they are populated */
+int build_pagetable(unsigned long start_address, unsigned long end_address, pfn_alloc_env_t *env_pfn, pfn_alloc_env_t *env_npf)
+{
+	return 1;
+}
+
+int build_superpage_pagetable(unsigned long start_address, unsigned long end_address, pfn_alloc_env_t *env_pfn, pfn_alloc_env_t *env_npf)
+{
+	return 1;
+}
+
+long pfn_linear_alloc(pfn_alloc_env_t *env, unsigned long addr)
+{
+	return env->pfn++;
+}
+
+long pfn_alloc_alloc(pfn_alloc_env_t *env, unsigned long addr)
+{
+	return -1;
+}
+
+void printk(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	host_vprintf(fmt, args);
+	va_end(args);
+}
+
+void flush(void)
+{
+}
+
+void poweroff(void)
+{
+	host_abort();
+}
+
+void backtrace_and_poweroff(void)
+{
+	host_abort();
+}
+
+void preempt_schedule(void)
+{
+}
+
+/* Threads waiting for the reservation owner just yield to the host */
+void block(struct thread *thread)
+{
+}
+
+void wake(struct thread *thread)
+{
+}
+
+void schedule(void)
+{
+	host_yield();
+}
+
+struct thread *create_thread(char *name, void (*function), int flags, void *data)
+{
+	return NULL;
+}
+
+#ifdef ENABLE_BALLOON
+void balloon_kick(unsigned long free_pages)
+{
+}
+#endif
+
+char *xenbus_read(xenbus_transaction_t xbt, const char *path, char **value)
+{
+	return "ENOENT";
+}
+
+char *xenbus_watch_path(xenbus_transaction_t xbt, char *path, char *token)
+{
+	return NULL;
+}
+
+char *xenbus_read_watch(char *token)
+{
+	return NULL;
+}
+
+char *xenbus_rm(xenbus_transaction_t xbt, const char *path)
+{
+	return NULL;
+}
+
+char *xenbus_printf(xenbus_transaction_t xbt, char *node, char *path, char *fmt, ...)
+{
+	return NULL;
+}
+
+void hosted_attach_cpu(int cpu)
+{
+	BUG_ON(cpu >= MAX_VIRT_CPUS);
+	percpu[cpu].irqcount = -1;
+	percpu[cpu].cpunumber = cpu;
+	percpu[cpu].current_thread = &hosted_threads[cpu];
+	hosted_threads[cpu].id = cpu;
+	host_set_gs(&percpu[cpu]);
+}
+
+void hosted_init(unsigned long initial_pages, unsigned long max_pages)
+{
+	BUG_ON((unsigned long)&_text != HOSTED_VIRT_START);
+	hosted_initial_pages = initial_pages;
+	hosted_max_pages = max_pages;
+	hosted_reservation = initial_pages;
+	host_map_arena(HOSTED_VIRT_START, max_pages << PAGE_SHIFT, initial_pages << PAGE_SHIFT);
+	hosted_attach_cpu(0);
+	init_mm("");
+}
+
+void *hosted_alloc_pages(int n)
+{
+	return (void *)allocate_pages(n, DATA_VM);
+}
+
+void hosted_free_pages(void *pointer, int n)
+{
+	deallocate_pages(pointer, n, DATA_VM);
+}
+
+void *hosted_xmalloc(unsigned long size)
+{
+	return xmalloc_align(size, 16);
+}
+
+void hosted_xfree(void *pointer)
+{
+	xfree(pointer);
+}
+
+void hosted_read_stats(struct hosted_stats *stats)
+{
+	unsigned long free_bulk_pages;
+#ifdef ENABLE_MM_STATS
+	struct mm_stats mm;
+	int kind;
+#endif
+
+	memset(stats, 0, sizeof(*stats));
+	stats->reservation_pages = hosted_reservation;
+	page_allocator_stats(&stats->free_pages, &free_bulk_pages, &stats->cached_pages, &stats->largest_free_extent);
+	if (stats->free_pages > 0)
+	{
+		stats->fragmentation = (stats->free_pages - stats->largest_free_extent) * 1000 / stats->free_pages;
+	}
+	xmalloc_stats(&stats->xmalloc_free_chunks, &stats->xmalloc_free_bytes, &stats->xmalloc_slabs);
+#ifdef ENABLE_MM_STATS
+	mm_stats_read(&mm);
+	for (kind = 0; kind < MM_STAT_KINDS; kind++)
+	{
+		stats->lock_waits += mm.counters[kind].lock_waits;
+		stats->lock_wait_cycles += mm.counters[kind].lock_wait_cycles;
+	}
+#endif
+}
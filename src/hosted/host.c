@@ -0,0 +1,83 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Linux services behind the stub hypervisor layer. Guest memory that is not
+ * part of the reservation is kept inaccessible, so a stray access to a frame
+ * that was never populated or has been released faults immediately.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <asm/prctl.h>
+#include "hosted.h"
+
+void host_vprintf(const char *fmt, va_list args)
+{
+	vfprintf(stderr, fmt, args);
+}
+
+void host_map_arena(unsigned long start, unsigned long size, unsigned long populated)
+{
+	void *arena = mmap((void *)start, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+	if (arena != (void *)start)
+	{
+		perror("mmap");
+		exit(1);
+	}
+	host_populate(start, populated);
+}
+
+void host_populate(unsigned long start, unsigned long size)
+{
+	if (mprotect((void *)start, size, PROT_READ | PROT_WRITE) != 0)
+	{
+		perror("mprotect");
+		abort();
+	}
+}
+
+void host_release(unsigned long start, unsigned long size)
+{
+	madvise((void *)start, size, MADV_DONTNEED);
+	mprotect((void *)start, size, PROT_NONE);
+}
+
+void host_set_gs(void *base)
+{
+	if (syscall(SYS_arch_prctl, ARCH_SET_GS, base) != 0)
+	{
+		perror("arch_prctl");
+		exit(1);
+	}
+}
+
+void host_yield(void)
+{
+	sched_yield();
+}
+
+void host_abort(void)
+{
+	fflush(stdout);
+	abort();
+}
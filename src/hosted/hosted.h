@@ -0,0 +1,65 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Interface between the allocators, which are built with the kernel headers,
+ * and the Linux side of the hosted build. Only plain C types cross it.
+ */
+
+#ifndef _HOSTED_H_
+#define _HOSTED_H_
+
+#include <stdarg.h>
+
+/* Must match the _text symbol defined at link time */
+#define HOSTED_VIRT_START 0x200000000000UL
+
+#define HOSTED_MAX_CPUS 64
+
+struct hosted_stats
+{
+	unsigned long reservation_pages;
+	unsigned long free_pages;
+	unsigned long cached_pages;
+	unsigned long largest_free_extent;
+	unsigned long fragmentation;
+	unsigned long xmalloc_free_chunks;
+	unsigned long xmalloc_free_bytes;
+	unsigned long xmalloc_slabs;
+	unsigned long lock_waits;
+	unsigned long lock_wait_cycles;
+};
+
+/* Provided by the host side */
+void host_vprintf(const char *fmt, va_list args);
+void host_map_arena(unsigned long start, unsigned long size, unsigned long populated);
+void host_populate(unsigned long start, unsigned long size);
+void host_release(unsigned long start, unsigned long size);
+void host_set_gs(void *base);
+void host_yield(void);
+void host_abort(void);
+
+/* Provided by the allocator side */
+void hosted_init(unsigned long initial_pages, unsigned long max_pages);
+void hosted_attach_cpu(int cpu);
+void *hosted_alloc_pages(int n);
+void hosted_free_pages(void *pointer, int n);
+void *hosted_xmalloc(unsigned long size);
+void hosted_xfree(void *pointer);
+void hosted_read_stats(struct hosted_stats *stats);
+
+#endif
@@ -0,0 +1,280 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Decodes the binary scheduler trace that a guest prints on its console
+ * when "binary" is written to control/sched-trace. Reads a console log from
+ * the named file or stdin, takes the last complete dump in it and prints on
+ * stdout, one JSON object per line, the latency histograms of every CPU in
+ * nanoseconds followed by the events of all CPUs merged in time order.
+ *
+ *   schedtrace [--no-events] [console.log]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The layout below must match include/os/schedtrace.h */
+#define SCHED_TRACE_MAGIC 0x43525453
+#define SCHED_TRACE_VERSION 2
+#define SCHED_TRACE_PREFIX "schedtrace: "
+#define SCHED_TRACE_MAX_BUCKETS 64
+
+struct sched_trace_event
+{
+	uint64_t tsc;
+	uint8_t type;
+	uint8_t cpu;
+	uint16_t thread;
+	uint16_t other;
+	uint16_t arg;
+};
+
+struct sched_trace_header
+{
+	uint32_t magic;
+	uint16_t version;
+	uint16_t nr_cpus;
+	uint32_t entries;
+	uint32_t buckets;
+};
+
+struct sched_trace_cpu
+{
+	uint64_t tsc_timestamp;
+	uint64_t system_timestamp;
+	uint32_t tsc_to_nsec_mul;
+	int32_t tsc_shift;
+	uint32_t cpu;
+	uint32_t nr_events;
+	uint64_t dropped;
+	uint64_t *wakeup_hist;
+	uint64_t *wait_hist;
+	struct sched_trace_event *events;
+};
+
+struct trace_event
+{
+	int64_t time;
+	struct sched_trace_event *event;
+};
+
+static const char *type_names[] = { "switch", "wake", "block", "migrate" };
+
+static unsigned char *data;
+static size_t data_len, data_size;
+
+static void append(const char *hex)
+{
+	unsigned int byte;
+
+	while (sscanf(hex, "%2x", &byte) == 1)
+	{
+		if (data_len == data_size)
+		{
+			data_size = data_size ? 2 * data_size : 65536;
+			data = realloc(data, data_size);
+			if (data == NULL)
+			{
+				perror("realloc");
+				exit(1);
+			}
+		}
+		data[data_len++] = byte;
+		hex += 2;
+	}
+}
+
+/* Collects the payload of the last dump between the begin and end markers */
+static int read_dump(FILE *in)
+{
+	char *line = NULL, *payload;
+	size_t len = 0;
+	int inside = 0, complete = 0;
+
+	while (getline(&line, &len, in) != -1)
+	{
+		payload = strstr(line, SCHED_TRACE_PREFIX);
+		if (payload == NULL)
+		{
+			continue;
+		}
+		payload += strlen(SCHED_TRACE_PREFIX);
+		payload[strcspn(payload, "\r\n")] = '\0';
+
+		if (!strcmp(payload, "begin"))
+		{
+			inside = 1;
+			data_len = 0;
+		}
+		else if (!strcmp(payload, "end"))
+		{
+			complete = inside;
+			inside = 0;
+		}
+		else if (inside)
+		{
+			append(payload);
+		}
+	}
+
+	free(line);
+	return complete;
+}
+
+static const void *take(size_t *offset, size_t len)
+{
+	const void *p = data + *offset;
+
+	if (*offset + len > data_len)
+	{
+		fprintf(stderr, "schedtrace: truncated dump\n");
+		exit(1);
+	}
+	*offset += len;
+	return p;
+}
+
+static uint64_t scale(const struct sched_trace_cpu *cpu, uint64_t cycles)
+{
+	if (cpu->tsc_shift < 0)
+	{
+		cycles >>= -cpu->tsc_shift;
+	}
+	else
+	{
+		cycles <<= cpu->tsc_shift;
+	}
+	return (uint64_t)(((unsigned __int128)cycles * cpu->tsc_to_nsec_mul) >> 32);
+}
+
+/* Puts an event on the hypervisor's system time */
+static int64_t system_time(const struct sched_trace_cpu *cpu, uint64_t tsc)
+{
+	if (tsc >= cpu->tsc_timestamp)
+	{
+		return cpu->system_timestamp + scale(cpu, tsc - cpu->tsc_timestamp);
+	}
+	return cpu->system_timestamp - scale(cpu, cpu->tsc_timestamp - tsc);
+}
+
+static void print_hist(const struct sched_trace_cpu *cpu, const char *name, const uint64_t *hist, uint32_t buckets)
+{
+	uint32_t i;
+	int first = 1;
+
+	printf("{\"cpu\": %u, \"histogram\": \"%s\", \"buckets\": [", cpu->cpu, name);
+	for (i = 0; i < buckets; i++)
+	{
+		if (hist[i] != 0)
+		{
+			printf("%s{\"below_ns\": %lu, \"count\": %lu}", first ? "" : ", ", 1UL << i, hist[i]);
+			first = 0;
+		}
+	}
+	printf("]}\n");
+}
+
+static int compare_events(const void *a, const void *b)
+{
+	const struct trace_event *x = a, *y = b;
+	return x->time < y->time ? -1 : x->time > y->time;
+}
+
+int main(int argc, char **argv)
+{
+	const struct sched_trace_header *header;
+	struct sched_trace_cpu *cpus;
+	struct trace_event *events;
+	size_t offset, nr_events, n;
+	int print_events = 1;
+	FILE *in = stdin;
+	uint32_t i, j;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--no-events"))
+		{
+			print_events = 0;
+		}
+		else if ((in = fopen(argv[i], "r")) == NULL)
+		{
+			perror(argv[i]);
+			return 1;
+		}
+	}
+
+	if (!read_dump(in))
+	{
+		fprintf(stderr, "schedtrace: no complete dump found\n");
+		return 1;
+	}
+
+	offset = 0;
+	header = take(&offset, sizeof(*header));
+	if (header->magic != SCHED_TRACE_MAGIC || header->version != SCHED_TRACE_VERSION || header->buckets > SCHED_TRACE_MAX_BUCKETS)
+	{
+		fprintf(stderr, "schedtrace: not a version %d trace\n", SCHED_TRACE_VERSION);
+		return 1;
+	}
+
+	cpus = calloc(header->nr_cpus, sizeof(*cpus));
+	nr_events = 0;
+	for (i = 0; i < header->nr_cpus; i++)
+	{
+		memcpy(&cpus[i], take(&offset, offsetof(struct sched_trace_cpu, wakeup_hist)), offsetof(struct sched_trace_cpu, wakeup_hist));
+		cpus[i].wakeup_hist = (uint64_t *)take(&offset, header->buckets * sizeof(uint64_t));
+		cpus[i].wait_hist = (uint64_t *)take(&offset, header->buckets * sizeof(uint64_t));
+		cpus[i].events = (struct sched_trace_event *)take(&offset, cpus[i].nr_events * sizeof(struct sched_trace_event));
+		nr_events += cpus[i].nr_events;
+
+		printf("{\"cpu\": %u, \"events\": %u, \"dropped\": %lu}\n", cpus[i].cpu, cpus[i].nr_events, cpus[i].dropped);
+		print_hist(&cpus[i], "wakeup_latency", cpus[i].wakeup_hist, header->buckets);
+		print_hist(&cpus[i], "run_queue_wait", cpus[i].wait_hist, header->buckets);
+	}
+
+	if (!print_events)
+	{
+		return 0;
+	}
+
+	events = calloc(nr_events, sizeof(*events));
+	n = 0;
+	for (i = 0; i < header->nr_cpus; i++)
+	{
+		for (j = 0; j < cpus[i].nr_events; j++)
+		{
+			events[n].event = &cpus[i].events[j];
+			events[n].time = system_time(&cpus[i], cpus[i].events[j].tsc);
+			n++;
+		}
+	}
+	qsort(events, nr_events, sizeof(*events), compare_events);
+
+	for (n = 0; n < nr_events; n++)
+	{
+		printf("{\"time_ns\": %ld, \"cpu\": %u, \"type\": \"%s\", \"thread\": %u, \"other\": %u, \"arg\": %u}\n",
+			events[n].time, events[n].event->cpu, events[n].event->type < 4 ? type_names[events[n].event->type] : "unknown",
+			events[n].event->thread, events[n].event->other, events[n].event->arg);
+	}
+
+	return 0;
+}
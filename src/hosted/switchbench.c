@@ -0,0 +1,141 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Measures the FPU part of a context switch as schedule() does it: save
+ * the state of prev into its area, then restore next from its own, for two
+ * threads taking turns. Each method runs twice, once with the xmm registers
+ * dirtied between switches, as kernel code built with -mfpmath=sse does,
+ * and once with them left alone. Results are printed on stdout as one JSON
+ * object per line, in TSC cycles per switch.
+ *
+ *   fxsave    fxsave/fxrstor, what schedule() did before XSAVE support
+ *   xsave     xsave/xrstor of x87, SSE and AVX state
+ *   xsaveopt  xsaveopt/xrstor, as fpu_save() and fpu_restore() do now
+ *
+ *   switchbench [--iterations N]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <cpuid.h>
+
+/* x87, SSE and AVX, the components fpu_init() enables */
+#define SWITCH_XSTATE_MASK 0x7
+
+#define SWITCH_AREA_SIZE 4096
+
+enum { SWITCH_FXSAVE, SWITCH_XSAVE, SWITCH_XSAVEOPT };
+
+static const char *switch_names[] = { "fxsave", "xsave", "xsaveopt" };
+
+static unsigned long switch_iterations = 1000000;
+
+static uint8_t switch_areas[2][SWITCH_AREA_SIZE] __attribute__((aligned(64)));
+
+static inline uint64_t rdtsc(void)
+{
+	uint32_t lo, hi;
+	__asm__ __volatile__("lfence; rdtsc" : "=a" (lo), "=d" (hi));
+	return lo | ((uint64_t)hi << 32);
+}
+
+static inline void switch_save(int method, void *area)
+{
+	uint32_t lo = SWITCH_XSTATE_MASK, hi = 0;
+
+	if (method == SWITCH_FXSAVE)
+		__asm__ __volatile__("fxsave (%0)" : : "r" (area) : "memory");
+	else if (method == SWITCH_XSAVEOPT)
+		__asm__ __volatile__("xsaveopt (%0)" : : "r" (area), "a" (lo), "d" (hi) : "memory");
+	else
+		__asm__ __volatile__("xsave (%0)" : : "r" (area), "a" (lo), "d" (hi) : "memory");
+}
+
+static inline void switch_restore(int method, void *area)
+{
+	uint32_t lo = SWITCH_XSTATE_MASK, hi = 0;
+
+	if (method == SWITCH_FXSAVE)
+		__asm__ __volatile__("fxrstor (%0)" : : "r" (area) : "memory");
+	else
+		__asm__ __volatile__("xrstor (%0)" : : "r" (area), "a" (lo), "d" (hi) : "memory");
+}
+
+static void switch_run(int method, int dirty)
+{
+	uint64_t start, cycles;
+	unsigned long i;
+	int prev = 0;
+
+	/* Zeroed areas with a valid MXCSR, as create_thread() sets them up */
+	memset(switch_areas, 0, sizeof(switch_areas));
+	*(uint32_t *)&switch_areas[0][24] = 0x1f80;
+	*(uint32_t *)&switch_areas[1][24] = 0x1f80;
+	switch_restore(method, switch_areas[prev]);
+
+	start = rdtsc();
+	for (i = 0; i < switch_iterations; i++)
+	{
+		if (dirty)
+			__asm__ __volatile__("movq %0, %%xmm0" : : "r" (i) : "xmm0");
+		switch_save(method, switch_areas[prev]);
+		prev ^= 1;
+		switch_restore(method, switch_areas[prev]);
+	}
+	cycles = rdtsc() - start;
+
+	printf("{\"bench\":\"switch\",\"method\":\"%s\",\"dirty\":%d,\"switches\":%lu,\"cycles_per_switch\":%.1f}\n",
+		switch_names[method], dirty, switch_iterations, (double)cycles / switch_iterations);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int eax, ebx, ecx, edx;
+	int i, xsave, xsaveopt;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) switch_iterations = strtoul(argv[++i], NULL, 0);
+		else
+		{
+			fprintf(stderr, "usage: %s [--iterations N]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	__cpuid(1, eax, ebx, ecx, edx);
+	/* XSAVE and OSXSAVE, and AVX so that the mask matches the guest's */
+	xsave = (ecx & (3U << 26)) == (3U << 26) && (ecx & (1U << 28));
+	xsaveopt = 0;
+	if (xsave)
+	{
+		__cpuid_count(0xd, 1, eax, ebx, ecx, edx);
+		xsaveopt = eax & 1;
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		switch_run(SWITCH_FXSAVE, i);
+		if (xsave) switch_run(SWITCH_XSAVE, i);
+		if (xsaveopt) switch_run(SWITCH_XSAVEOPT, i);
+	}
+	return 0;
+}
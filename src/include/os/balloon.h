@@ -0,0 +1,32 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _BALLOON_H_
+#define _BALLOON_H_
+
+/* Free page watermarks, in pages */
+#define BALLOON_LOW_WATERMARK 8192
+#define BALLOON_HIGH_WATERMARK 32768
+
+/* Largest amount of memory populated or released in one step, in pages */
+#define BALLOON_STEP_PAGES 65536
+
+#define BALLOON_POLL_MS 1000
+
+void balloon_kick(unsigned long free_pages);
+
+#endif
@@ -7,4 +7,11 @@
 #define set_map(_map, _s) _map[(_s)/ENTRIES_PER_MAPWORD] |= (1UL<<((_s)&(ENTRIES_PER_MAPWORD-1)))
 #define clear_map(_map, _s) _map[(_s)/ENTRIES_PER_MAPWORD] &= ~(1UL<<((_s)&(ENTRIES_PER_MAPWORD-1)))
 
+/* Searches return the end of the range when nothing is found */
+unsigned long bitmap_find_next_zero(const unsigned long *map, unsigned long start, unsigned long end);
+unsigned long bitmap_find_next_set(const unsigned long *map, unsigned long start, unsigned long end);
+unsigned long bitmap_find_zero_run(const unsigned long *map, unsigned long start, unsigned long end, unsigned long n);
+void bitmap_set_range(unsigned long *map, unsigned long start, unsigned long n);
+void bitmap_clear_range(unsigned long *map, unsigned long start, unsigned long n);
+
 #endif
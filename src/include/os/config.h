@@ -39,6 +39,36 @@
 /* Java support requires libraries from the packages repository */ 
 // #define ENABLE_JAVA
 
+/* Uses the buddy page allocator instead of scanning the allocation bitmap */
+#define ENABLE_BUDDY_ALLOCATOR
+
+/* Populates memory in 2MB extents and maps them with superpages when Xen allows */
+#define ENABLE_SUPERPAGES
+
+/* Runs a balloon thread that populates memory ahead of demand and follows memory/target */
+#define ENABLE_BALLOON
+
+/* Keeps allocator counters, histograms and call-site samples, dumped by writing control/mm-stats */
+#define ENABLE_MM_STATS
+
+/* Stops the periodic tick; the one-shot timer is only armed for sleepers and contended timeslices */
+#define ENABLE_TICKLESS
+
+/* Recycle the structs, stacks and FP save areas of dead threads */
+#define ENABLE_THREAD_CACHE
+
+/* Size each thread's timeslice from how long it usually runs before blocking */
+#define ENABLE_ADAPTIVE_TIMESLICE
+
+/* Records scheduler events and wakeup latencies per CPU, dumped by writing control/sched-trace */
+#define ENABLE_SCHED_TRACE
+
+/* Spinlock waiters block in the hypervisor once the lock holder looks preempted, and are kicked by the unlocker */
+#define ENABLE_PV_SPINLOCKS
+
+/* Counts acquisitions, contention and hold times of registered spinlocks, dumped by writing control/lock-stats */
+// #define ENABLE_SPINLOCK_STATS
+
 /* Supports the standard maths library */
 // #define ENABLE_FDLIBM
 
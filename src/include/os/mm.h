@@ -170,10 +170,21 @@ extern unsigned long mfn_zero;
 #define DATA_VM 3
 #define PAGE_FRAME_VM 4
 
+#define INVALID_P2M_ENTRY (~0UL)
+
+#define SUPERPAGE_ORDER 9
+#define SUPERPAGE_PAGES (1UL << SUPERPAGE_ORDER)
+#define SUPERPAGE_SIZE (1UL << L2_PAGETABLE_SHIFT)
+
 void init_mm(char *cmd_line);
 void arch_init_mm(unsigned long* start_pfn_p, unsigned long* max_pfn_p);
 unsigned long allocate_ondemand(unsigned long n, unsigned long alignment);
 unsigned long allocate_pages(int n, int type);
+unsigned long allocate_huge_pages(int n);
+unsigned long free_page_count(void);
+void page_allocator_stats(unsigned long *free_pages, unsigned long *free_bulk_pages, unsigned long *cached_pages, unsigned long *largest_extent);
+long grow_reservation(unsigned long n);
+long shrink_reservation(unsigned long n);
 void deallocate_pages(void *pointer, int n, int type);
 unsigned long alloc_pages(int order);
 #define alloc_page() alloc_pages(0)
@@ -201,7 +212,9 @@ struct pfn_alloc_env {
 long pfn_linear_alloc(pfn_alloc_env_t *env, unsigned long addr);
 long pfn_alloc_alloc(pfn_alloc_env_t *env, unsigned long addr);
 int build_pagetable(unsigned long start_address, unsigned long end_address, pfn_alloc_env_t *env_pfn, pfn_alloc_env_t *env_npf);
+int build_superpage_pagetable(unsigned long start_address, unsigned long end_address, pfn_alloc_env_t *env_pfn, pfn_alloc_env_t *env_npf);
 void demolish_pagetable(unsigned long start_address, unsigned long end_address);
+void pagetable_stats(unsigned long *hypercalls, unsigned long *frames, unsigned long *pages_mapped);
 unsigned long maximum_ram_page(void);
 extern int unmap_page(unsigned long addr);
 extern int remap_page(unsigned long addr);
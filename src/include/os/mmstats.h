@@ -0,0 +1,88 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _MMSTATS_H_
+#define _MMSTATS_H_
+
+#include <os/config.h>
+#include <os/spinlock.h>
+
+#define MM_STAT_PAGES 0
+#define MM_STAT_XMALLOC 1
+#define MM_STAT_KINDS 2
+
+/* Bucket i counts requests of up to 2^i bytes */
+#define MM_STATS_BUCKETS 24
+
+/* Call sites are tracked in a small table and sampled one call in MM_STATS_SITE_SAMPLE */
+#define MM_STATS_SITES 64
+#define MM_STATS_SITE_PROBES 8
+#define MM_STATS_SITE_SAMPLE 32
+
+struct mm_stat_counters
+{
+	unsigned long calls;
+	unsigned long bytes;
+	unsigned long failures;
+	unsigned long frees;
+	unsigned long freed_bytes;
+	unsigned long lock_waits;
+	unsigned long lock_wait_cycles;
+	unsigned long histogram[MM_STATS_BUCKETS];
+};
+
+struct mm_stat_site
+{
+	unsigned long site;
+	unsigned long calls;
+	unsigned long bytes;
+};
+
+struct mm_stats
+{
+	struct mm_stat_counters counters[MM_STAT_KINDS];
+	unsigned long free_pages;
+	unsigned long free_bulk_pages;
+	unsigned long cached_pages;
+	unsigned long largest_free_extent;
+	unsigned long fragmentation;
+	unsigned long xmalloc_free_chunks;
+	unsigned long xmalloc_free_bytes;
+	unsigned long xmalloc_slabs;
+};
+
+#ifdef ENABLE_MM_STATS
+
+void mm_stat_alloc(int kind, unsigned long bytes, void *site);
+void mm_stat_free(int kind, unsigned long bytes);
+void mm_stat_spin_lock(spinlock_t *lock, int kind);
+unsigned long mm_stat_spin_lock_irqsave(spinlock_t *lock, int kind);
+void mm_stats_read(struct mm_stats *stats);
+int mm_stats_read_sites(int kind, struct mm_stat_site *sites, int max);
+void mm_stats_dump(void);
+void mm_stats_publish(void);
+
+#else
+
+#define mm_stat_alloc(kind, bytes, site) do { } while (0)
+#define mm_stat_free(kind, bytes) do { } while (0)
+#define mm_stat_spin_lock(lock, kind) spin_lock(lock)
+#define mm_stat_spin_lock_irqsave(lock, kind) os_spin_lock_irqsave(lock)
+
+#endif
+
+#endif
@@ -19,13 +19,25 @@
 #define SRC_INCLUDE_THREADS_MUTEXES_H_
 
 #include <os/spinlock.h>
+#include <os/list.h>
 
+/* Spins this many times for an owner that is running elsewhere before
+ * going to sleep */
+#define MUTEX_SPIN_LIMIT 1024
+
+/* A sleeping mutex. The owner is taken and released with an atomic
+ * operation; lock protects the FIFO of waiters, which is only touched once
+ * the mutex turns out to be contended */
 typedef struct mutex_t
 {
-	spinlock_t * lock;
+	struct thread * volatile owner;
+	volatile int nr_waiters;
+	spinlock_t lock;
+	struct list_head waiters;
 	char name[64];
 } mutex_t;
 
+void mutex_init(mutex_t *m);
 mutex_t* mutex_create(void);
 void mutex_lock(mutex_t *m);
 void mutex_unlock(mutex_t *m);
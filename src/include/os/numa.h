@@ -0,0 +1,41 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _NUMA_H_
+#define _NUMA_H_
+
+#include <os/kernel.h>
+#include <os/hypervisor.h>
+
+#define MAX_NUMA_NODES 8
+
+#define MAX_NUMA_RANGES 16
+
+extern int numa_nr_nodes;
+
+extern unsigned char numa_cpu_to_node[MAX_VIRT_CPUS];
+
+void init_numa(void);
+int numa_pfn_to_node(unsigned long pfn, unsigned long *start_pfn, unsigned long *end_pfn);
+int numa_fallback_node(int node, int n);
+
+static inline int numa_node_id(void)
+{
+	return numa_cpu_to_node[smp_processor_id()];
+}
+
+#endif
@@ -78,6 +78,7 @@ struct thread {
     struct pt_regs *regs;
     struct fp_regs *fpregs;
     uint16_t id;
+    uint16_t gen;
     int16_t appsched_id;
     int16_t stack_allocated;
     char *name;
@@ -85,9 +86,16 @@ struct thread {
     unsigned long stack_size;
     void *specific;
     u64 timeslice;
+    u64 avg_run_time;
+    int timeslice_fixed;
     u64 resched_running_time;
     u64 start_running_time;
     u64 cum_running_time;
+    unsigned long nr_switches;
+    s_time_t ready_time;          /* system time it last became ready to run, 0 while it runs or waits */
+    int ready_woken;              /* ready_time was set by a wakeup rather than a preemption */
+    int prio;
+    int policy;
     unsigned int cpu;
     int lock_count;
     unsigned long sp;
@@ -99,6 +107,10 @@ struct thread {
     void *db_data;
     unsigned long r14;
     struct tls * tls;
+    struct sleep_queue *timer;
+    u32 last_wakee;               /* handle of the last thread this one woke */
+    int woke_other;               /* woke somebody since it was switched in */
+    int wake_sync;                /* tends to block right after waking somebody */
 };
 
 extern struct list_head thread_list;
@@ -120,6 +132,18 @@ void idle_thread_fn(void *data);
 #define PTHREAD_FLAG            0x00002000     	/* Thread is a pthread */
 
 #define JOINING_FLAG            0x00004000      /* Thread is currently blocked trying to join another */
+#define CANCELLABLE_FLAG        0x00008000      /* Thread is in a wait that cancellation interrupts */
+
+#define SCHED_POLICY_OTHER      0               /* Time-sliced, shares levels with kernel threads */
+#define SCHED_POLICY_FIFO       1               /* Runs until it blocks or a higher level preempts it */
+#define SCHED_POLICY_RR         2               /* Time-sliced among threads of the same level */
+
+#define SCHED_PRIO_MIN          0
+#define SCHED_PRIO_MAX          10
+#define SCHED_PRIO_DEFAULT      ((SCHED_PRIO_MIN + SCHED_PRIO_MAX) / 2)
+
+/* SCHED_FIFO and SCHED_RR threads get a band of levels above SCHED_OTHER */
+#define SCHED_PRIO_LEVELS       (2 * (SCHED_PRIO_MAX + 1))
 
 #define DEFINE_THREAD_FLAG(flag_name, flag_set_prefix, funct_name)   \
 static unsigned long inline flag_set_prefix##funct_name(             \
@@ -149,6 +173,7 @@ DEFINE_THREAD_FLAG(CANCELLED, is_, cancelled);
 DEFINE_THREAD_FLAG(SUSPENDED, is_, suspended);
 DEFINE_THREAD_FLAG(PTHREAD, is_, pthread);
 DEFINE_THREAD_FLAG(JOINING, is_, joining);
+DEFINE_THREAD_FLAG(CANCELLABLE, in_, cancellable_wait);
 
 #define switch_threads(prev, next, last) arch_switch_threads(prev, next, last)
 
@@ -165,11 +190,24 @@ struct thread* create_idle_thread(unsigned int cpu);
 struct thread* create_vm_thread(char *name, void (*function)(void *), void *stack, unsigned long stack_size, int priority, void *data);
 
 void schedule(void);
-int join_thread(struct thread *joinee);
+int join_thread(u32 handle);
 int sched_wake_joiner(struct thread *joiner);
 u32 get_flags(struct thread *thread);
 struct thread *sched_get_thread(uint16_t);
+u32 sched_thread_handle(struct thread *thread);
+int sched_yield_to(u32 handle);
+struct thread *sched_get_thread_handle(u32 handle);
 void start_thread(struct thread *thread);
+int sched_set_priority(struct thread *thread, int policy, int prio);
+int sched_set_timeslice(struct thread *thread, u64 timeslice);
+u64 sched_get_timeslice(struct thread *thread);
+int sched_set_default_timeslice(u64 timeslice);
+u64 sched_get_default_timeslice(void);
+int sched_timers_due(void);
+s_time_t sched_next_expiry(void);
+#ifdef ENABLE_TICKLESS
+void sched_restart_tick(void);
+#endif
 void wake(struct thread *thread);
 void wake_suspended_thread(struct thread * thread);
 void block(struct thread *thread);
@@ -280,6 +318,9 @@ struct sleep_queue
     struct list_head list;
     s_time_t timeout;
     struct thread *thread;
+    u64 expires;                /* timer wheel tick, see sched.c */
+    int cpu;                    /* wheel the entry is queued on */
+    int level;
 };
 
 #define DEFINE_SLEEP_QUEUE(name)                \
@@ -328,9 +369,14 @@ void sleep_queue_del(struct sleep_queue *sq);
 
 #define MXCSRINIT 0x1f80
 
-#define save_fp_regs_asm "fxsave (%[fpr])\n\t"
+/* Bytes of FP save area per thread: struct fp_regs, or the XSAVE area when
+ * the processor has one */
+extern unsigned long fp_area_size;
 
-#define restore_fp_regs_asm "fxrstor (%[fpr])\n\t"
+void fpu_init(void);
+void fpu_init_cpu(void);
+void fpu_save(struct fp_regs *fpregs);
+void fpu_restore(struct fp_regs *fpregs);
 
 void exit_current_thread(void);
 void exit_thread(struct thread *thread);
@@ -349,9 +395,17 @@ void suspend_thread (struct thread * thread);
 
 #include <os/bug.h>
 
+/* Thread ids are 16 bits; ids below MAX_VIRT_CPUS belong to the idle threads */
+#define MAX_THREADS              65536
+
 #define STACK_SIZE_PAGE_ORDER    2
 #define STACK_SIZE               (PAGE_SIZE * (1 << STACK_SIZE_PAGE_ORDER))
 
+/* Dead threads kept for reuse, each holding on to its stack */
+#define THREAD_CACHE_SIZE        64
+
+struct thread *sched_alloc_thread(int with_stack);
+
 #define CLOBBER_LIST  \
     ,"r8","r9","r10","r11","r12","r13","r14","r15"
 #define arch_switch_threads(prev, next, last) do {                      \
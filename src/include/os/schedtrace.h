@@ -0,0 +1,97 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _SCHEDTRACE_H_
+#define _SCHEDTRACE_H_
+
+#include <os/config.h>
+#include <os/types.h>
+
+#define SCHED_TRACE_SWITCH 0            /* thread = next, other = prev, arg = 1 if prev was preempted */
+#define SCHED_TRACE_WAKE 1              /* thread = woken, other = waker, arg = run queue it went to */
+#define SCHED_TRACE_BLOCK 2             /* thread = blocked, arg = SCHED_TRACE_BLOCK_* */
+#define SCHED_TRACE_MIGRATE 3           /* thread = moved, other = from, arg = to */
+
+#define SCHED_TRACE_BLOCK_WAIT 0
+#define SCHED_TRACE_BLOCK_HIBERNATE 1
+#define SCHED_TRACE_BLOCK_SUSPEND 2
+
+/* Events kept per CPU, must be a power of two */
+#define SCHED_TRACE_ENTRIES 1024
+
+/* Bucket i counts latencies of less than 2^i ns */
+#define SCHED_TRACE_BUCKETS 40
+
+/* The binary dump is a header, then for each CPU a sched_trace_cpu_header
+ * followed by its events, oldest first. It is written to the console as hex
+ * lines prefixed with SCHED_TRACE_PREFIX, which hosted/schedtrace decodes */
+#define SCHED_TRACE_MAGIC 0x43525453    /* "STRC" */
+#define SCHED_TRACE_VERSION 2
+#define SCHED_TRACE_PREFIX "schedtrace: "
+
+struct sched_trace_event
+{
+	u64 tsc;
+	uint8_t type;
+	uint8_t cpu;
+	u16 thread;
+	u16 other;
+	u16 arg;
+};
+
+struct sched_trace_header
+{
+	u32 magic;
+	u16 version;
+	u16 nr_cpus;
+	u32 entries;
+	u32 buckets;
+};
+
+struct sched_trace_cpu_header
+{
+	u64 tsc_timestamp;
+	u64 system_timestamp;
+	u32 tsc_to_nsec_mul;
+	s32 tsc_shift;
+	u32 cpu;
+	u32 nr_events;
+	u64 dropped;
+	u64 wakeup_hist[SCHED_TRACE_BUCKETS];
+	u64 wait_hist[SCHED_TRACE_BUCKETS];
+};
+
+struct thread;
+
+#ifdef ENABLE_SCHED_TRACE
+
+void sched_trace_event(int type, struct thread *thread, int other, int arg);
+void sched_trace_wake(struct thread *thread);
+void sched_trace_switch(struct thread *prev, struct thread *next);
+void sched_trace_reset(void);
+void sched_trace_dump(void);
+void sched_trace_dump_binary(void);
+
+#else
+
+#define sched_trace_event(type, thread, other, arg) do { } while (0)
+#define sched_trace_wake(thread) do { } while (0)
+#define sched_trace_switch(prev, next) do { } while (0)
+
+#endif
+
+#endif
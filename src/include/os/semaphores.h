@@ -33,29 +33,33 @@
 #include <os/xmalloc.h>
 #include <os/mutexes.h>
 #include <os/xenbus.h>
+#include <os/list.h>
 
 #define DEFAULT_SEM_VALUE (int) 0
 
-typedef struct semaphore_list_t {
-	struct thread * thread;
-	struct semaphore_list_t * next;
-} semaphore_list_t;
+/* Results of semaphore_cancellable_pend() */
+#define SEMAPHORE_ACQUIRED 1
+#define SEMAPHORE_TIMEOUT 0
+#define SEMAPHORE_INTERRUPTED -1
 
+/* A counting semaphore. Uncontended pends and posts only touch value with
+ * an atomic operation; lock protects the FIFO of sleeping waiters, which
+ * live on the stacks of the threads waiting */
 typedef struct semaphore_t {
-	int value;
-	mutex_t * mutex;
-	semaphore_list_t * head;
+	volatile int value;
+	volatile int nr_waiters;
+	spinlock_t lock;
+	struct list_head waiters;
 } semaphore_t;
 
+void semaphore_init(semaphore_t *sem, int value);
 semaphore_t * semaphore_create(int value);
 void semaphore_pend(semaphore_t *sem);
 void semaphore_post(semaphore_t *sem);
 void semaphore_delete(semaphore_t *sem);
 int semaphore_try_pend(semaphore_t *sem);
+int semaphore_timed_pend(semaphore_t *sem, unsigned int timeout);
+int semaphore_cancellable_pend(semaphore_t *sem, unsigned int *timeout);
 int semaphore_count(semaphore_t *sem);
 
-semaphore_list_t * semaphore_list_create(struct thread * thread, semaphore_list_t * next);
-semaphore_list_t * semaphore_list_append(struct thread * thread, semaphore_list_t * head);
-semaphore_list_t * semaphore_list_delete_first(semaphore_list_t * head);
-
 #endif
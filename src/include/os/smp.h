@@ -28,8 +28,10 @@
 #ifndef _SMP_H_
 #define _SMP_H_
 
+#include <os/config.h>
 #include <os/kernel.h>
 #include <os/time.h>
+#include <public/vcpu.h>
 
 struct cpu_private 
 {
@@ -43,6 +45,14 @@ struct cpu_private
     int cpu_state;
     evtchn_port_t ipi_port;
     void *db_support;
+    int preempt_pending;
+#ifdef ENABLE_TICKLESS
+    int tick_pending;
+#endif
+    struct vcpu_runstate_info runstate; /* kept up to date by Xen */
+    evtchn_port_t spin_kick_port; /* masked, polled by spinlock waiters */
+    struct spinlock *spin_poll_lock; /* lock this processor is polling for */
+    unsigned short spin_poll_ticket;
 };
 
 extern struct cpu_private percpu[];
@@ -53,6 +63,11 @@ extern struct cpu_private percpu[];
 void init_smp(void);
 
 void smp_signal_cpu(int cpu);
+void smp_preempt_cpu(int cpu);
+void smp_notify_cpu(int cpu);
+#ifdef ENABLE_TICKLESS
+void smp_restart_tick(int cpu);
+#endif
 void smp_cpu_safe(int cpu);
 int smp_num_active(void);
 
@@ -22,21 +22,60 @@
 #ifndef _SPINLOCK_H_
 #define _SPINLOCK_H_
 
+#include <os/config.h>
+
 #define DEBUG_LOCKS
 
+/* Waiters check every SPIN_CHECK_INTERVAL spins whether the holder's vCPU
+ * was preempted, and give up the processor if it was, or if the lock has
+ * not changed hands for SPIN_YIELD_THRESHOLD spins. With PV spinlocks they
+ * block in SCHEDOP_poll until the unlocker kicks them, otherwise they just
+ * yield */
+#define SPIN_CHECK_INTERVAL 256
+#ifdef ENABLE_PV_SPINLOCKS
+#define SPIN_YIELD_THRESHOLD (1 << 12)
+#else
+#define SPIN_YIELD_THRESHOLD (1 << 16)
+#endif
+
+struct spinlock_stats
+{
+	const char *name;
+	int index;
+	unsigned long acquisitions;
+	unsigned long contended;
+	unsigned long spins;
+	unsigned long yields;
+	unsigned long wait_cycles;
+	unsigned long max_wait_cycles;
+	unsigned long hold_cycles;
+	unsigned long max_hold_cycles;
+	unsigned long hold_start;
+};
+
+/* A ticket lock: the low half of slock is the ticket being served, the high
+ * half the next ticket to hand out, so waiters get the lock in the order
+ * they arrived and only read the line while they wait */
 typedef struct spinlock {
 	volatile unsigned int slock;
-#if defined(CONFIG_PREEMPT) && defined(CONFIG_SMP)
-	unsigned int break_lock;
-        unsigned long spin_count;
-        struct thread *owner;
-#endif
+	int poll_waiters;
+	int owner_cpu;
+	struct thread *owner;
+	struct spinlock_stats *stats;
 } spinlock_t;
 
+#define SPIN_TICKET_SHIFT 16
+#define spin_ticket_head(x) ((unsigned short)(x))
+#define spin_ticket_tail(x) ((unsigned short)((x) >> SPIN_TICKET_SHIFT))
 
-#define ARCH_SPIN_LOCK_UNLOCKED (spinlock_t) { 1 }
+#define ARCH_SPIN_LOCK_UNLOCKED (spinlock_t) { 0 }
+
+static inline int arch_spin_is_locked(spinlock_t *lock)
+{
+	unsigned int slock = lock->slock;
+	return spin_ticket_head(slock) != spin_ticket_tail(slock);
+}
 
-#define arch_spin_is_locked(x)	(*(volatile signed char *)(&(x)->slock) <= 0)
 #define arch_spin_can_lock(lock) (!arch_spin_is_locked(lock)) 
 
 #define cpu_relax_string    "rep;nop"
@@ -51,46 +90,45 @@ static inline void relax(void)
 #define LOCK ""
 #endif
 
-#define spin_lock_string \
-        "1:\n" \
-	LOCK \
-	"decb %0\n\t" \
-	"jns 3f\n" \
-	"2:\t" \
-    cpu_relax_string \
-	"cmpb $0,%0\n\t" \
-	"jle 2b\n\t" \
-	"jmp 1b\n" \
-	"3:\n\t"
-
-#define spin_unlock_string \
-	"xchgb %b0, %1" \
-		:"=q" (oldval), "=m" (lock->slock) \
-		:"0" (oldval) : "memory"
-
-static inline void _raw_spin_unlock(spinlock_t *lock)
+/* Returns the lock word as it was before our ticket was taken */
+static inline unsigned int _raw_spin_take_ticket(spinlock_t *lock)
 {
-	char oldval = 1;
+	unsigned int slock = 1 << SPIN_TICKET_SHIFT;
 	__asm__ __volatile__(
-		spin_unlock_string
-	);
+		LOCK "xaddl %0, %1"
+		: "+r" (slock), "+m" (lock->slock) : : "memory");
+	return slock;
 }
 
-static inline int _raw_spin_trylock(spinlock_t *lock)
+/* Only the holder writes the head, so no lock prefix is needed, except to
+ * order the release before the check for waiters blocked in the hypervisor */
+#ifdef ENABLE_PV_SPINLOCKS
+#define SPIN_UNLOCK_PREFIX LOCK
+#else
+#define SPIN_UNLOCK_PREFIX ""
+#endif
+
+static inline void _raw_spin_unlock(spinlock_t *lock)
 {
-	char oldval;
 	__asm__ __volatile__(
-		"lock xchgb %b0,%1\n"
-		:"=q" (oldval), "=m" (lock->slock)
-		:"0" (0) : "memory");
-	return oldval > 0;
+		SPIN_UNLOCK_PREFIX "incw (%0)"
+		: : "r" (&lock->slock) : "memory");
 }
 
-static inline void _raw_spin_lock(spinlock_t *lock)
+static inline int _raw_spin_trylock(spinlock_t *lock)
 {
+	unsigned int slock = lock->slock;
+	unsigned int old;
+
+	if (spin_ticket_head(slock) != spin_ticket_tail(slock))
+	{
+		return 0;
+	}
 	__asm__ __volatile__(
-		spin_lock_string
-		:"=m" (lock->slock) : : "memory");
+		LOCK "cmpxchgl %2, %1"
+		: "=a" (old), "+m" (lock->slock)
+		: "r" (slock + (1 << SPIN_TICKET_SHIFT)), "0" (slock) : "memory");
+	return old == slock;
 }
 
 #define SPIN_LOCK_UNLOCKED ARCH_SPIN_LOCK_UNLOCKED
@@ -107,6 +145,14 @@ extern void os_spin_unlock(spinlock_t *lock);
 extern unsigned long os_spin_lock_irqsave(spinlock_t *lock);
 extern void os_spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags);
 
+#ifdef ENABLE_SPINLOCK_STATS
+void spin_lock_stats_register(spinlock_t *lock, const char *name, int index);
+void spin_lock_stats_reset(void);
+void spin_lock_stats_dump(void);
+#else
+#define spin_lock_stats_register(lock, name, index) do { } while (0)
+#endif
+
 #define spin_lock(lock)     os_spin_lock(lock)
 #define spin_unlock(lock)   os_spin_unlock(lock)
 
@@ -88,7 +88,13 @@ int     gettimeofday(struct timeval *tv);
 void     block_domain(s_time_t until);
 void     check_need_resched(void);
 u64      get_cpu_running_time(int cpu);
+u64      tsc_to_nsec(int cpu, u64 cycles);
 void     set_timer_interrupt(u64 delta);
+void     set_timer_deadline(s_time_t deadline);
+void     stop_periodic_timer(int cpu);
+
+/* Deadlines this close together are served by one timer interrupt */
+#define TIMER_SLACK             MICROSECS(100)
 
 #define get_running_time() get_cpu_running_time(smp_processor_id())
 
@@ -30,6 +30,7 @@ extern void * xrealloc(const void *, size_t size, size_t align);
 void * xcalloc(size_t n, size_t size);
 extern void * xmalloc_at(const void *p, size_t size);
 extern void xfree_at(void *start, size_t length);
+void xmalloc_stats(unsigned long *free_chunks, unsigned long *free_bytes, unsigned long *slabs);
 
 static inline void * xmalloc_array_align(size_t size, size_t align, size_t num)
 {
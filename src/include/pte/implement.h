@@ -118,6 +118,7 @@ struct pte_thread_t_
 	int detachState;
 	pthread_mutex_t threadLock;	/* Used for serialised access to public thread state */
 	int sched_priority;		/* As set, not as currently is */
+	int sched_policy;
 	pthread_mutex_t cancelLock;	/* Used for async-cancel safety */
 	int cancelState;
 	int cancelType;
@@ -146,6 +147,7 @@ struct pthread_attr_t_
 	size_t stacksize;
 	int detachstate;
 	struct sched_param param;
+	int policy;
 	int inheritsched;
 	int contentionscope;
 };
@@ -31,7 +31,8 @@
 #include <os/function.h>
 #include <stdlib.h>
 
-typedef uint16_t osThreadHandle_t;
+/* sched_thread_handle(): thread id plus a generation, so never reused quickly */
+typedef uint32_t osThreadHandle_t;
 
 typedef osThreadHandle_t pte_osThreadHandle;
 typedef semaphore_t * pte_osSemaphoreHandle;
@@ -273,6 +273,11 @@ int pte_osThreadGetMinPriority();
  */
 int pte_osThreadGetDefaultPriority();
 
+/**
+ * Returns the timeslice of the calling thread, in nanoseconds.
+ */
+unsigned long long pte_osThreadGetTimeslice(void);
+
 //@}
 
 
@@ -26,8 +26,6 @@
 #include <pte/pthread.h>
 #include <os/trace.h>
 
-#define MAX_SKIPS 1
-
 pte_osResult pte_osInit(void)
 {
 	return pte_osTlsInit();
@@ -94,30 +92,16 @@ pte_osResult pte_osSemaphoreDelete(pte_osSemaphoreHandle handle)
 
 pte_osResult pte_osSemaphorePend(pte_osSemaphoreHandle handle, unsigned int *pTimeout)
 {
-
-	s_time_t past_time;
-	s_time_t current_time;
-	s_time_t timeout;
-
-	timeout = 0;
-	if ((pTimeout != NULL) || (pTimeout != 0))
-		timeout =  (s_time_t) *pTimeout * 1000000;
-
-	past_time = NOW();
-
-	while (1) {
-
-		current_time = NOW();
-		s_time_t timespent;
-		timespent = current_time - past_time;
-
-		if ( pTimeout == NULL ) {
-			semaphore_pend(handle);
-			return PTE_OS_OK;
-		}
-		if (semaphore_try_pend(handle) == 1) return PTE_OS_OK;
-		else if ( (pTimeout == 0) || (timespent >=  timeout ) ) return PTE_OS_TIMEOUT;
+	if (pTimeout == NULL)
+	{
+		semaphore_pend(handle);
+		return PTE_OS_OK;
 	}
+	if (semaphore_timed_pend(handle, *pTimeout) == 0)
+	{
+		return PTE_OS_TIMEOUT;
+	}
+	return PTE_OS_OK;
 }
 
 pte_osResult pte_osSemaphorePost(pte_osSemaphoreHandle handle, int count)
@@ -132,12 +116,17 @@ pte_osResult pte_osSemaphorePost(pte_osSemaphoreHandle handle, int count)
 
 pte_osResult pte_osThreadCancel(pte_thread_t *pte_thread_pntr)
 {
-    struct thread * t = pte_thread_pntr->os_thread_pntr;
-    if (t != NULL ) {
+    // os_thread_pntr may point at a struct that has been reused by another thread since
+    struct thread * t = sched_get_thread_handle(pte_thread_pntr->threadId);
+    if (t != NULL && !is_dying(t)) {
         if (is_joining(t)) { // if thread is currently blocked - waiting to join another thread
             sched_wake_joiner(t); // for deferred cancellation, need to wake target thread
         }
         set_cancelled(t);
+        mb();
+        if (in_cancellable_wait(t)) { // blocked in a cancellable semaphore pend, which checks the flag when woken
+            wake(t);
+        }
     }
     return PTE_OS_OK;
 }
@@ -217,13 +206,15 @@ pte_osResult pte_osThreadCreate(function entryPoint, int stackSize, int initialP
 	pte_thread_pntr->os_thread_pntr = pthread;
 	pthread->tls = tls_init();
 	pte_thread_pntr->priority = initialPriority;
+	/* pte's SCHED_* constants line up with SCHED_POLICY_* */
+	sched_set_priority(pthread, pte_thread_pntr->sched_policy, initialPriority);
 	unsigned key = 1;
 	void * value = NULL;
 	if (tls_alloc(pthread->tls, key, value) == 0)
 	{
 		return PTE_OS_NO_RESOURCES;
 	}
-	pte_thread_pntr->threadId = (uint16_t) pthread->id;
+	pte_thread_pntr->threadId = sched_thread_handle(pthread);
 	return PTE_OS_OK;
 }
 
@@ -255,8 +246,7 @@ int pte_osThreadGetDefaultPriority()
 
 pte_osThreadHandle pte_osThreadGetHandle(void)
 {
-	uint16_t threadHandle = sched_current_thread()->id;
-	return threadHandle;
+	return sched_thread_handle(sched_current_thread());
 }
 
 int pte_osThreadGetMaxPriority()
@@ -270,6 +260,11 @@ int pte_osThreadGetMinPriority()
 	return PTE_MIN_PRIORITY;
 }
 
+unsigned long long pte_osThreadGetTimeslice(void)
+{
+	return sched_get_timeslice(sched_current_thread());
+}
+
 int pte_osThreadGetPriority(pte_thread_t *pte_thread_pntr)
 {
     struct thread * thread = pte_thread_pntr->os_thread_pntr;
@@ -294,6 +289,11 @@ pte_osResult pte_osThreadSetPriority(pte_thread_t *pte_thread_pntr, int newPrior
 
 	if (thread != NULL && pte_thread_pntr->state != PThreadStateLast)
 	{
+		if (sched_set_priority(thread, pte_thread_pntr->sched_policy, newPriority) != 0)
+		{
+			return PTE_OS_INVALID_PARAM;
+		}
+
 		if (is_pthread(thread))
 		{
 			pte_thread_pntr->priority = newPriority;
@@ -337,8 +337,8 @@ pte_osResult pte_osThreadWaitForEnd(volatile pte_thread_t *pte_thread_pntr)
 
     struct thread *current_thread = sched_current_thread();
 
-    // Jon caution, we don't have mutex protection here, using atomic add as atomic read instead
-    struct thread *target_thread = (struct thread *) pte_osAtomicExchangeAdd_x86_64(((unsigned long *)&(pte_thread_pntr->os_thread_pntr)), 0);
+    // Goes NULL once the target has been reaped, even if its struct has been reused since
+    struct thread *target_thread = sched_get_thread_handle(pte_thread_pntr->threadId);
 //    int orig_thread_id = pte_osAtomicExchangeAdd(((int *)&(pte_thread_pntr->threadId)), 0);
 //    int orig_thread_reuse_count = pte_osAtomicExchangeAdd(((int *)&(pte_thread_pntr->ptHandle.x)), 0);
 
@@ -364,7 +364,7 @@ pte_osResult pte_osThreadWaitForEnd(volatile pte_thread_t *pte_thread_pntr)
     }
 
     // Otherwise, block until target has exited or joiner has been cancelled
-    join_return_value = join_thread(target_thread);
+    join_return_value = join_thread(pte_thread_pntr->threadId);
 
     if (join_return_value == -1) { // there was no such process at the OS level
 //        printk("2 waitForEnd %i: no OS level thread for tp: os-%p, tid: %i, pte-id: %i, reuse: %i\n", instance, target_thread, target_thread->id, orig_thread_id, orig_thread_reuse_count);
@@ -397,63 +397,14 @@ pte_osResult pte_osThreadWaitForEnd(volatile pte_thread_t *pte_thread_pntr)
 pte_osResult
 pte_osSemaphoreCancellablePend(pte_osSemaphoreHandle semHandle, unsigned int *pTimeout)
 {
-
-	s_time_t past_time;
-	s_time_t current_time;
-	s_time_t last_current_time = 0;
-	s_time_t timeout;
-	int time_skipped_backwards_count = 0;
-	unsigned int last_cpu, current_cpu;
-
-	if (pTimeout == NULL) {
-		semaphore_pend(semHandle);
-		return PTE_OS_OK;
-	}
-
-	struct thread * t = sched_current_thread();
-
-	timeout = 0;
-	if ((pTimeout != NULL))
-		timeout =  (s_time_t) *pTimeout * 1000000;
-
-#ifdef ENABLE_DEBUG_TRACE
-	pte_osThreadHandle self_id = sched_current_thread()->id;
-	if (timeout < 0) {
-		tprintk("pte_osSemaphoreCancellablePend: thread %u - timeout is %ld.\n", self_id, timeout);
-	}
-#endif
-#ifdef DEBUG
-	assert(timeout >= 0);
-#endif
-	past_time = NOW();
-#ifdef DEBUG
-	last_cpu = sched_current_thread()->cpu;
-#endif
-
-	while (1) {
-#ifdef DEBUG
-		current_cpu = sched_current_thread()->cpu;
-#endif
-		current_time = NOW();
-		s_time_t timespent;
-		timespent = current_time - past_time;
-#ifdef DEBUG
-		if (current_time - last_current_time < 0) {
-			time_skipped_backwards_count++;
-			tprintk("pte_osSemaphoreCancellablePend: skip %i, thread %u - current_time=%ld, last_current_time=%ld, difference=%ld, timeout=%ld, last_cpu=%i, current_cpu=%i.\n", time_skipped_backwards_count, self_id, current_time, last_current_time, current_time - last_current_time, timeout, last_cpu, current_cpu);
-		}
-		assert(timespent >= 0);
-		assert(current_time >= 0);
-		assert(time_skipped_backwards_count < MAX_SKIPS);
-#endif
-		if (semaphore_try_pend(semHandle) == 1 ) return PTE_OS_OK;
-		else if ( (t != NULL) && is_cancelled(t)) return PTE_OS_INTERRUPTED;
-		else if ( (timeout == 0) || (timespent >= timeout) ) return PTE_OS_TIMEOUT;
-#ifdef DEBUG
-		last_current_time = current_time;
-		last_cpu = current_cpu;
-#endif
-
+	switch (semaphore_cancellable_pend(semHandle, pTimeout))
+	{
+		case SEMAPHORE_ACQUIRED:
+			return PTE_OS_OK;
+		case SEMAPHORE_INTERRUPTED:
+			return PTE_OS_INTERRUPTED;
+		default:
+			return PTE_OS_TIMEOUT;
 	}
 }
 
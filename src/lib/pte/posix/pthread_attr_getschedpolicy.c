@@ -71,7 +71,7 @@ int pthread_attr_getschedpolicy (pthread_attr_t * attr, int *policy)
 {
 	if (pte_is_attr (attr) != 0 || policy == NULL) return EINVAL;
 	if (policy <= (int *) SCHED_MAX) return EINVAL;
-	*policy = SCHED_OTHER;
+	*policy = (*attr)->policy;
 	return 0;
 }
 
@@ -93,6 +93,7 @@ int pthread_attr_init (pthread_attr_t * attr)
 #endif
 	attr_result->detachstate = PTHREAD_CREATE_JOINABLE;
 	attr_result->param.sched_priority = pte_osThreadGetDefaultPriority();
+	attr_result->policy = SCHED_OTHER;
 	attr_result->inheritsched = PTHREAD_EXPLICIT_SCHED;
 	attr_result->contentionscope = PTHREAD_SCOPE_SYSTEM;
 	attr_result->valid = PTE_ATTR_VALID;
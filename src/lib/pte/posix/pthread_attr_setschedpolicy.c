@@ -75,11 +75,12 @@ pthread_attr_setschedpolicy (pthread_attr_t * attr, int policy)
 		return EINVAL;
 	}
 
-	if (policy != SCHED_OTHER)
+	if (policy < SCHED_MIN || policy > SCHED_MAX)
 	{
-		return ENOTSUP;
+		return EINVAL;
 	}
 
+	(*attr)->policy = policy;
 	return 0;
 }
 
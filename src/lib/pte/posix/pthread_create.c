@@ -118,6 +118,7 @@ int pthread_create (pthread_t * tid, const pthread_attr_t * attr, void *(*start)
 	ThreadParms *parms = NULL;
 	long stackSize;
 	int priority = 0;
+	int policy = SCHED_OTHER;
 	pthread_t self;
 	pte_osResult osResult;
 
@@ -149,6 +150,7 @@ int pthread_create (pthread_t * tid, const pthread_attr_t * attr, void *(*start)
 	tp = (pte_thread_t *) thread.p;
 
 	priority = tp->sched_priority;
+	policy = tp->sched_policy;
 
 
 	if ((parms = (ThreadParms *) malloc (sizeof (*parms))) == NULL)
@@ -165,6 +167,7 @@ int pthread_create (pthread_t * tid, const pthread_attr_t * attr, void *(*start)
 		stackSize = a->stacksize;
 		tp->detachState = a->detachstate;
 		priority = a->param.sched_priority;
+		policy = a->policy;
 
 		if ( (priority > pte_osThreadGetMaxPriority()) ||(priority < pte_osThreadGetMinPriority()) )
 		{
@@ -188,6 +191,7 @@ int pthread_create (pthread_t * tid, const pthread_attr_t * attr, void *(*start)
 			 */
 			self = pthread_self ();
 			priority = ((pte_thread_t *) self.p)->sched_priority;
+			policy = ((pte_thread_t *) self.p)->sched_policy;
 		}
 
 
@@ -223,6 +227,7 @@ int pthread_create (pthread_t * tid, const pthread_attr_t * attr, void *(*start)
 		 * not as finally adjusted.
 		 */
 		tp->sched_priority = priority;
+		tp->sched_policy = policy;
 
 		(void) pthread_mutex_unlock (&tp->threadLock);
 	}
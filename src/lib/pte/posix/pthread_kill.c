@@ -249,11 +249,10 @@ int pthread_kill (pthread_t thread, int sig)
 	pte_osMutexLock (pte_thread_reuse_lock);
 
 	pte_osThreadHandle pthread_id = tp->threadId;
-	uint16_t t_handle = pthread_id;
 
 	struct thread * current_thread = sched_current_thread();
 
-	int attempting_to_suspend_self = (current_thread->id == t_handle);
+	int attempting_to_suspend_self = (sched_thread_handle(current_thread) == pthread_id);
 
     struct thread * osthread = tp->os_thread_pntr;
 
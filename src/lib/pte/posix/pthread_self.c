@@ -126,7 +126,8 @@ pthread_t pthread_self (void) {
 			 * No need to explicitly serialise access to sched_priority
 			 * because the new handle is not yet public.
 			 */
-			sp->sched_priority = 0;
+			sp->sched_priority = pte_osThreadGetDefaultPriority();
+			sp->sched_policy = SCHED_OTHER;
 
 			pthread_setspecific (pte_selfThreadKey, (void *) sp);
 		}
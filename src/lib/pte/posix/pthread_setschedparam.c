@@ -86,12 +86,6 @@ pthread_setschedparam (pthread_t thread, int policy,
 		return EINVAL;
 	}
 
-	/* Ensure the policy is SCHED_OTHER. */
-	if (policy != SCHED_OTHER)
-	{
-		return ENOTSUP;
-	}
-
 	return (pte_setthreadpriority (thread, policy, param->sched_priority));
 }
 
@@ -101,6 +95,7 @@ pte_setthreadpriority (pthread_t thread, int policy, int priority)
 {
 	int prio;
 	int result;
+	int oldPolicy;
 	pte_thread_t * tp = (pte_thread_t *) thread.p;
 
 	prio = priority;
@@ -117,9 +112,12 @@ pte_setthreadpriority (pthread_t thread, int policy, int priority)
 	if (0 == result)
 	{
 		/* If this fails, the current priority is unchanged. */
+		oldPolicy = tp->sched_policy;
+		tp->sched_policy = policy;
 
 		if (0 != pte_osThreadSetPriority(tp, prio))
 		{
+			tp->sched_policy = oldPolicy;
 			result = EINVAL;
 		}
 		else
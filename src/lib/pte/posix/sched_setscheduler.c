@@ -67,11 +67,32 @@
 #include <errno.h>
 #include <pte/pte_generic_osal.h>
 
+/*
+ * There is a single process, so 'pid' is ignored and the policy of the
+ * calling thread is changed. Returns the previous policy.
+ */
 int
 sched_setscheduler (pid_t pid, int policy)
 {
-	errno = EPERM;
-	return -1;
+	pthread_t self = pthread_self ();
+	pte_thread_t * sp = (pte_thread_t *) self.p;
+	int oldPolicy;
+
+	if (policy < SCHED_MIN || policy > SCHED_MAX)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	oldPolicy = sp->sched_policy;
+
+	if (0 != pte_setthreadpriority (self, policy, sp->sched_priority))
+	{
+		errno = EPERM;
+		return -1;
+	}
+
+	return oldPolicy;
 }
 
 #endif
@@ -105,7 +105,8 @@ pte_new (void)
 	}
 
 	/* Set default state. */
-	tp->sched_priority = pte_osThreadGetMinPriority();
+	tp->sched_priority = pte_osThreadGetDefaultPriority();
+	tp->sched_policy = SCHED_OTHER;
 
 	tp->detachState = PTHREAD_CREATE_JOINABLE;
 	tp->cancelState = PTHREAD_CANCEL_ENABLE;
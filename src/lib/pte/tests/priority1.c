@@ -57,7 +57,8 @@
  * --------------------------------------------------------------------------
  *
  * Test Synopsis:
- * - Test thread priority explicit setting using thread attribute.
+ * - Test thread priority and policy explicit setting using thread attribute,
+ *   and that the scheduler runs the thread with them.
  *
  * Test Method (Validation or Falsification):
  * -
@@ -97,6 +98,7 @@
 
 #ifdef ENABLE_PTE_TESTS
 #include <pte/test.h>
+#include <os/sched.h>
 
 enum
 {
@@ -111,6 +113,7 @@ static int validPriorities[PTW32TEST_MAXPRIORITIES];
 */
 
 static int pthreadPrio;
+static int pthreadPolicy;
 
 static void *
 func(void * arg)
@@ -120,11 +123,15 @@ func(void * arg)
   pthread_t threadID = pthread_self();
 
   assert(pthread_getschedparam(threadID, &policy, &param) == 0);
-  assert(policy == SCHED_OTHER);
+  assert(policy == pthreadPolicy);
   assert(param.sched_priority == (int) pthreadPrio);
 
   assert(pte_osThreadGetPriority((pte_thread_t *) pthread_self().p) == param.sched_priority);
 
+  /* The scheduler must see what was asked for, not just pte's bookkeeping */
+  assert(sched_current_thread()->policy == pthreadPolicy);
+  assert(sched_current_thread()->prio == pthreadPrio);
+
 
   return (void *) 0;
 }
@@ -139,12 +146,18 @@ int pthread_test_priority1()
   assert(pthread_attr_init(&attr) == 0);
   assert(pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) == 0);
 
-  param.sched_priority = sched_get_priority_min(SCHED_OTHER) + 1;
-  pthreadPrio = sched_get_priority_min(SCHED_OTHER) + 1;
-  assert(pthread_attr_setschedparam(&attr, &param) == 0);
+  for (pthreadPolicy = SCHED_MIN; pthreadPolicy <= SCHED_MAX; pthreadPolicy++)
+    {
+      param.sched_priority = sched_get_priority_min(pthreadPolicy) + 1;
+      pthreadPrio = sched_get_priority_min(pthreadPolicy) + 1;
+      assert(pthread_attr_setschedpolicy(&attr, pthreadPolicy) == 0);
+      assert(pthread_attr_setschedparam(&attr, &param) == 0);
+
+      assert(pthread_create(&t, &attr, func, (void *) &attr) == 0);
+      assert(pthread_join(t, &result) == 0);
+    }
 
-  assert(pthread_create(&t, &attr, func, (void *) &attr) == 0);
-  assert(pthread_join(t, &result) == 0);
+  assert(pthread_attr_destroy(&attr) == 0);
 
   return 0;
 }
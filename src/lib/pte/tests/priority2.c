@@ -97,6 +97,7 @@
 
 #ifdef ENABLE_PTE_TESTS
 #include <pte/test.h>
+#include <os/sched.h>
 
 enum
 {
@@ -105,6 +106,7 @@ enum
 };
 
 static pthread_barrier_t startBarrier, endBarrier;
+static int expectedPolicy;
 
 static void * func(void * arg)
 {
@@ -115,11 +117,13 @@ static void * func(void * arg)
   result = pthread_barrier_wait(&startBarrier);
   assert(result == 0 || result == PTHREAD_BARRIER_SERIAL_THREAD);
   assert(pthread_getschedparam(pthread_self(), &policy, &param) == 0);
-  assert(policy == SCHED_OTHER);
+  assert(policy == expectedPolicy);
   result = pthread_barrier_wait(&endBarrier);
   assert(result == 0 || result == PTHREAD_BARRIER_SERIAL_THREAD);
 
   assert(pte_osThreadGetPriority((pte_thread_t *) pthread_self().p) == param.sched_priority);
+  assert(sched_current_thread()->policy == policy);
+  assert(sched_current_thread()->prio == param.sched_priority);
 
   return (void *) param.sched_priority;
 }
@@ -150,12 +154,13 @@ int pthread_test_priority2()
     SetThreadPriority(pthread_getw32threadhandle_np(pthread_self()),
                       PTW32TEST_THREAD_INIT_PRIO);
   */
+  for (expectedPolicy = SCHED_MIN; expectedPolicy <= SCHED_MAX; expectedPolicy++)
   for (param.sched_priority = pte_osThreadGetMinPriority();
        param.sched_priority <= pte_osThreadGetMaxPriority();
        param.sched_priority++)
     {
       assert(pthread_create(&t, NULL, func, NULL) == 0);
-      assert(pthread_setschedparam(t, SCHED_OTHER, &param) == 0);
+      assert(pthread_setschedparam(t, expectedPolicy, &param) == 0);
       result2 = pthread_barrier_wait(&startBarrier);
       assert(result2 == 0 || result2 == PTHREAD_BARRIER_SERIAL_THREAD);
       result2 = pthread_barrier_wait(&endBarrier);
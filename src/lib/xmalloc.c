@@ -58,6 +58,7 @@
 #include <os/types.h>
 #include <os/lib.h>
 #include <os/list.h>
+#include <os/mmstats.h>
 
 static LIST_HEAD(freelist);
 static spinlock_t freelist_lock = SPIN_LOCK_UNLOCKED;
@@ -68,15 +69,84 @@ struct xmalloc_hdr
 	struct list_head freelist;
 };
 
+/*
+ * Requests of up to XMALLOC_SLAB_MAX_SIZE bytes are served from size-class
+ * slabs. Each CPU keeps a magazine of free objects per class, so the common
+ * case neither walks the freelist nor takes a lock. Magazines are refilled
+ * from, and drained to, the per-class slab caches in batches.
+ *
+ * Slab objects carry a two word header. The tag word sits immediately before
+ * the object, where a legacy header keeps freelist.prev, and it can never be
+ * mistaken for a pointer because of the magic in its top bits.
+ */
+
+#define XMALLOC_NUM_CLASSES         13
+#define XMALLOC_SLAB_MAX_SIZE       2048
+#define XMALLOC_MAGAZINE_SIZE       32
+#define XMALLOC_MAGAZINE_BATCH      (XMALLOC_MAGAZINE_SIZE / 2)
+#define XMALLOC_LARGE_STRIDE        512
+#define XMALLOC_LARGE_SLAB_PAGES    4
+
+#define XMALLOC_SLAB_MAGIC          0x5ab1000000000000UL
+#define XMALLOC_SLAB_MAGIC_MASK     0xffff000000000000UL
+#define XMALLOC_SLAB_FREE           0x0000800000000000UL
+#define XMALLOC_SLAB_CLASS_MASK     0x00000000000000ffUL
+
+struct xmalloc_slab_hdr
+{
+	struct xmalloc_slab *slab;
+	unsigned long tag;
+};
+
+struct xmalloc_slab
+{
+	struct list_head list;
+	void *free;
+	unsigned int inuse;
+	unsigned int objects;
+	unsigned int pages;
+	unsigned int class;
+};
+
+struct xmalloc_cache
+{
+	spinlock_t lock;
+	struct list_head partial;
+	unsigned long nr_slabs;
+};
+
+struct xmalloc_magazine
+{
+	unsigned int count;
+	void *objects[XMALLOC_MAGAZINE_SIZE];
+};
+
+/* Object strides, including the slab header; usable sizes run from 16 to 2048 bytes */
+static const size_t xmalloc_class_stride[XMALLOC_NUM_CLASSES] = {
+	32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2064
+};
+
+#define XMALLOC_CACHE_INIT(n) { SPIN_LOCK_UNLOCKED, LIST_HEAD_INIT(xmalloc_caches[n].partial), 0 }
+
+static struct xmalloc_cache xmalloc_caches[XMALLOC_NUM_CLASSES] = {
+	XMALLOC_CACHE_INIT(0), XMALLOC_CACHE_INIT(1), XMALLOC_CACHE_INIT(2),
+	XMALLOC_CACHE_INIT(3), XMALLOC_CACHE_INIT(4), XMALLOC_CACHE_INIT(5),
+	XMALLOC_CACHE_INIT(6), XMALLOC_CACHE_INIT(7), XMALLOC_CACHE_INIT(8),
+	XMALLOC_CACHE_INIT(9), XMALLOC_CACHE_INIT(10), XMALLOC_CACHE_INIT(11),
+	XMALLOC_CACHE_INIT(12)
+};
+
+static struct xmalloc_magazine *xmalloc_magazines[MAX_VIRT_CPUS];
+
+static size_t xmalloc_usable_size(const void *p);
+
 extern void *
 xmalloc_at(const void *p, size_t size)
 {
-	struct xmalloc_hdr *hdr;
 	int p_size;
 	BUG_ON(in_irq());
 	if (p == NULL) return xmalloc_align(size, sizeof(unsigned long));
-	hdr = (struct xmalloc_hdr *)p - 1;
-	p_size = hdr->size - sizeof(struct xmalloc_hdr);
+	p_size = xmalloc_usable_size(p);
 	if (p_size >= size) return (void *)p;
 	void *result = xmalloc_align(size, sizeof(unsigned long));
 	memcpy(result, p, p_size);
@@ -134,6 +204,226 @@ static inline size_t align_up(size_t size, size_t align)
 	return (size + align - 1) & ~(align - 1);
 }
 
+static inline unsigned long *xmalloc_tag(const void *p)
+{
+	return (unsigned long *)p - 1;
+}
+
+static inline int is_slab_object(const void *p)
+{
+	return (*xmalloc_tag(p) & XMALLOC_SLAB_MAGIC_MASK) == XMALLOC_SLAB_MAGIC;
+}
+
+static inline struct xmalloc_slab_hdr *slab_hdr(const void *p)
+{
+	return (struct xmalloc_slab_hdr *)p - 1;
+}
+
+static int xmalloc_size_class(size_t size)
+{
+	int class;
+	size += sizeof(struct xmalloc_slab_hdr);
+	for (class = 0; class < XMALLOC_NUM_CLASSES; class++)
+	{
+		if (size <= xmalloc_class_stride[class]) return class;
+	}
+	return -1;
+}
+
+static struct xmalloc_slab *xmalloc_slab_new(int class)
+{
+	struct xmalloc_slab *slab;
+	size_t stride = xmalloc_class_stride[class];
+	unsigned int pages = stride > XMALLOC_LARGE_STRIDE ? XMALLOC_LARGE_SLAB_PAGES : 1;
+	unsigned long object, end;
+	void **link;
+
+	slab = (struct xmalloc_slab *)allocate_pages(pages, DATA_VM);
+	if (slab == NULL) return NULL;
+
+	INIT_LIST_HEAD(&slab->list);
+	slab->inuse = 0;
+	slab->objects = 0;
+	slab->pages = pages;
+	slab->class = class;
+	link = &slab->free;
+
+	object = (unsigned long)slab + align_up(sizeof(struct xmalloc_slab), 16);
+	end = (unsigned long)slab + pages * PAGE_SIZE;
+	for ( ; object + stride <= end; object += stride)
+	{
+		struct xmalloc_slab_hdr *hdr = (struct xmalloc_slab_hdr *)object;
+		hdr->slab = slab;
+		hdr->tag = XMALLOC_SLAB_MAGIC | XMALLOC_SLAB_FREE | class;
+		*link = hdr + 1;
+		link = (void **)(hdr + 1);
+		slab->objects++;
+	}
+	*link = NULL;
+	return slab;
+}
+
+/* Takes up to n objects of a class from its slabs, growing the cache when it runs dry */
+static int xmalloc_cache_take(int class, void **objects, int n)
+{
+	struct xmalloc_cache *cache = &xmalloc_caches[class];
+	struct xmalloc_slab *slab;
+	unsigned long flags;
+	int taken = 0;
+
+	flags = mm_stat_spin_lock_irqsave(&cache->lock, MM_STAT_XMALLOC);
+	while (taken < n)
+	{
+		if (list_empty(&cache->partial))
+		{
+			spin_unlock_irqrestore(&cache->lock, flags);
+			slab = xmalloc_slab_new(class);
+			spin_lock_irqsave(&cache->lock, flags);
+			if (slab == NULL) break;
+			list_add(&slab->list, &cache->partial);
+			cache->nr_slabs++;
+		}
+		slab = list_entry(cache->partial.next, struct xmalloc_slab, list);
+		while (taken < n && slab->free != NULL)
+		{
+			objects[taken] = slab->free;
+			slab->free = *(void **)slab->free;
+			slab->inuse++;
+			taken++;
+		}
+		if (slab->free == NULL)
+		{
+			list_del_init(&slab->list);
+		}
+	}
+	spin_unlock_irqrestore(&cache->lock, flags);
+	return taken;
+}
+
+/* Returns n objects of a class to their slabs and releases slabs that became empty */
+static void xmalloc_cache_give(int class, void **objects, int n)
+{
+	struct xmalloc_cache *cache = &xmalloc_caches[class];
+	struct xmalloc_slab *slab, *tmp;
+	unsigned long flags;
+	LIST_HEAD(empty);
+	int i;
+
+	flags = mm_stat_spin_lock_irqsave(&cache->lock, MM_STAT_XMALLOC);
+	for (i = 0; i < n; i++)
+	{
+		slab = slab_hdr(objects[i])->slab;
+		if (slab->free == NULL)
+		{
+			list_add(&slab->list, &cache->partial);
+		}
+		*(void **)objects[i] = slab->free;
+		slab->free = objects[i];
+		slab->inuse--;
+
+		/* Keep the last partial slab around to avoid thrashing the page allocator */
+		if (slab->inuse == 0 && cache->partial.next->next != &cache->partial)
+		{
+			list_del(&slab->list);
+			list_add(&slab->list, &empty);
+			cache->nr_slabs--;
+		}
+	}
+	spin_unlock_irqrestore(&cache->lock, flags);
+
+	list_for_each_entry_safe(slab, tmp, &empty, list)
+	{
+		deallocate_pages(slab, slab->pages, DATA_VM);
+	}
+}
+
+static struct xmalloc_magazine *xmalloc_this_magazine(int class)
+{
+	int cpu = smp_processor_id();
+	struct xmalloc_magazine *mags = xmalloc_magazines[cpu];
+	if (unlikely(mags == NULL))
+	{
+		size_t size = sizeof(struct xmalloc_magazine) * XMALLOC_NUM_CLASSES;
+		mags = (struct xmalloc_magazine *)allocate_pages(align_up(size, PAGE_SIZE) / PAGE_SIZE, DATA_VM);
+		if (mags == NULL) return NULL;
+		memset(mags, 0, size);
+		xmalloc_magazines[cpu] = mags;
+	}
+	return &mags[class];
+}
+
+static void *xmalloc_slab_alloc(int class)
+{
+	struct xmalloc_magazine *mag;
+	void *result = NULL;
+
+	preempt_disable();
+	mag = xmalloc_this_magazine(class);
+	if (likely(mag != NULL))
+	{
+		if (unlikely(mag->count == 0))
+		{
+			mag->count = xmalloc_cache_take(class, mag->objects, XMALLOC_MAGAZINE_BATCH);
+		}
+		if (mag->count > 0)
+		{
+			result = mag->objects[--mag->count];
+		}
+	}
+	else
+	{
+		xmalloc_cache_take(class, &result, 1);
+	}
+	preempt_enable();
+
+	if (result != NULL)
+	{
+		*xmalloc_tag(result) &= ~XMALLOC_SLAB_FREE;
+	}
+	return result;
+}
+
+static void xmalloc_slab_free(const void *p)
+{
+	struct xmalloc_magazine *mag;
+	unsigned long *tag = xmalloc_tag(p);
+	int class = *tag & XMALLOC_SLAB_CLASS_MASK;
+
+	if (*tag & XMALLOC_SLAB_FREE)
+	{
+		printk("Should not be previously freed\n");
+		return;
+	}
+	*tag |= XMALLOC_SLAB_FREE;
+	mm_stat_free(MM_STAT_XMALLOC, xmalloc_usable_size(p));
+
+	preempt_disable();
+	mag = xmalloc_this_magazine(class);
+	if (likely(mag != NULL))
+	{
+		if (unlikely(mag->count == XMALLOC_MAGAZINE_SIZE))
+		{
+			mag->count -= XMALLOC_MAGAZINE_BATCH;
+			xmalloc_cache_give(class, &mag->objects[mag->count], XMALLOC_MAGAZINE_BATCH);
+		}
+		mag->objects[mag->count++] = (void *)p;
+	}
+	else
+	{
+		xmalloc_cache_give(class, (void **)&p, 1);
+	}
+	preempt_enable();
+}
+
+static size_t xmalloc_usable_size(const void *p)
+{
+	if (is_slab_object(p))
+	{
+		return xmalloc_class_stride[*xmalloc_tag(p) & XMALLOC_SLAB_CLASS_MASK] - sizeof(struct xmalloc_slab_hdr);
+	}
+	return ((struct xmalloc_hdr *)p - 1)->size - sizeof(struct xmalloc_hdr);
+}
+
 static void *xmalloc_whole_pages(size_t size) 
 {
 	struct xmalloc_hdr *hdr;
@@ -153,6 +443,13 @@ void *xmalloc_align(size_t asize, size_t align)
 	void *result;
 
 	BUG_ON(in_irq());
+
+	if (asize <= XMALLOC_SLAB_MAX_SIZE && align <= 16)
+	{
+		result = xmalloc_slab_alloc(xmalloc_size_class(asize));
+		goto done;
+	}
+
 	size += sizeof(struct xmalloc_hdr);
 	size = align_up(size, __alignof__(struct xmalloc_hdr));
 
@@ -162,7 +459,7 @@ void *xmalloc_align(size_t asize, size_t align)
 		goto done;
 	}
 
-	spin_lock_irqsave(&freelist_lock, flags);
+	flags = mm_stat_spin_lock_irqsave(&freelist_lock, MM_STAT_XMALLOC);
 	list_for_each_entry(i, &freelist, freelist)
 	{
 		if ( i->size < size ) continue;
@@ -176,6 +473,7 @@ void *xmalloc_align(size_t asize, size_t align)
 	spin_unlock_irqrestore(&freelist_lock, flags);
 	result = xmalloc_new_page(size);
 	done:
+	mm_stat_alloc(MM_STAT_XMALLOC, result != NULL ? asize : 0, __builtin_return_address(0));
 	return result;
 }
 
@@ -186,6 +484,13 @@ void xfree(const void *p)
 	BUG_ON(in_irq());
 
 	if (p == NULL) return;
+
+	if (is_slab_object(p))
+	{
+		xmalloc_slab_free(p);
+		return;
+	}
+
 	hdr = (struct xmalloc_hdr *)p - 1;
 
 	if(((long)p & PAGE_MASK) != ((long)hdr & PAGE_MASK))
@@ -201,13 +506,15 @@ void xfree(const void *p)
 		*(int*)0=0;
 	}
 
+	mm_stat_free(MM_STAT_XMALLOC, xmalloc_usable_size(p));
+
 	if ( hdr->size >= PAGE_SIZE )
 	{
 		deallocate_pages(hdr, hdr->size / PAGE_SIZE, DATA_VM);
 		goto done;
 	}
 
-	spin_lock_irqsave(&freelist_lock, flags);
+	flags = mm_stat_spin_lock_irqsave(&freelist_lock, MM_STAT_XMALLOC);
 	list_for_each_entry_safe( i, tmp, &freelist, freelist )
 	{
 		unsigned long _i   = (unsigned long)i;
@@ -248,17 +555,38 @@ void xfree(const void *p)
 	return;
 }
 
+void xmalloc_stats(unsigned long *free_chunks, unsigned long *free_bytes, unsigned long *slabs)
+{
+	struct xmalloc_hdr *i;
+	unsigned long flags;
+	int class;
+
+	*free_chunks = 0;
+	*free_bytes = 0;
+	spin_lock_irqsave(&freelist_lock, flags);
+	list_for_each_entry(i, &freelist, freelist)
+	{
+		(*free_chunks)++;
+		*free_bytes += i->size;
+	}
+	spin_unlock_irqrestore(&freelist_lock, flags);
+
+	*slabs = 0;
+	for (class = 0; class < XMALLOC_NUM_CLASSES; class++)
+	{
+		*slabs += xmalloc_caches[class].nr_slabs;
+	}
+}
+
 void *xrealloc(const void *p, size_t size, size_t align)
 {
-	struct xmalloc_hdr *hdr;
 	int psize;
 	BUG_ON(in_irq());
 	if (p == NULL)
 	{
 		return xmalloc_align(size, align);
 	}
-	hdr = (struct xmalloc_hdr *)p - 1;
-	psize = hdr->size - sizeof(struct xmalloc_hdr);
+	psize = xmalloc_usable_size(p);
 	if (psize >= size) return (void *)p;
 	void *result = xmalloc_align(size, align);
 	memcpy(result, p, psize);
@@ -277,3 +605,19 @@ void *xcalloc(size_t n, size_t size)
 	}
 	return x;
 }
+
+#ifdef ENABLE_SPINLOCK_STATS
+USED static int init_xmalloc_lock_stats(void)
+{
+	int class;
+
+	spin_lock_stats_register(&freelist_lock, "freelist_lock", -1);
+	for (class = 0; class < XMALLOC_NUM_CLASSES; class++)
+	{
+		spin_lock_stats_register(&xmalloc_caches[class].lock, "xmalloc_cache", class);
+	}
+	return 0;
+}
+
+DECLARE_INIT(init_xmalloc_lock_stats);
+#endif
@@ -0,0 +1,160 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Contention statistics for registered spinlocks. The counters of a lock
+ * are only updated by whoever holds it, so they need no atomics, and locks
+ * that were never registered pay a single test of lock->stats. Times are in
+ * TSC cycles.
+ *
+ * Writing anything but "reset" to control/lock-stats prints the statistics
+ * on the console.
+ */
+
+#include <os/config.h>
+
+#ifdef ENABLE_SPINLOCK_STATS
+
+#include <os/kernel.h>
+#include <os/sched.h>
+#include <os/spinlock.h>
+#include <os/xenbus.h>
+#include <os/xmalloc.h>
+
+#define SPINLOCK_STATS_MAX 128
+
+static struct spinlock_stats lock_stats[SPINLOCK_STATS_MAX];
+
+static int lock_stats_count;
+
+void spin_lock_stats_register(spinlock_t *lock, const char *name, int index)
+{
+	struct spinlock_stats *stats;
+	int slot;
+
+	slot = atomic_exchange_add(&lock_stats_count, 1);
+	if (slot >= SPINLOCK_STATS_MAX)
+	{
+		printk("lock-stats: no room for %s\n", name);
+		return;
+	}
+
+	stats = &lock_stats[slot];
+	stats->name = name;
+	stats->index = index;
+
+	/* Attached under the lock, so that a holder never sees half of it */
+	spin_lock(lock);
+	rdtscll(stats->hold_start);
+	lock->stats = stats;
+	spin_unlock(lock);
+}
+
+void spin_lock_stats_reset(void)
+{
+	struct spinlock_stats *stats;
+	int i, count;
+
+	count = lock_stats_count < SPINLOCK_STATS_MAX ? lock_stats_count : SPINLOCK_STATS_MAX;
+	for (i = 0; i < count; i++)
+	{
+		stats = &lock_stats[i];
+		stats->acquisitions = 0;
+		stats->contended = 0;
+		stats->spins = 0;
+		stats->yields = 0;
+		stats->wait_cycles = 0;
+		stats->max_wait_cycles = 0;
+		stats->hold_cycles = 0;
+		stats->max_hold_cycles = 0;
+	}
+}
+
+void spin_lock_stats_dump(void)
+{
+	struct spinlock_stats *stats;
+	char name[32];
+	int i, count;
+
+	count = lock_stats_count < SPINLOCK_STATS_MAX ? lock_stats_count : SPINLOCK_STATS_MAX;
+	printk("Spinlock statistics (cycles):\n");
+	printk("%-16s %12s %10s %12s %8s %10s %12s %10s %12s\n", "lock", "acquired", "contended",
+		"spins", "yields", "avg wait", "max wait", "avg hold", "max hold");
+	for (i = 0; i < count; i++)
+	{
+		stats = &lock_stats[i];
+		if (stats->acquisitions == 0)
+		{
+			continue;
+		}
+
+		if (stats->index < 0)
+		{
+			snprintf(name, sizeof(name), "%s", stats->name);
+		}
+		else
+		{
+			snprintf(name, sizeof(name), "%s%d", stats->name, stats->index);
+		}
+
+		printk("%-16s %12lu %10lu %12lu %8lu %10lu %12lu %10lu %12lu\n", name,
+			stats->acquisitions, stats->contended, stats->spins, stats->yields,
+			stats->contended ? stats->wait_cycles / stats->contended : 0, stats->max_wait_cycles,
+			stats->hold_cycles / stats->acquisitions, stats->max_hold_cycles);
+	}
+}
+
+static void lock_stats_watch_fn(void *data)
+{
+	char *path, *value, *err;
+
+	xenbus_watch_path(XBT_NIL, "control/lock-stats", "lock-stats");
+	for (;;)
+	{
+		path = xenbus_read_watch("lock-stats");
+		xfree(path);
+		err = xenbus_read(XBT_NIL, "control/lock-stats", &value);
+		if (err)
+		{
+			xfree(err);
+			continue;
+		}
+
+		if (!strcmp(value, "reset"))
+		{
+			spin_lock_stats_reset();
+		}
+		else
+		{
+			spin_lock_stats_dump();
+		}
+
+		xfree(value);
+		err = xenbus_rm(XBT_NIL, "control/lock-stats");
+		if (err) xfree(err);
+	}
+}
+
+USED static int init_lock_stats(void)
+{
+	create_thread("lock_stats", lock_stats_watch_fn, UKERNEL_FLAG, NULL);
+	return 0;
+}
+
+DECLARE_INIT(init_lock_stats);
+
+#endif
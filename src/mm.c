@@ -52,6 +52,7 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <os/config.h>
 #include <os/kernel.h>
 #include <os/hypervisor.h>
 #include <os/mm.h>
@@ -63,6 +64,10 @@
 #include <os/lib.h>
 #include <os/bitmap.h>
 #include <os/crash.h>
+#include <os/numa.h>
+#include <os/balloon.h>
+#include <os/mmstats.h>
+#include <os/wait.h>
 
 static DEFINE_SPINLOCK(bitmap_lock);
 
@@ -103,7 +108,12 @@ typedef struct memory_hole
 
 #define memory_hole_head (list_entry(memory_hole_list.next, memory_hole_t, memory_hole_next))
 
-static int in_increase_memory = 0;
+static struct thread *increase_memory_owner;
+
+static DECLARE_WAIT_QUEUE_HEAD(increase_memory_waiters);
+
+/* Most pages populated with preemption disabled before the grower lets others run */
+#define GROW_STEP_PAGES (8 * SUPERPAGE_PAGES)
 
 #define BULK_ALLOCATION 512
 
@@ -129,72 +139,299 @@ static unsigned long max_pfn_table;
 
 static unsigned long maxmem_pfn_table;
 
-static void map_alloc(unsigned long first_page, unsigned long nr_pages)
+static inline void map_alloc(unsigned long first_page, unsigned long nr_pages)
+{
+	bitmap_set_range(alloc_bitmap, first_page, nr_pages);
+}
+
+static inline void map_free(unsigned long first_page, unsigned long nr_pages)
 {
-	unsigned long start_off, end_off, curr_idx, end_idx;
-	curr_idx  = first_page / PAGES_PER_MAPWORD;
-	start_off = first_page & (PAGES_PER_MAPWORD-1);
-	end_idx   = (first_page + nr_pages) / PAGES_PER_MAPWORD;
-	end_off   = (first_page + nr_pages) & (PAGES_PER_MAPWORD-1);
+	bitmap_clear_range(alloc_bitmap, first_page, nr_pages);
+}
+
+#ifdef ENABLE_BUDDY_ALLOCATOR
+
+/*
+ * The buddy allocator keeps one set of free lists per zone, so the small/bulk
+ * split is preserved, and the bulk zone is further split per NUMA node. Free
+ * block headers live in the first page of each free block, while the
+ * allocation bitmap remains the authoritative record of which pages are in use.
+ */
+
+#define BUDDY_MAX_ORDER 20
+
+#define BUDDY_MAGIC 0x6275646479626c6bUL
+
+#define BUDDY_SMALL_ZONE 0
+
+#define BUDDY_BULK_ZONE 1
+
+struct buddy_block
+{
+	struct list_head list;
+	unsigned long magic;
+	unsigned long order;
+};
+
+#define BUDDY_NR_ZONES (BUDDY_BULK_ZONE + MAX_NUMA_NODES)
+
+struct buddy_zone
+{
+	unsigned long nr_free;
+	unsigned long free_mask;
+	struct list_head free_list[BUDDY_MAX_ORDER + 1];
+};
+
+static struct buddy_zone buddy_zones[BUDDY_NR_ZONES];
+
+static inline struct buddy_block *buddy_block(unsigned long pfn)
+{
+	return (struct buddy_block *)pfn_to_virt(pfn);
+}
 
-	if ( curr_idx == end_idx )
+/* Returns the zone of pfn and the contiguous range of that zone which contains it */
+static struct buddy_zone *buddy_zone_of(unsigned long pfn, unsigned long *start, unsigned long *end)
+{
+	int node;
+	if (pfn < first_bulk_page)
 	{
-		alloc_bitmap[curr_idx] |= ((1UL<<end_off)-1) & -(1UL<<start_off);
+		*start = first_alloc_page;
+		*end = first_bulk_page;
+		return &buddy_zones[BUDDY_SMALL_ZONE];
 	}
-	else
+	node = numa_pfn_to_node(pfn, start, end);
+	if (*start < first_bulk_page) *start = first_bulk_page;
+	if (*end > end_alloc_page) *end = end_alloc_page;
+	return &buddy_zones[BUDDY_BULK_ZONE + node];
+}
+
+static inline int buddy_order(unsigned long n)
+{
+	int order = 0;
+	while ((1UL << order) < n) order++;
+	return order;
+}
+
+static void buddy_init_zones(void)
+{
+	int z, order;
+	for (z = 0; z < BUDDY_NR_ZONES; z++)
 	{
-		alloc_bitmap[curr_idx] |= -(1UL<<start_off);
-		while ( ++curr_idx < end_idx ) alloc_bitmap[curr_idx] = ~0L;
-		alloc_bitmap[curr_idx] |= (1UL<<end_off)-1;
+		buddy_zones[z].nr_free = 0;
+		buddy_zones[z].free_mask = 0;
+		for (order = 0; order <= BUDDY_MAX_ORDER; order++)
+		{
+			INIT_LIST_HEAD(&buddy_zones[z].free_list[order]);
+		}
 	}
 }
 
-static void map_free(unsigned long first_page, unsigned long nr_pages)
+static void buddy_list_add(struct buddy_zone *zone, unsigned long pfn, int order)
 {
-	unsigned long start_off, end_off, curr_idx, end_idx;
+	struct buddy_block *block = buddy_block(pfn);
+	block->magic = BUDDY_MAGIC;
+	block->order = order;
+	list_add(&block->list, &zone->free_list[order]);
+	zone->free_mask |= 1UL << order;
+}
 
-	curr_idx = first_page / PAGES_PER_MAPWORD;
-	start_off = first_page & (PAGES_PER_MAPWORD-1);
-	end_idx   = (first_page + nr_pages) / PAGES_PER_MAPWORD;
-	end_off   = (first_page + nr_pages) & (PAGES_PER_MAPWORD-1);
+static void buddy_list_del(struct buddy_zone *zone, struct buddy_block *block, int order)
+{
+	list_del(&block->list);
+	block->magic = 0;
+	if (list_empty(&zone->free_list[order])) zone->free_mask &= ~(1UL << order);
+}
 
-	if ( curr_idx == end_idx )
+static int buddy_is_free(unsigned long pfn, int order, unsigned long start, unsigned long end)
+{
+	struct buddy_block *block;
+	if (pfn < start || pfn + (1UL << order) > end) return 0;
+	if (allocated_in_map(alloc_bitmap, pfn)) return 0;
+	block = buddy_block(pfn);
+	return block->magic == BUDDY_MAGIC && block->order == order;
+}
+
+static void buddy_free_block(struct buddy_zone *zone, unsigned long pfn, int order, unsigned long start, unsigned long end)
+{
+	while (order < BUDDY_MAX_ORDER)
 	{
-		alloc_bitmap[curr_idx] &= -(1UL<<end_off) | ((1UL<<start_off)-1);
+		unsigned long buddy = pfn ^ (1UL << order);
+		if (!buddy_is_free(buddy, order, start, end)) break;
+		buddy_list_del(zone, buddy_block(buddy), order);
+		pfn &= ~(1UL << order);
+		order++;
 	}
-	else
+	buddy_list_add(zone, pfn, order);
+}
+
+/* Releases an arbitrary run of pages by splitting it into aligned blocks */
+static void buddy_free_range(unsigned long pfn, unsigned long n)
+{
+	map_free(pfn, n);
+	while (n > 0)
 	{
-		alloc_bitmap[curr_idx] &= (1UL<<start_off)-1;
-		while ( ++curr_idx != end_idx ) alloc_bitmap[curr_idx] = 0;
-		alloc_bitmap[curr_idx] &= -(1UL<<end_off);
+		unsigned long start, end;
+		struct buddy_zone *zone = buddy_zone_of(pfn, &start, &end);
+		int order = __builtin_ctzl(pfn);
+		if (order > BUDDY_MAX_ORDER) order = BUDDY_MAX_ORDER;
+		while ((1UL << order) > n || (1UL << order) > end - pfn) order--;
+		buddy_free_block(zone, pfn, order, start, end);
+		zone->nr_free += 1UL << order;
+		if (zone != &buddy_zones[BUDDY_SMALL_ZONE]) num_free_bulk_pages += 1UL << order;
+		num_free_pages += 1UL << order;
+		pfn += 1UL << order;
+		n -= 1UL << order;
 	}
 }
 
-static int next_free(int page) 
+static unsigned long buddy_alloc(struct buddy_zone *zone, unsigned long n)
 {
-	while (page < end_alloc_page) 
+	struct buddy_block *block;
+	unsigned long pfn, mask;
+	int order = buddy_order(n);
+	int current_order;
+
+	if (order > BUDDY_MAX_ORDER) return 0;
+	mask = zone->free_mask & ~((1UL << order) - 1);
+	if (mask == 0) return 0;
+
+	current_order = __builtin_ctzl(mask);
+	block = list_entry(zone->free_list[current_order].next, struct buddy_block, list);
+	pfn = virt_to_pfn(block);
+	buddy_list_del(zone, block, current_order);
+	while (current_order > order)
+	{
+		current_order--;
+		buddy_list_add(zone, pfn + (1UL << current_order), current_order);
+	}
+
+	map_alloc(pfn, 1UL << order);
+	zone->nr_free -= 1UL << order;
+	if (zone != &buddy_zones[BUDDY_SMALL_ZONE]) num_free_bulk_pages -= 1UL << order;
+	num_free_pages -= 1UL << order;
+	if (n < (1UL << order))
 	{
-		if (!allocated_in_map(alloc_bitmap, page)) 
+		buddy_free_range(pfn + n, (1UL << order) - n);
+	}
+	return pfn;
+}
+
+/*
+ * Takes pages from the local node first. Small requests use the small zone
+ * ahead of the local node when the small zone is itself local, and before
+ * any remote node otherwise; remote nodes are tried in order of distance.
+ */
+static unsigned long buddy_alloc_local(unsigned long n, int use_small)
+{
+	unsigned long start, end, page = 0;
+	int node = numa_node_id();
+	int i;
+
+	if (use_small && numa_pfn_to_node(first_alloc_page, &start, &end) == node)
+	{
+		page = buddy_alloc(&buddy_zones[BUDDY_SMALL_ZONE], n);
+		use_small = 0;
+	}
+	if (page == 0) page = buddy_alloc(&buddy_zones[BUDDY_BULK_ZONE + node], n);
+	if (page == 0 && use_small) page = buddy_alloc(&buddy_zones[BUDDY_SMALL_ZONE], n);
+	for (i = 1; page == 0 && i < numa_nr_nodes; i++)
+	{
+		page = buddy_alloc(&buddy_zones[BUDDY_BULK_ZONE + numa_fallback_node(node, i)], n);
+	}
+	return page;
+}
+
+#else
+
+static inline unsigned long next_free(unsigned long page) 
+{
+	return bitmap_find_next_zero(alloc_bitmap, page, end_alloc_page);
+}
+
+#endif
+
+/*
+ * Growing and shrinking the reservation both drop bitmap_lock around their
+ * hypercalls while holding on to memory holes, so only one thread at a time
+ * may do either. These are called with bitmap_lock held. Waiters sleep on
+ * increase_memory_waiters unless they hold other locks, in which case they
+ * can only spin.
+ */
+static inline int reservation_can_sleep(void)
+{
+	return current->preempt_count == 1 && in_spinlock(current) == 1 && !irqs_disabled();
+}
+
+static void reservation_wait(void)
+{
+	DEFINE_WAIT(wait);
+
+	if (increase_memory_owner == NULL) 
+	{
+		return;
+	}
+	add_wait_queue(&increase_memory_waiters, &wait);
+	while (increase_memory_owner != NULL) 
+	{
+		if (reservation_can_sleep()) 
 		{
-			break;
+			block(current);
+			spin_unlock(&bitmap_lock);
+			schedule();
 		}
-		page++;
+		else 
+		{
+			spin_unlock(&bitmap_lock);
+			relax();
+		}
+		spin_lock(&bitmap_lock);
 	}
-	return page;
+	remove_wait_queue(&wait);
 }
 
-static long increase_memory_holding_lock(unsigned long n) 
+static void reservation_acquire(void)
+{
+	reservation_wait();
+	increase_memory_owner = current;
+}
+
+static void reservation_release(void)
+{
+	increase_memory_owner = NULL;
+	__wake_up(&increase_memory_waiters);
+}
+
+/* Frees holes that have been unlinked from the hole list, called without bitmap_lock */
+static void memory_holes_free(struct list_head *holes)
+{
+	memory_hole_t *memory_hole, *next;
+	list_for_each_entry_safe(memory_hole, next, holes, memory_hole_next) 
+	{
+		xfree(memory_hole);
+	}
+}
+
+/*
+ * Grows the reservation by n pages. Only one thread grows memory at a time,
+ * in steps of at most GROW_STEP_PAGES that each run with preemption disabled,
+ * so other callers can simply wait for it and retry their allocation. A
+ * recursive entry, which happens when page table frames are allocated, fails.
+ * Holes that get used up are moved to consumed, for the caller to free once
+ * it has dropped bitmap_lock.
+ */
+static long increase_memory_holding_lock(unsigned long n, struct list_head *consumed) 
 {
 	long result = 0;
-	if (in_increase_memory) 
+	if (increase_memory_owner == current) 
 	{
-		in_increase_memory = 0;
 		return 0;
-	} 
-	else 
+	}
+	if (increase_memory_owner != NULL) 
 	{
-		in_increase_memory = 1;
+		reservation_wait();
+		return 1;
 	}
+	reservation_acquire();
 	if (can_increase(n)) 
 	{
 		while (n > 0) 
@@ -202,22 +439,30 @@ static long increase_memory_holding_lock(unsigned long n)
 			memory_hole_t *memory_hole = memory_hole_head;
 			unsigned long hole_size = memory_hole->end_pfn - memory_hole->start_pfn;
 			unsigned long nn = hole_size <= n ? hole_size : n;
+			if (nn > GROW_STEP_PAGES) nn = GROW_STEP_PAGES;
 			spin_unlock(&bitmap_lock); /* there may be recursive entry for page table frames */
+			preempt_disable();
 			long rc = increase_reservation(nn, memory_hole);
+			preempt_enable();
 			spin_lock(&bitmap_lock);
 			if (rc > 0) 
 			{
-				map_free(memory_hole->start_pfn, rc);
 				if (memory_hole->start_pfn + rc > end_alloc_page) 
 				{
 					end_alloc_page = memory_hole->start_pfn + rc;
 				}
+#ifdef ENABLE_BUDDY_ALLOCATOR
+				buddy_free_range(memory_hole->start_pfn, rc);
+#else
+				map_free(memory_hole->start_pfn, rc);
 				num_free_pages += rc;
 				num_free_bulk_pages += rc;
+#endif
 
 				if (hole_size == rc) 
 				{
 					list_del(&memory_hole->memory_hole_next);
+					list_add(&memory_hole->memory_hole_next, consumed);
 				} 
 				else 
 				{
@@ -232,17 +477,10 @@ static long increase_memory_holding_lock(unsigned long n)
 			result += rc;
 		}
 	}
-	in_increase_memory = 0;
+	reservation_release();
 	return result;
 }
 
-void unlocked_free(void *p) 
-{
-	spin_unlock(&bitmap_lock);
-	xfree(p);
-	spin_lock(&bitmap_lock);
-}
-
 void memory_hole_add(memory_hole_t *new_memory_hole) 
 {
 	struct list_head *list;
@@ -255,62 +493,105 @@ void memory_hole_add(memory_hole_t *new_memory_hole)
 	list_add_tail(&new_memory_hole->memory_hole_next, list);
 }
 
+/*
+ * Adds a hole and merges it with its neighbours, called with bitmap_lock held.
+ * Holes merged away are moved to merged for the caller to free.
+ */
+static void memory_hole_insert(memory_hole_t *new_memory_hole, struct list_head *merged) 
+{
+	memory_hole_t *prev, *next;
+	memory_hole_add(new_memory_hole);
+	if (new_memory_hole->memory_hole_next.next != &memory_hole_list) 
+	{
+		next = list_entry(new_memory_hole->memory_hole_next.next, memory_hole_t, memory_hole_next);
+		if (next->start_pfn == new_memory_hole->end_pfn) 
+		{
+			new_memory_hole->end_pfn = next->end_pfn;
+			list_del(&next->memory_hole_next);
+			list_add(&next->memory_hole_next, merged);
+		}
+	}
+	if (new_memory_hole->memory_hole_next.prev != &memory_hole_list) 
+	{
+		prev = list_entry(new_memory_hole->memory_hole_next.prev, memory_hole_t, memory_hole_next);
+		if (prev->end_pfn == new_memory_hole->start_pfn) 
+		{
+			prev->end_pfn = new_memory_hole->end_pfn;
+			list_del(&new_memory_hole->memory_hole_next);
+			list_add(&new_memory_hole->memory_hole_next, merged);
+		}
+	}
+}
+
+#ifdef ENABLE_BUDDY_ALLOCATOR
+
+static unsigned long _allocate_pages(int n, int type)
+{
+	unsigned long page = 0;
+	int is_bulk_alloc = is_bulk(n);
+	LIST_HEAD(consumed);
+
+	BUG_ON(in_irq());
+	mm_stat_spin_lock(&bitmap_lock, MM_STAT_PAGES);
+
+	while (page == 0) 
+	{
+		page = buddy_alloc_local(n, !is_bulk_alloc);
+		if (page == 0 && !increase_memory_holding_lock(n, &consumed)) break;
+	}
+
+	spin_unlock(&bitmap_lock);
+	memory_holes_free(&consumed);
+
+	if (page == 0) 
+	{
+		if (!is_bulk_alloc) crash();
+		return 0;
+	}
+#ifdef ENABLE_BALLOON
+	if (!list_empty(&memory_hole_list)) balloon_kick(num_free_pages);
+#endif
+	return (unsigned long) to_virt(PFN_PHYS(page));
+}
+
+#else
+
 static unsigned long _allocate_pages(int n, int type)
 {
 	unsigned long page;
 	unsigned long result = 0;
 	int is_bulk_alloc = is_bulk(n);
 	int initial_is_bulk_alloc = is_bulk_alloc;
+	LIST_HEAD(consumed);
 
 	BUG_ON(in_irq());
-	spin_lock(&bitmap_lock);
+	mm_stat_spin_lock(&bitmap_lock, MM_STAT_PAGES);
 
 	while (result == 0) 
 	{
 		unsigned long end_page = is_bulk_alloc ? end_alloc_page : first_bulk_page;
 		page = is_bulk_alloc ? first_free_bulk_page : first_free_page;
-		while (page < end_page) 
+		page = bitmap_find_zero_run(alloc_bitmap, page, end_page, n);
+		if (page < end_page) 
 		{
-			if (!allocated_in_map(alloc_bitmap, page)) 
+			result = (unsigned long) to_virt(PFN_PHYS(page));
+			if (is_bulk_alloc) 
 			{
-				int nn = n;
-				unsigned long npage = page + 1;
-				while (nn > 1 && (npage < end_page)) 
+				num_free_bulk_pages -= n;
+				if (page == first_free_bulk_page) 
 				{
-					if (!allocated_in_map(alloc_bitmap, npage)) 
-					{
-						nn--; npage++;
-					} 
-					else 
-					{
-						page = npage;
-						break;
-					}
+					first_free_bulk_page = next_free(page + n);
 				}
-				if (nn == 1) 
+			} 
+			else 
+			{
+				if (page == first_free_page) 
 				{
-					result = (unsigned long) to_virt(PFN_PHYS(page));
-					if (is_bulk_alloc) 
-					{
-						num_free_bulk_pages -= n;
-						if (page == first_free_bulk_page) 
-						{
-							first_free_bulk_page = next_free(page + n);
-						}
-					} 
-					else 
-					{
-						if (page == first_free_page) 
-						{
-							first_free_page = next_free(page + n);
-						}
-					}
-					num_free_pages -= n;
-					map_alloc(page, n);
-					break;
+					first_free_page = next_free(page + n);
 				}
 			}
-			page++;
+			num_free_pages -= n;
+			map_alloc(page, n);
 		}
 
 		if (result > 0) break;
@@ -322,36 +603,77 @@ static unsigned long _allocate_pages(int n, int type)
 			} 
 			else 
 			{
-				if (!increase_memory_holding_lock(n)) break;
+				if (!increase_memory_holding_lock(n, &consumed)) break;
 			}
 		}
 	}
 
 	spin_unlock(&bitmap_lock);
+	memory_holes_free(&consumed);
 
 	if (result == 0 && !initial_is_bulk_alloc) 
 	{
 		crash();
 	}
+#ifdef ENABLE_BALLOON
+	if (result != 0 && !list_empty(&memory_hole_list)) balloon_kick(num_free_pages);
+#endif
 	return result;
 }
 
-unsigned long alloc_pages(int order) 
+#endif
+
+#ifdef ENABLE_BUDDY_ALLOCATOR
+
+static unsigned long __allocate_single_page(int small_only)
 {
-	return _allocate_pages(1 << order, DATA_VM);
+	if (small_only) return buddy_alloc(&buddy_zones[BUDDY_SMALL_ZONE], 1);
+	return buddy_alloc_local(1, 1);
 }
 
-unsigned long allocate_pages(int n, int type) 
+static void __deallocate_pages(unsigned long page, int n)
 {
-	return _allocate_pages(n, type);
+	buddy_free_range(page, n);
 }
 
-void deallocate_pages(void *pointer, int n, int type) 
+/* Takes n free bulk pages without growing the reservation */
+static unsigned long __take_free_pages(unsigned long n)
 {
-	BUG_ON(in_irq());
-	spin_lock(&bitmap_lock);
-	unsigned long page = virt_to_pfn(pointer);
-	if (is_bulk(n)) 
+	unsigned long page = 0;
+	int node;
+	for (node = numa_nr_nodes - 1; page == 0 && node >= 0; node--) 
+	{
+		page = buddy_alloc(&buddy_zones[BUDDY_BULK_ZONE + node], n);
+	}
+	return page;
+}
+
+#else
+
+static unsigned long __allocate_single_page(int small_only)
+{
+	unsigned long page = bitmap_find_next_zero(alloc_bitmap, first_free_page, first_bulk_page);
+	if (page < first_bulk_page) 
+	{
+		first_free_page = next_free(page + 1);
+	}
+	else 
+	{
+		if (small_only) return 0;
+		page = bitmap_find_next_zero(alloc_bitmap, first_free_bulk_page, end_alloc_page);
+		if (page >= end_alloc_page) return 0;
+		first_free_bulk_page = next_free(page + 1);
+		num_free_bulk_pages--;
+	}
+	num_free_pages--;
+	map_alloc(page, 1);
+	return page;
+}
+
+static void __deallocate_pages(unsigned long page, int n)
+{
+	/* Small requests fall back to the bulk area when the small one is full */
+	if (page >= first_bulk_page) 
 	{
 		if (page < first_free_bulk_page) first_free_bulk_page = page;
 		num_free_bulk_pages += n;
@@ -361,10 +683,178 @@ void deallocate_pages(void *pointer, int n, int type)
 		if (page < first_free_page) first_free_page = page;
 	}
 	map_free(page, n);
-	spin_unlock(&bitmap_lock);
 	num_free_pages += n;
 }
 
+static unsigned long __take_free_pages(unsigned long n)
+{
+	unsigned long page = bitmap_find_zero_run(alloc_bitmap, first_free_bulk_page, end_alloc_page, n);
+	if (page >= end_alloc_page) return 0;
+	if (page == first_free_bulk_page) first_free_bulk_page = next_free(page + n);
+	num_free_bulk_pages -= n;
+	num_free_pages -= n;
+	map_alloc(page, n);
+	return page;
+}
+
+#endif
+
+/*
+ * Single pages are served from a per-CPU cache so that the common
+ * alloc_page/free_page pattern stays off bitmap_lock. The cache is refilled
+ * and drained in batches; recently freed pages are reused first and the
+ * oldest ones are returned to the allocator.
+ */
+
+#define PAGE_CACHE_SIZE 64
+
+#define PAGE_CACHE_BATCH 16
+
+struct page_cache
+{
+	unsigned int count;
+	unsigned long pfns[PAGE_CACHE_SIZE];
+};
+
+static struct page_cache page_caches[MAX_VIRT_CPUS];
+
+static unsigned long page_cache_get(void)
+{
+	struct page_cache *cache;
+	unsigned long page = 0;
+
+	preempt_disable();
+	cache = &page_caches[smp_processor_id()];
+	if (cache->count == 0) 
+	{
+		mm_stat_spin_lock(&bitmap_lock, MM_STAT_PAGES);
+		while (cache->count < PAGE_CACHE_BATCH) 
+		{
+			page = __allocate_single_page(0);
+			if (page == 0) break;
+			cache->pfns[cache->count++] = page;
+		}
+		spin_unlock(&bitmap_lock);
+	}
+	page = cache->count > 0 ? cache->pfns[--cache->count] : 0;
+	preempt_enable();
+	return page;
+}
+
+static void page_cache_put(unsigned long page)
+{
+	struct page_cache *cache;
+	int i;
+
+	preempt_disable();
+	cache = &page_caches[smp_processor_id()];
+	if (cache->count == PAGE_CACHE_SIZE) 
+	{
+		mm_stat_spin_lock(&bitmap_lock, MM_STAT_PAGES);
+		for (i = 0; i < PAGE_CACHE_BATCH; i++) 
+		{
+			__deallocate_pages(cache->pfns[i], 1);
+		}
+		spin_unlock(&bitmap_lock);
+		cache->count -= PAGE_CACHE_BATCH;
+		memmove(cache->pfns, cache->pfns + PAGE_CACHE_BATCH, cache->count * sizeof(unsigned long));
+	}
+	cache->pfns[cache->count++] = page;
+	preempt_enable();
+}
+
+/*
+ * Returns 2MB aligned memory. The buddy engine aligns blocks of at least
+ * SUPERPAGE_PAGES naturally; the bitmap engine over-allocates and trims.
+ */
+unsigned long allocate_huge_pages(int n) 
+{
+	n = (n + SUPERPAGE_PAGES - 1) & ~(SUPERPAGE_PAGES - 1);
+#ifdef ENABLE_BUDDY_ALLOCATOR
+	return _allocate_pages(n, DATA_VM);
+#else
+	unsigned long aligned;
+	unsigned long result = _allocate_pages(n + SUPERPAGE_PAGES - 1, DATA_VM);
+	if (result == 0) return 0;
+	aligned = (result + SUPERPAGE_SIZE - 1) & ~(SUPERPAGE_SIZE - 1);
+	if (aligned > result) 
+	{
+		deallocate_pages((void *)result, (aligned - result) >> PAGE_SHIFT, DATA_VM);
+	}
+	if (aligned - result < (SUPERPAGE_PAGES - 1) << PAGE_SHIFT) 
+	{
+		deallocate_pages((void *)(aligned + ((unsigned long)n << PAGE_SHIFT)), SUPERPAGE_PAGES - 1 - ((aligned - result) >> PAGE_SHIFT), DATA_VM);
+	}
+	return aligned;
+#endif
+}
+
+/* site is the caller charged in the statistics. The entry points below pass
+ * their own return address, so it does not depend on them being compiled
+ * as tail calls */
+static unsigned long allocate_pages_from(int n, int type, void *site) 
+{
+	unsigned long page, result;
+
+	if (n >= SUPERPAGE_PAGES && (n & (SUPERPAGE_PAGES - 1)) == 0) 
+	{
+		result = allocate_huge_pages(n);
+		goto done;
+	}
+#ifdef ENABLE_SUPERPAGES
+	if (n == 1 && type == PAGE_FRAME_VM) 
+	{
+		/*
+		 * Page table frames are made read-only, which needs a 4K mapping; the
+		 * small zone only covers boot memory. Bulk pages may sit inside a 2MB
+		 * mapping, so when the small zone is empty the caller has to fail.
+		 */
+		mm_stat_spin_lock(&bitmap_lock, MM_STAT_PAGES);
+		page = __allocate_single_page(1);
+		spin_unlock(&bitmap_lock);
+		result = page != 0 ? (unsigned long) to_virt(PFN_PHYS(page)) : 0;
+		goto done;
+	}
+#endif
+	if (n == 1) 
+	{
+		page = page_cache_get();
+		if (page != 0) 
+		{
+			result = (unsigned long) to_virt(PFN_PHYS(page));
+			goto done;
+		}
+	}
+	result = _allocate_pages(n, type);
+	done:
+	mm_stat_alloc(MM_STAT_PAGES, result != 0 ? (unsigned long)n << PAGE_SHIFT : 0, site);
+	return result;
+}
+
+unsigned long allocate_pages(int n, int type) 
+{
+	return allocate_pages_from(n, type, __builtin_return_address(0));
+}
+
+unsigned long alloc_pages(int order) 
+{
+	return allocate_pages_from(1 << order, DATA_VM, __builtin_return_address(0));
+}
+
+void deallocate_pages(void *pointer, int n, int type) 
+{
+	BUG_ON(in_irq());
+	mm_stat_free(MM_STAT_PAGES, (unsigned long)n << PAGE_SHIFT);
+	if (n == 1) 
+	{
+		page_cache_put(virt_to_pfn(pointer));
+		return;
+	}
+	mm_stat_spin_lock(&bitmap_lock, MM_STAT_PAGES);
+	__deallocate_pages(virt_to_pfn(pointer), n);
+	spin_unlock(&bitmap_lock);
+}
+
 void free_pages(void *pointer, int order)
 {
 	deallocate_pages(pointer, 1 << order, DATA_VM);
@@ -403,6 +893,46 @@ void resize_phys_to_machine_mapping_table(void)
 	list_add(&memory_hole->memory_hole_next, &memory_hole_list);
 }
 
+#ifdef ENABLE_SUPERPAGES
+
+/*
+ * Populates whole 2MB extents at an aligned pfn. The extent list is built in
+ * the first p2m slots of the range and expanded in place from the last extent
+ * down, so no slot is overwritten before it has been read.
+ */
+static long populate_superpages(unsigned long start_pfn, unsigned long nr_extents)
+{
+	struct xen_memory_reservation reservation = {
+			.address_bits = 0,
+			.extent_order = SUPERPAGE_ORDER,
+			.domid        = DOMID_SELF
+	};
+	unsigned long i, j;
+	long rc;
+
+	for (i = 0; i < nr_extents; i++) 
+	{
+		phys_to_machine_mapping[start_pfn + i] = start_pfn + i * SUPERPAGE_PAGES;
+	}
+
+	set_xen_guest_handle(reservation.extent_start, &phys_to_machine_mapping[start_pfn]);
+	reservation.nr_extents = nr_extents;
+	rc = HYPERVISOR_memory_op(XENMEM_populate_physmap, &reservation);
+	if (rc <= 0) return rc;
+
+	for (i = rc; i-- > 0; ) 
+	{
+		unsigned long mfn = phys_to_machine_mapping[start_pfn + i];
+		for (j = 0; j < SUPERPAGE_PAGES; j++) 
+		{
+			phys_to_machine_mapping[start_pfn + i * SUPERPAGE_PAGES + j] = mfn + j;
+		}
+	}
+	return rc * SUPERPAGE_PAGES;
+}
+
+#endif
+
 static long increase_reservation(unsigned long nr_pages, memory_hole_t *memory_hole) 
 {
 	struct xen_memory_reservation reservation = {
@@ -411,18 +941,40 @@ static long increase_reservation(unsigned long nr_pages, memory_hole_t *memory_h
 			.domid        = DOMID_SELF
 	};
 	int pfn;
+	long rc = 0;
+	int superpages = 0;
 
 	unsigned long start_pfn = memory_hole->start_pfn;
 	BUG_ON(memory_hole->end_pfn - memory_hole->start_pfn < nr_pages);
-	
-	for (pfn = 0; pfn < nr_pages; pfn++) 
+
+#ifdef ENABLE_SUPERPAGES
+	if (nr_pages >= SUPERPAGE_PAGES) 
 	{
-		phys_to_machine_mapping[start_pfn + pfn] = start_pfn + pfn;
+		unsigned long misalignment = start_pfn & (SUPERPAGE_PAGES - 1);
+		if (misalignment == 0) 
+		{
+			rc = populate_superpages(start_pfn, nr_pages / SUPERPAGE_PAGES);
+			superpages = rc > 0;
+		} 
+		else 
+		{
+			/* Bring the hole up to a 2MB boundary with small pages first */
+			nr_pages = SUPERPAGE_PAGES - misalignment;
+		}
 	}
+#endif
+
+	if (!superpages) 
+	{
+		for (pfn = 0; pfn < nr_pages; pfn++) 
+		{
+			phys_to_machine_mapping[start_pfn + pfn] = start_pfn + pfn;
+		}
 	
-	set_xen_guest_handle(reservation.extent_start, &phys_to_machine_mapping[start_pfn]);
-	reservation.nr_extents = nr_pages;
-	long rc = HYPERVISOR_memory_op(XENMEM_populate_physmap, &reservation);
+		set_xen_guest_handle(reservation.extent_start, &phys_to_machine_mapping[start_pfn]);
+		reservation.nr_extents = nr_pages;
+		rc = HYPERVISOR_memory_op(XENMEM_populate_physmap, &reservation);
+	}
 
 	if (rc > 0) 
 	{
@@ -434,8 +986,17 @@ static long increase_reservation(unsigned long nr_pages, memory_hole_t *memory_h
 				.pfn_alloc = pfn_linear_alloc
 		};
 
+		int mapped;
 		pfn_linear_tomap_env.pfn = start_pfn;
-		if (build_pagetable(pfn_to_virtu(start_pfn), pfn_to_virtu(start_pfn + rc), &pfn_linear_tomap_env, &pfn_frame_alloc_env)) 
+#ifdef ENABLE_SUPERPAGES
+		if (superpages) 
+		{
+			mapped = build_superpage_pagetable(pfn_to_virtu(start_pfn), pfn_to_virtu(start_pfn + rc), &pfn_linear_tomap_env, &pfn_frame_alloc_env);
+		}
+		else
+#endif
+		mapped = build_pagetable(pfn_to_virtu(start_pfn), pfn_to_virtu(start_pfn + rc), &pfn_linear_tomap_env, &pfn_frame_alloc_env);
+		if (mapped) 
 		{
 			arch_update_p2m(start_pfn, start_pfn + rc, 1);
 		} 
@@ -480,7 +1041,14 @@ static void init_page_allocator(char *cmd_line, unsigned long min, unsigned long
 	first_free_bulk_page = first_bulk_page;
 	num_free_bulk_pages = max - first_bulk_page;
 	memset(alloc_bitmap, ~0, bitmap_pages * 4096);
+#ifdef ENABLE_BUDDY_ALLOCATOR
+	num_free_pages = 0;
+	num_free_bulk_pages = 0;
+	buddy_init_zones();
+	buddy_free_range(first_alloc_page, max - min);
+#else
 	map_free(first_alloc_page, num_free_pages);
+#endif
 }
 
 static unsigned long demand_map_area_start;
@@ -570,6 +1138,249 @@ unsigned long allocate_ondemand(unsigned long n, unsigned long alignment)
     return demand_map_area_start + x * PAGE_SIZE;
 }
 
+unsigned long free_page_count(void)
+{
+	return num_free_pages;
+}
+
+void page_allocator_stats(unsigned long *free_pages, unsigned long *free_bulk_pages, unsigned long *cached_pages, unsigned long *largest_extent)
+{
+	unsigned long largest = 0;
+	int i;
+#ifndef ENABLE_BUDDY_ALLOCATOR
+	unsigned long page, end;
+#endif
+
+	spin_lock(&bitmap_lock);
+	*free_pages = num_free_pages;
+	*free_bulk_pages = num_free_bulk_pages;
+#ifdef ENABLE_BUDDY_ALLOCATOR
+	for (i = 0; i < BUDDY_NR_ZONES; i++) 
+	{
+		if (buddy_zones[i].free_mask == 0) continue;
+		if ((1UL << (63 - __builtin_clzl(buddy_zones[i].free_mask))) > largest) 
+		{
+			largest = 1UL << (63 - __builtin_clzl(buddy_zones[i].free_mask));
+		}
+	}
+#else
+	/* The bitmap engine has no free lists, so walk the free runs */
+	page = bitmap_find_next_zero(alloc_bitmap, first_alloc_page, end_alloc_page);
+	while (page < end_alloc_page) 
+	{
+		end = bitmap_find_next_set(alloc_bitmap, page, end_alloc_page);
+		if (end - page > largest) largest = end - page;
+		page = bitmap_find_next_zero(alloc_bitmap, end, end_alloc_page);
+	}
+#endif
+	spin_unlock(&bitmap_lock);
+	*largest_extent = largest;
+
+	*cached_pages = 0;
+	for (i = 0; i < MAX_VIRT_CPUS; i++) 
+	{
+		*cached_pages += page_caches[i].count;
+	}
+}
+
+long grow_reservation(unsigned long n)
+{
+	long rc;
+	LIST_HEAD(consumed);
+	spin_lock(&bitmap_lock);
+	rc = increase_memory_holding_lock(n, &consumed);
+	spin_unlock(&bitmap_lock);
+	memory_holes_free(&consumed);
+	return rc;
+}
+
+/* Maps a range back after unmap_linear_range(), returns 0 if it runs out of page table frames */
+static int remap_linear_range(unsigned long start_pfn, unsigned long n)
+{
+	struct pfn_alloc_env pfn_frame_alloc_env = {
+			.pfn_alloc = pfn_alloc_alloc
+	};
+
+	struct pfn_alloc_env pfn_linear_tomap_env = {
+			.pfn_alloc = pfn_linear_alloc
+	};
+
+	pfn_linear_tomap_env.pfn = start_pfn;
+#ifdef ENABLE_SUPERPAGES
+	if ((start_pfn & (SUPERPAGE_PAGES - 1)) == 0) 
+	{
+		return build_superpage_pagetable(pfn_to_virtu(start_pfn), pfn_to_virtu(start_pfn + n), &pfn_linear_tomap_env, &pfn_frame_alloc_env);
+	}
+#endif
+	return build_pagetable(pfn_to_virtu(start_pfn), pfn_to_virtu(start_pfn + n), &pfn_linear_tomap_env, &pfn_frame_alloc_env);
+}
+
+/* Returns 0 if the hypervisor refused any of the updates in a batch */
+static int unmap_batch(multicall_entry_t *call, int n)
+{
+	int i;
+	if (HYPERVISOR_multicall(call, n)) crash();
+	for (i = 0; i < n; i++) 
+	{
+		if (call[i].result != 0) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Removes the linear mapping of a range, clearing superpage entries as a
+ * whole. A superpage that the range only partly covers fails it before
+ * anything is unmapped; if the hypervisor refuses an update, whatever was
+ * unmapped is mapped back, so that on failure the range is left as it was.
+ */
+static int unmap_linear_range(unsigned long start_pfn, unsigned long n)
+{
+	unsigned long start = (unsigned long)pfn_to_virt(start_pfn);
+	unsigned long end = start + n * PAGE_SIZE;
+	unsigned long va;
+	multicall_entry_t call[64];
+	struct mmuext_op flush;
+	mmu_update_t update;
+	pgentry_t *pgt;
+	int i = 0, failed = 0;
+
+	for (va = start; va < end; va += PAGE_SIZE) 
+	{
+		pgt = get_pgt(va);
+		if (pgt != NULL && (*pgt & _PAGE_PSE)) 
+		{
+			if ((va & (SUPERPAGE_SIZE - 1)) || va + SUPERPAGE_SIZE > end) return 0;
+			va += SUPERPAGE_SIZE - PAGE_SIZE;
+		}
+	}
+
+	va = start;
+	while (va < end && !failed) 
+	{
+		pgt = get_pgt(va);
+		if (pgt != NULL && (*pgt & _PAGE_PSE)) 
+		{
+			update.ptr = virt_to_mach(pgt);
+			update.val = 0;
+			if (HYPERVISOR_mmu_update(&update, 1, NULL, DOMID_SELF) < 0) 
+			{
+				failed = 1;
+				break;
+			}
+			va += SUPERPAGE_SIZE;
+			continue;
+		}
+		call[i].op = __HYPERVISOR_update_va_mapping;
+		call[i].args[0] = va;
+		call[i].args[1] = 0;
+		call[i].args[2] = UVMF_NONE;
+		va += PAGE_SIZE;
+		if (++i == 64) 
+		{
+			failed = !unmap_batch(call, i);
+			i = 0;
+		}
+	}
+	if (!failed && i > 0) 
+	{
+		failed = !unmap_batch(call, i);
+	}
+
+	if (failed) 
+	{
+		/* Entries that were never unmapped are simply written again */
+		if (va > start && !remap_linear_range(start_pfn, (va - start) >> PAGE_SHIFT)) crash();
+		return 0;
+	}
+
+	flush.cmd = MMUEXT_TLB_FLUSH_ALL;
+	HYPERVISOR_mmuext_op(&flush, 1, NULL, DOMID_SELF);
+	return 1;
+}
+
+/*
+ * Returns up to n free bulk pages to the hypervisor, in chunks of at most a
+ * superpage, and records them as memory holes so that they can be populated
+ * again later. Returns the number of pages released.
+ */
+long shrink_reservation(unsigned long n)
+{
+	struct xen_memory_reservation reservation = {
+			.address_bits = 0,
+			.extent_order = 0,
+			.domid        = DOMID_SELF
+	};
+	unsigned long chunk = SUPERPAGE_PAGES;
+	unsigned long page, i;
+	long released = 0;
+	long rc;
+
+	while (released < n && chunk > 0) 
+	{
+		memory_hole_t *memory_hole;
+		LIST_HEAD(merged);
+		if (chunk > n - released) chunk = n - released;
+		memory_hole = xmalloc(memory_hole_t);
+		spin_lock(&bitmap_lock);
+		reservation_acquire();
+		page = __take_free_pages(chunk);
+		spin_unlock(&bitmap_lock);
+		if (page == 0 || !unmap_linear_range(page, chunk)) 
+		{
+			spin_lock(&bitmap_lock);
+			if (page != 0) __deallocate_pages(page, chunk);
+			reservation_release();
+			spin_unlock(&bitmap_lock);
+			xfree(memory_hole);
+			chunk >>= 1;
+			continue;
+		}
+
+		set_xen_guest_handle(reservation.extent_start, &phys_to_machine_mapping[page]);
+		reservation.nr_extents = chunk;
+		rc = HYPERVISOR_memory_op(XENMEM_decrease_reservation, &reservation);
+		if (rc != chunk) 
+		{
+			/* Xen stops at the first extent it cannot release, so the rest is still ours */
+			printk("decrease_reservation released %ld of %ld pages at %lx\n", rc, chunk, page);
+			if (rc < 0) rc = 0;
+			if (!remap_linear_range(page + rc, chunk - rc)) 
+			{
+				printk("Failed to map back %ld pages at %lx\n", chunk - rc, page + rc);
+			}
+			else 
+			{
+				spin_lock(&bitmap_lock);
+				__deallocate_pages(page + rc, chunk - rc);
+				spin_unlock(&bitmap_lock);
+			}
+		}
+		for (i = 0; i < rc; i++) 
+		{
+			phys_to_machine_mapping[page + i] = INVALID_P2M_ENTRY;
+		}
+		if (rc > 0) arch_update_p2m(page, page + rc, 0);
+
+		spin_lock(&bitmap_lock);
+		if (rc > 0) 
+		{
+			memory_hole->start_pfn = page;
+			memory_hole->end_pfn = page + rc;
+			memory_hole_insert(memory_hole, &merged);
+		}
+		else 
+		{
+			list_add(&memory_hole->memory_hole_next, &merged);
+		}
+		reservation_release();
+		spin_unlock(&bitmap_lock);
+		memory_holes_free(&merged);
+		released += rc;
+		if (rc < chunk) chunk >>= 1;
+	}
+	return released;
+}
+
 void arch_update_p2m(unsigned long start_pfn, unsigned long end_pfn, int adding)
 {
     unsigned long *l2_list;
@@ -627,8 +1438,19 @@ void init_mm(char *cmd_line)
 	unsigned long pt_pfn, max_pfn;
 	arch_init_mm(&pt_pfn, &max_pfn);
 	barrier();
+	init_numa();
 	init_page_allocator(cmd_line, pt_pfn, max_pfn);
 	resize_phys_to_machine_mapping_table();
 	arch_init_p2m(max_pfn, max_end_alloc_page);
 	arch_init_demand_mapping_area();
 }
+
+#ifdef ENABLE_SPINLOCK_STATS
+USED static int init_mm_lock_stats(void)
+{
+	spin_lock_stats_register(&bitmap_lock, "bitmap_lock", -1);
+	return 0;
+}
+
+DECLARE_INIT(init_mm_lock_stats);
+#endif
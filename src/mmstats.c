@@ -0,0 +1,338 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Allocator statistics. Counters are kept per CPU and only summed when they
+ * are read, so the allocation paths never share a cache line for accounting.
+ * Lock wait time is only measured when a lock is found to be held. Call sites
+ * are sampled, and their calls and bytes are scaled back up by the sample
+ * rate, so the site table holds estimates rather than exact counts.
+ *
+ * Writing anything to control/mm-stats prints the statistics on the console
+ * and publishes them under data/mm-stats.
+ */
+
+#include <os/config.h>
+
+#ifdef ENABLE_MM_STATS
+
+#include <os/kernel.h>
+#include <os/atomic.h>
+#include <os/mm.h>
+#include <os/sched.h>
+#include <os/smp.h>
+#include <os/xenbus.h>
+#include <os/xmalloc.h>
+#include <os/mmstats.h>
+
+struct mm_stats_cpu
+{
+	struct mm_stat_counters counters[MM_STAT_KINDS];
+	unsigned long sample;
+} __attribute__((aligned(64)));
+
+static struct mm_stats_cpu mm_stats_cpus[MAX_VIRT_CPUS];
+
+static struct mm_stat_site mm_stat_sites[MM_STAT_KINDS][MM_STATS_SITES];
+
+static unsigned long mm_stat_sites_dropped[MM_STAT_KINDS];
+
+static const char *mm_stat_names[MM_STAT_KINDS] = { "pages", "xmalloc" };
+
+static inline int mm_stat_bucket(unsigned long bytes)
+{
+	int bucket = bytes <= 1 ? 0 : 64 - __builtin_clzl(bytes - 1);
+	return bucket < MM_STATS_BUCKETS ? bucket : MM_STATS_BUCKETS - 1;
+}
+
+static void mm_stat_site_record(int kind, unsigned long site, unsigned long bytes)
+{
+	struct mm_stat_site *table = mm_stat_sites[kind];
+	unsigned long slot = (site >> 2) % MM_STATS_SITES;
+	unsigned long owner;
+	int i;
+
+	for (i = 0; i < MM_STATS_SITE_PROBES; i++, slot = (slot + 1) % MM_STATS_SITES)
+	{
+		owner = table[slot].site;
+		if (owner == 0)
+		{
+			owner = atomic_compare_exchange_x86_64(&table[slot].site, 0, site);
+		}
+		if (owner == 0 || owner == site)
+		{
+			atomic_exchange_add_x86_64(&table[slot].calls, MM_STATS_SITE_SAMPLE);
+			atomic_exchange_add_x86_64(&table[slot].bytes, bytes * MM_STATS_SITE_SAMPLE);
+			return;
+		}
+	}
+	atomic_exchange_add_x86_64(&mm_stat_sites_dropped[kind], 1);
+}
+
+void mm_stat_alloc(int kind, unsigned long bytes, void *site)
+{
+	struct mm_stats_cpu *stats;
+	struct mm_stat_counters *counters;
+
+	preempt_disable();
+	stats = &mm_stats_cpus[smp_processor_id()];
+	counters = &stats->counters[kind];
+	counters->calls++;
+	if (bytes == 0)
+	{
+		counters->failures++;
+	}
+	else
+	{
+		counters->bytes += bytes;
+		counters->histogram[mm_stat_bucket(bytes)]++;
+		if (++stats->sample == MM_STATS_SITE_SAMPLE)
+		{
+			stats->sample = 0;
+			mm_stat_site_record(kind, (unsigned long)site, bytes);
+		}
+	}
+	preempt_enable();
+}
+
+void mm_stat_free(int kind, unsigned long bytes)
+{
+	struct mm_stat_counters *counters;
+
+	preempt_disable();
+	counters = &mm_stats_cpus[smp_processor_id()].counters[kind];
+	counters->frees++;
+	counters->freed_bytes += bytes;
+	preempt_enable();
+}
+
+static inline unsigned long mm_stat_cycles(void)
+{
+	unsigned long cycles;
+	rdtscll(cycles);
+	return cycles;
+}
+
+static void mm_stat_lock_wait(int kind, unsigned long cycles)
+{
+	struct mm_stat_counters *counters;
+
+	preempt_disable();
+	counters = &mm_stats_cpus[smp_processor_id()].counters[kind];
+	counters->lock_waits++;
+	counters->lock_wait_cycles += cycles;
+	preempt_enable();
+}
+
+void mm_stat_spin_lock(spinlock_t *lock, int kind)
+{
+	unsigned long start;
+
+	if (likely(spin_can_lock(lock)))
+	{
+		spin_lock(lock);
+		return;
+	}
+	start = mm_stat_cycles();
+	spin_lock(lock);
+	mm_stat_lock_wait(kind, mm_stat_cycles() - start);
+}
+
+unsigned long mm_stat_spin_lock_irqsave(spinlock_t *lock, int kind)
+{
+	unsigned long start, flags;
+
+	if (likely(spin_can_lock(lock)))
+	{
+		return os_spin_lock_irqsave(lock);
+	}
+	start = mm_stat_cycles();
+	flags = os_spin_lock_irqsave(lock);
+	mm_stat_lock_wait(kind, mm_stat_cycles() - start);
+	return flags;
+}
+
+void mm_stats_read(struct mm_stats *stats)
+{
+	struct mm_stat_counters *from, *to;
+	int cpu, kind, i;
+
+	memset(stats, 0, sizeof(*stats));
+	for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++)
+	{
+		for (kind = 0; kind < MM_STAT_KINDS; kind++)
+		{
+			from = &mm_stats_cpus[cpu].counters[kind];
+			to = &stats->counters[kind];
+			to->calls += from->calls;
+			to->bytes += from->bytes;
+			to->failures += from->failures;
+			to->frees += from->frees;
+			to->freed_bytes += from->freed_bytes;
+			to->lock_waits += from->lock_waits;
+			to->lock_wait_cycles += from->lock_wait_cycles;
+			for (i = 0; i < MM_STATS_BUCKETS; i++)
+			{
+				to->histogram[i] += from->histogram[i];
+			}
+		}
+	}
+
+	page_allocator_stats(&stats->free_pages, &stats->free_bulk_pages, &stats->cached_pages, &stats->largest_free_extent);
+	xmalloc_stats(&stats->xmalloc_free_chunks, &stats->xmalloc_free_bytes, &stats->xmalloc_slabs);
+
+	/* Share of free memory, in thousandths, that lies outside the largest free extent */
+	if (stats->free_pages > 0)
+	{
+		stats->fragmentation = (stats->free_pages - stats->largest_free_extent) * 1000 / stats->free_pages;
+	}
+}
+
+/* Copies out the busiest call sites by bytes, returning how many were copied */
+int mm_stats_read_sites(int kind, struct mm_stat_site *sites, int max)
+{
+	struct mm_stat_site *table = mm_stat_sites[kind];
+	struct mm_stat_site site;
+	int count = 0, i, j;
+
+	for (i = 0; i < MM_STATS_SITES; i++)
+	{
+		if (table[i].site == 0) continue;
+		site = table[i];
+		if (count == max && sites[max - 1].bytes >= site.bytes) continue;
+		j = count < max ? count++ : max - 1;
+		while (j > 0 && sites[j - 1].bytes < site.bytes)
+		{
+			sites[j] = sites[j - 1];
+			j--;
+		}
+		sites[j] = site;
+	}
+	return count;
+}
+
+#define MM_STATS_TOP_SITES 8
+
+void mm_stats_dump(void)
+{
+	struct mm_stats stats;
+	struct mm_stat_site sites[MM_STATS_TOP_SITES];
+	struct mm_stat_counters *counters;
+	int kind, i, n;
+
+	mm_stats_read(&stats);
+	printk("mm: free %lu pages (%lu bulk, %lu cached), largest extent %lu, fragmentation %lu/1000\n",
+			stats.free_pages, stats.free_bulk_pages, stats.cached_pages, stats.largest_free_extent, stats.fragmentation);
+	printk("mm: xmalloc freelist %lu chunks (%lu bytes), %lu slabs\n",
+			stats.xmalloc_free_chunks, stats.xmalloc_free_bytes, stats.xmalloc_slabs);
+
+	for (kind = 0; kind < MM_STAT_KINDS; kind++)
+	{
+		counters = &stats.counters[kind];
+		printk("mm: %s calls %lu bytes %lu failures %lu frees %lu freed %lu lock waits %lu (%lu cycles)\n",
+				mm_stat_names[kind], counters->calls, counters->bytes, counters->failures,
+				counters->frees, counters->freed_bytes, counters->lock_waits, counters->lock_wait_cycles);
+		for (i = 0; i < MM_STATS_BUCKETS; i++)
+		{
+			if (counters->histogram[i] == 0) continue;
+			printk("mm: %s <= %lu bytes: %lu\n", mm_stat_names[kind], 1UL << i, counters->histogram[i]);
+		}
+		n = mm_stats_read_sites(kind, sites, MM_STATS_TOP_SITES);
+		for (i = 0; i < n; i++)
+		{
+			printk("mm: %s site %p: ~%lu calls ~%lu bytes\n", mm_stat_names[kind], (void *)sites[i].site, sites[i].calls, sites[i].bytes);
+		}
+		if (mm_stat_sites_dropped[kind] != 0)
+		{
+			printk("mm: %s sites dropped %lu\n", mm_stat_names[kind], mm_stat_sites_dropped[kind]);
+		}
+	}
+}
+
+static void mm_stats_write(const char *name, unsigned long value)
+{
+	char *err = xenbus_printf(XBT_NIL, "data/mm-stats", (char *)name, "%lu", value);
+	if (err) xfree(err);
+}
+
+void mm_stats_publish(void)
+{
+	struct mm_stats stats;
+	struct mm_stat_counters *counters;
+	char name[64];
+	int kind;
+
+	mm_stats_read(&stats);
+	mm_stats_write("free_pages", stats.free_pages);
+	mm_stats_write("free_bulk_pages", stats.free_bulk_pages);
+	mm_stats_write("cached_pages", stats.cached_pages);
+	mm_stats_write("largest_free_extent", stats.largest_free_extent);
+	mm_stats_write("fragmentation", stats.fragmentation);
+	mm_stats_write("xmalloc_free_chunks", stats.xmalloc_free_chunks);
+	mm_stats_write("xmalloc_free_bytes", stats.xmalloc_free_bytes);
+	mm_stats_write("xmalloc_slabs", stats.xmalloc_slabs);
+
+	for (kind = 0; kind < MM_STAT_KINDS; kind++)
+	{
+		counters = &stats.counters[kind];
+		sprintf(name, "%s_calls", mm_stat_names[kind]);
+		mm_stats_write(name, counters->calls);
+		sprintf(name, "%s_bytes", mm_stat_names[kind]);
+		mm_stats_write(name, counters->bytes);
+		sprintf(name, "%s_failures", mm_stat_names[kind]);
+		mm_stats_write(name, counters->failures);
+		sprintf(name, "%s_frees", mm_stat_names[kind]);
+		mm_stats_write(name, counters->frees);
+		sprintf(name, "%s_lock_waits", mm_stat_names[kind]);
+		mm_stats_write(name, counters->lock_waits);
+		sprintf(name, "%s_lock_wait_cycles", mm_stat_names[kind]);
+		mm_stats_write(name, counters->lock_wait_cycles);
+	}
+}
+
+static void mm_stats_watch_fn(void *data)
+{
+	char *path, *value, *err;
+
+	xenbus_watch_path(XBT_NIL, "control/mm-stats", "mm-stats");
+	for (;;)
+	{
+		path = xenbus_read_watch("mm-stats");
+		xfree(path);
+		err = xenbus_read(XBT_NIL, "control/mm-stats", &value);
+		if (err)
+		{
+			xfree(err);
+			continue;
+		}
+		xfree(value);
+		mm_stats_dump();
+		mm_stats_publish();
+		err = xenbus_rm(XBT_NIL, "control/mm-stats");
+		if (err) xfree(err);
+	}
+}
+
+USED static int init_mm_stats(void)
+{
+	create_thread("mm_stats", mm_stats_watch_fn, UKERNEL_FLAG, NULL);
+	return 0;
+}
+
+DECLARE_INIT(init_mm_stats);
+
+#endif
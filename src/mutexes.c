@@ -33,50 +33,190 @@
 #include <os/xmalloc.h>
 #include <os/xenbus.h>
 
+/*
+ * A contended mutex_lock() first spins while the owner is running on
+ * another processor, since it is likely to let go soon. Otherwise it queues
+ * up and sleeps. mutex_unlock() releases the mutex and wakes the first
+ * waiter, which then competes with anybody who arrived in the meantime. A
+ * waiter that has already lost that race once gets the mutex handed over
+ * directly on the next unlock, so it cannot be starved.
+ */
+
+struct mutex_waiter
+{
+	struct list_head list;
+	struct thread *thread;
+	int granted;
+	int lost;
+};
+
+static inline int mutex_acquire(mutex_t *m)
+{
+	return m->owner == NULL && synch_cmpxchg(&m->owner, NULL, current) == NULL;
+}
+
+static int mutex_spin(mutex_t *m)
+{
+	struct thread *owner;
+	int spins;
+
+	for (spins = 0; spins < MUTEX_SPIN_LIMIT; spins++)
+	{
+		owner = m->owner;
+		if (owner == NULL)
+		{
+			if (mutex_acquire(m))
+			{
+				return 1;
+			}
+			continue;
+		}
+
+		if (!is_running(owner) || owner->cpu == smp_processor_id() || need_resched(current))
+		{
+			break;
+		}
+		relax();
+	}
+
+	return 0;
+}
+
+/* Sleeps until the mutex is ours or, unless it is 0, the deadline passes */
+static int mutex_lock_slow(mutex_t *m, s_time_t deadline)
+{
+	struct thread *thread = current;
+	struct mutex_waiter waiter;
+	DEFINE_SLEEP_QUEUE(sq);
+	int acquired;
+
+	if (mutex_spin(m))
+	{
+		return 1;
+	}
+
+	waiter.thread = thread;
+	waiter.granted = 0;
+	waiter.lost = 0;
+
+	spin_lock(&m->lock);
+	list_add_tail(&waiter.list, &m->waiters);
+	m->nr_waiters++;
+	mb();
+	for (;;)
+	{
+		/* Retried after we are counted, so that an unlock that found no
+		 * waiters cannot slip past unnoticed */
+		if (waiter.granted || mutex_acquire(m))
+		{
+			acquired = 1;
+			break;
+		}
+
+		if (deadline != 0 && NOW() >= deadline)
+		{
+			acquired = 0;
+			break;
+		}
+
+		block(thread);
+		if (deadline != 0)
+		{
+			sq.timeout = deadline;
+			set_sleeping(thread);
+			sleep_queue_add(&sq);
+		}
+		spin_unlock(&m->lock);
+		schedule();
+		if (is_sleeping(thread))
+		{
+			clear_sleeping(thread);
+			sleep_queue_del(&sq);
+		}
+		spin_lock(&m->lock);
+		waiter.lost = 1;
+	}
+
+	if (!waiter.granted)
+	{
+		list_del(&waiter.list);
+		m->nr_waiters--;
+	}
+	spin_unlock(&m->lock);
+
+	return acquired;
+}
+
+void mutex_init(mutex_t *m)
+{
+	m->owner = NULL;
+	m->nr_waiters = 0;
+	spin_lock_init(&m->lock);
+	INIT_LIST_HEAD(&m->waiters);
+	m->name[0] = '\0';
+}
+
 mutex_t* mutex_create()
 {
 	struct mutex_t * m = (struct mutex_t*) xmalloc(struct mutex_t);
-	m->lock = create_spin_lock();
+	mutex_init(m);
 	return m;
 }
 
 void mutex_lock(mutex_t *m)
 {
-	os_spin_lock(m->lock);
+	if (!mutex_acquire(m))
+	{
+		mutex_lock_slow(m, 0);
+	}
 }
 
 void mutex_unlock(mutex_t *m)
 {
-	spin_unlock(m->lock);
+	struct mutex_waiter *waiter;
+
+	BUG_ON(m->owner != current);
+	(void)xchg(&m->owner, NULL);
+	if (m->nr_waiters == 0)
+	{
+		return;
+	}
+
+	spin_lock(&m->lock);
+	if (!list_empty(&m->waiters))
+	{
+		waiter = list_entry(m->waiters.next, struct mutex_waiter, list);
+		if (waiter->lost && synch_cmpxchg(&m->owner, NULL, waiter->thread) == NULL)
+		{
+			waiter->granted = 1;
+			list_del(&waiter->list);
+			m->nr_waiters--;
+		}
+		wake(waiter->thread);
+	}
+	spin_unlock(&m->lock);
 }
 
 void mutex_delete(mutex_t *m)
 {
-	delete_spin_lock(m->lock);
+	BUG_ON(m->nr_waiters != 0);
 	xfree(m);
 }
 
 int mutex_try_lock(mutex_t *m)
 {
-	int result = 0;
-	if(arch_spin_can_lock(m->lock))
-	{
-		os_spin_lock(m->lock);
-		result = 1;
-	}
-	return result;
+	return mutex_acquire(m);
 }
 
 int mutex_timed_lock(mutex_t *m, unsigned int timeout)
 {
-	s_time_t end_time;
-	end_time = NOW() + MILLISECS(timeout);
-	while(NOW() < end_time)
+	if (mutex_acquire(m))
 	{
-		if (mutex_try_lock(m) == 1)
-		{
-			return 1;
-		}
+		return 1;
 	}
-	return 0;
+	if (timeout == 0)
+	{
+		return 0;
+	}
+	return mutex_lock_slow(m, NOW() + MILLISECS(timeout));
 }
@@ -0,0 +1,168 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <os/numa.h>
+#include <os/mm.h>
+#include <os/lib.h>
+#include <public/memory.h>
+
+struct numa_range
+{
+	unsigned long start_pfn;
+	unsigned long end_pfn;
+	unsigned int node;
+};
+
+int numa_nr_nodes = 1;
+
+unsigned char numa_cpu_to_node[MAX_VIRT_CPUS];
+
+static struct numa_range numa_ranges[MAX_NUMA_RANGES];
+
+static int numa_nr_ranges;
+
+/* Nodes ordered by distance from each node, the node itself first */
+static unsigned char numa_fallback[MAX_NUMA_NODES][MAX_NUMA_NODES];
+
+static xen_vmemrange_t vmemranges[MAX_NUMA_RANGES];
+
+static unsigned int vdistance[MAX_NUMA_NODES * MAX_NUMA_NODES];
+
+static unsigned int vcpu_to_vnode[MAX_VIRT_CPUS];
+
+/*
+ * Returns the node that owns pfn together with the bounds of the contiguous
+ * range it lies in. Pages outside every range belong to node 0 and are
+ * bounded by the neighbouring ranges.
+ */
+int numa_pfn_to_node(unsigned long pfn, unsigned long *start_pfn, unsigned long *end_pfn)
+{
+	int i;
+	*start_pfn = 0;
+	*end_pfn = ~0UL;
+	for (i = 0; i < numa_nr_ranges; i++)
+	{
+		if (pfn < numa_ranges[i].start_pfn)
+		{
+			*end_pfn = numa_ranges[i].start_pfn;
+			break;
+		}
+		if (pfn < numa_ranges[i].end_pfn)
+		{
+			*start_pfn = numa_ranges[i].start_pfn;
+			*end_pfn = numa_ranges[i].end_pfn;
+			return numa_ranges[i].node;
+		}
+		*start_pfn = numa_ranges[i].end_pfn;
+	}
+	return 0;
+}
+
+int numa_fallback_node(int node, int n)
+{
+	return numa_fallback[node][n];
+}
+
+static void numa_single_node(void)
+{
+	numa_nr_nodes = 1;
+	numa_nr_ranges = 0;
+	memset(numa_cpu_to_node, 0, sizeof(numa_cpu_to_node));
+	numa_fallback[0][0] = 0;
+}
+
+static void numa_sort_ranges(void)
+{
+	int i, j;
+	for (i = 1; i < numa_nr_ranges; i++)
+	{
+		struct numa_range range = numa_ranges[i];
+		for (j = i; j > 0 && numa_ranges[j - 1].start_pfn > range.start_pfn; j--)
+		{
+			numa_ranges[j] = numa_ranges[j - 1];
+		}
+		numa_ranges[j] = range;
+	}
+}
+
+static void numa_build_fallback(void)
+{
+	int node, i, j;
+	for (node = 0; node < numa_nr_nodes; node++)
+	{
+		unsigned int *distance = &vdistance[node * numa_nr_nodes];
+		for (i = 0; i < numa_nr_nodes; i++)
+		{
+			numa_fallback[node][i] = i;
+		}
+		numa_fallback[node][0] = node;
+		numa_fallback[node][node] = 0;
+		for (i = 1; i < numa_nr_nodes; i++)
+		{
+			for (j = i; j > 1 && distance[numa_fallback[node][j - 1]] > distance[numa_fallback[node][j]]; j--)
+			{
+				unsigned char tmp = numa_fallback[node][j];
+				numa_fallback[node][j] = numa_fallback[node][j - 1];
+				numa_fallback[node][j - 1] = tmp;
+			}
+		}
+	}
+}
+
+void init_numa(void)
+{
+	struct xen_vnuma_topology_info topology = {
+			.domid = DOMID_SELF,
+			.nr_vnodes = MAX_NUMA_NODES,
+			.nr_vcpus = MAX_VIRT_CPUS,
+			.nr_vmemranges = MAX_NUMA_RANGES
+	};
+	int i, rc;
+
+	set_xen_guest_handle(topology.vdistance.h, vdistance);
+	set_xen_guest_handle(topology.vcpu_to_vnode.h, vcpu_to_vnode);
+	set_xen_guest_handle(topology.vmemrange.h, vmemranges);
+
+	numa_single_node();
+	rc = HYPERVISOR_memory_op(XENMEM_get_vnumainfo, &topology);
+	if (rc < 0 || topology.nr_vnodes <= 1)
+	{
+		printk("NUMA: single node (%d)\n", rc);
+		return;
+	}
+
+	numa_nr_nodes = topology.nr_vnodes;
+	numa_nr_ranges = topology.nr_vmemranges;
+	for (i = 0; i < numa_nr_ranges; i++)
+	{
+		numa_ranges[i].start_pfn = vmemranges[i].start >> PAGE_SHIFT;
+		numa_ranges[i].end_pfn = vmemranges[i].end >> PAGE_SHIFT;
+		numa_ranges[i].node = vmemranges[i].nid < numa_nr_nodes ? vmemranges[i].nid : 0;
+	}
+	for (i = 0; i < topology.nr_vcpus && i < MAX_VIRT_CPUS; i++)
+	{
+		numa_cpu_to_node[i] = vcpu_to_vnode[i] < numa_nr_nodes ? vcpu_to_vnode[i] : 0;
+	}
+	numa_sort_ranges();
+	numa_build_fallback();
+
+	printk("NUMA: %d nodes\n", numa_nr_nodes);
+	for (i = 0; i < numa_nr_ranges; i++)
+	{
+		printk("    node %d    : %lx-%lx\n", numa_ranges[i].node, numa_ranges[i].start_pfn, numa_ranges[i].end_pfn);
+	}
+}
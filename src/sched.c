@@ -70,60 +70,185 @@
 #include <os/types.h>
 #include <os/lib.h>
 #include <os/mutexes.h>
+#include <os/schedtrace.h>
 
 #define DEFAULT_TIMESLICE_MS 	20
 
 #define DEFAULT_SLEEP_MS 		1
 
+#define MIN_TIMESLICE			MILLISECS(1)
+#define MAX_TIMESLICE			SECONDS(1)
+
+/* An adaptive timeslice never grows past this multiple of the default */
+#define ADAPTIVE_TIMESLICE_SCALE	4
+
 static long timeslice = MILLISECS(DEFAULT_TIMESLICE_MS);
 
-static uint16_t thread_id = MAX_VIRT_CPUS;
 
 struct thread * sched_current_thread()
 {
 	return current;
 }
 
-static LIST_HEAD(ready_queue);
-static DEFINE_SPINLOCK(ready_lock);
+/* One list per priority level; bit n of 'levels' is set while queues[n] is
+ * non-empty, and lower indices are more urgent so __ffs() finds the top */
+struct runqueue
+{
+	spinlock_t lock;
+	unsigned long levels;
+	struct list_head queues[SCHED_PRIO_LEVELS];
+	int nr_queued;
+	int tick_stopped;		/* the running thread has nobody to share with */
+};
+
+static struct runqueue runqueues[MAX_VIRT_CPUS];
+
+#ifdef ENABLE_TICKLESS
+/* Processors about to block, or blocked, in the hypervisor with nothing to do */
+static unsigned long idle_cpus;
+#endif
+
+/* Sleepers live in a hierarchical timer wheel on the processor that armed
+ * them. Level 0 has one slot per tick, each level above covers WHEEL_SIZE
+ * slots of the one below and is cascaded down as the wheel turns */
+#define TIMER_TICK_SHIFT		16
+#define TIMER_TICK				(1LL << TIMER_TICK_SHIFT)
+#define WHEEL_BITS				6
+#define WHEEL_SIZE				(1 << WHEEL_BITS)
+#define WHEEL_MASK				(WHEEL_SIZE - 1)
+#define WHEEL_LEVELS			4
+#define WHEEL_RANGE				(1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct timer_wheel
+{
+	spinlock_t lock;
+	u64 clk;
+	s_time_t next_expiry;
+	int count;
+	int pending[WHEEL_LEVELS];
+	struct list_head slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
 
-static LIST_HEAD(sleep_queue);
-static DEFINE_SPINLOCK(sleep_lock);
+static struct timer_wheel timer_wheels[MAX_VIRT_CPUS];
 
 static LIST_HEAD(dead_queue);
 static DEFINE_SPINLOCK(dead_lock);
 
+/* FP save areas are packed into pages rather than taking one each */
+#define FP_AREA_SIZE	((fp_area_size + 63) & ~63UL)
+
+static void *fp_area_free;
+static DEFINE_SPINLOCK(fp_area_lock);
+
+#ifdef ENABLE_THREAD_CACHE
+static LIST_HEAD(thread_cache);
+static DEFINE_SPINLOCK(thread_cache_lock);
+static int thread_cache_count;
+#endif
+
 DEFINE_SPINLOCK(thread_list_lock);
 LIST_HEAD(thread_list);
 
-struct thread * sched_get_thread(uint16_t id)
+/* Threads by id, in a two level radix table whose leaves are allocated as
+ * ids are first handed out. Each slot counts the threads that have held
+ * its id, so a stale (generation, id) handle never finds a newer thread */
+#define THREAD_TABLE_SHIFT	8
+#define THREAD_TABLE_SIZE	(1 << THREAD_TABLE_SHIFT)
+
+struct thread_slot
 {
 	struct thread *thread;
-	struct list_head *list_head;
+	uint16_t gen;
+};
+
+static struct thread_slot *thread_table[MAX_THREADS / THREAD_TABLE_SIZE];
+static unsigned int next_thread_id = MAX_VIRT_CPUS;
+
+static inline struct thread_slot *thread_slot(unsigned int id)
+{
+	struct thread_slot *leaf = thread_table[id >> THREAD_TABLE_SHIFT];
+	return leaf == NULL ? NULL : &leaf[id & (THREAD_TABLE_SIZE - 1)];
+}
+
+struct thread * sched_get_thread(uint16_t id)
+{
+	struct thread_slot *slot;
+	struct thread *thread = NULL;
+
 	spin_lock(&thread_list_lock);
-	list_for_each(list_head, &thread_list)
-    {
-		thread = list_entry(list_head, struct thread, thread_list);
-		if(thread->id == id)
-		{
-			spin_unlock(&thread_list_lock);
-			return thread;
-		}
+	slot = thread_slot(id);
+	if (slot != NULL)
+	{
+		thread = slot->thread;
 	}
 	spin_unlock(&thread_list_lock);
-	return NULL;
+	return thread;
+}
+
+u32 sched_thread_handle(struct thread *thread)
+{
+	return ((u32)thread->gen << 16) | thread->id;
+}
+
+/* Returns NULL once the thread the handle was taken from has been reaped */
+struct thread *sched_get_thread_handle(u32 handle)
+{
+	struct thread_slot *slot;
+	struct thread *thread = NULL;
+
+	spin_lock(&thread_list_lock);
+	slot = thread_slot(handle & (MAX_THREADS - 1));
+	if (slot != NULL && slot->gen == (handle >> 16))
+	{
+		thread = slot->thread;
+	}
+	spin_unlock(&thread_list_lock);
+	return thread;
 }
 
-static void sched_add_thread_list(struct thread *thread)
+/* Gives the thread the next free id. Returns -1 if all are taken */
+static int sched_add_thread_list(struct thread *thread)
 {
+	struct thread_slot *slot;
+	unsigned int id, n;
+
 	spin_lock(&thread_list_lock);
-	list_add_tail(&thread->thread_list, &thread_list);
+	for (n = MAX_VIRT_CPUS; n < MAX_THREADS; n++)
+	{
+		id = next_thread_id;
+		next_thread_id = id + 1 < MAX_THREADS ? id + 1 : MAX_VIRT_CPUS;
+
+		if (thread_table[id >> THREAD_TABLE_SHIFT] == NULL)
+		{
+			slot = xmalloc_array(struct thread_slot, THREAD_TABLE_SIZE);
+			if (slot == NULL)
+			{
+				break;
+			}
+			memset(slot, 0, THREAD_TABLE_SIZE * sizeof(struct thread_slot));
+			thread_table[id >> THREAD_TABLE_SHIFT] = slot;
+		}
+
+		slot = thread_slot(id);
+		if (slot->thread == NULL)
+		{
+			slot->thread = thread;
+			slot->gen++;
+			thread->id = id;
+			thread->gen = slot->gen;
+			list_add_tail(&thread->thread_list, &thread_list);
+			spin_unlock(&thread_list_lock);
+			return 0;
+		}
+	}
 	spin_unlock(&thread_list_lock);
+	return -1;
 }
 
 static void sched_del_thread_list(struct thread *thread)
 {
 	spin_lock(&thread_list_lock);
+	thread_slot(thread->id)->thread = NULL;
 	list_del_init(&thread->thread_list);
 	spin_unlock(&thread_list_lock);
 }
@@ -133,25 +258,386 @@ void os_sched_delete(struct thread *thread)
 	sched_del_thread_list(thread);
 }
 
+static inline int sched_cpu_usable(int cpu)
+{
+	return per_cpu(cpu, cpu_state) == CPU_UP || per_cpu(cpu, cpu_state) == CPU_SLEEPING;
+}
+
+/* Place a thread that has no processor yet on the least loaded one */
+static int sched_select_cpu(void)
+{
+	int cpu, best;
+
+	best = smp_processor_id();
+	if (!sched_cpu_usable(best))
+	{
+		best = 0;
+	}
+
+	for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++)
+	{
+		if (sched_cpu_usable(cpu) && runqueues[cpu].nr_queued < runqueues[best].nr_queued)
+		{
+			best = cpu;
+		}
+	}
+
+	return best;
+}
+
+/* Lock the run queue a thread belongs to. thread->cpu only changes with the
+ * old and the new queue locked, so recheck it once the lock is held */
+static struct runqueue *thread_rq_lock(struct thread *thread, long *flags)
+{
+	struct runqueue *rq;
+	unsigned int cpu;
+
+	for (;;)
+	{
+		cpu = thread->cpu;
+		if (cpu == -1)
+		{
+			cpu = sched_select_cpu();
+		}
+
+		rq = &runqueues[cpu];
+		spin_lock_irqsave(&rq->lock, *flags);
+
+		if (thread->cpu == -1)
+		{
+			thread->cpu = cpu;
+		}
+
+		if (thread->cpu == cpu)
+		{
+			return rq;
+		}
+
+		spin_unlock_irqrestore(&rq->lock, *flags);
+	}
+}
+
+static inline int sched_level(struct thread *thread)
+{
+	int prio = thread->prio;
+
+	if (thread->policy != SCHED_POLICY_OTHER)
+	{
+		prio += SCHED_PRIO_MAX + 1;
+	}
+
+	return SCHED_PRIO_LEVELS - 1 - prio;
+}
+
+static inline void rq_enqueue(struct runqueue *rq, struct thread *thread)
+{
+	int level = sched_level(thread);
+
+	list_add_tail(&thread->ready_list, &rq->queues[level]);
+	rq->levels |= 1UL << level;
+	rq->nr_queued++;
+}
+
+static inline void rq_enqueue_head(struct runqueue *rq, struct thread *thread)
+{
+	int level = sched_level(thread);
+
+	list_add(&thread->ready_list, &rq->queues[level]);
+	rq->levels |= 1UL << level;
+	rq->nr_queued++;
+}
+
+static inline void rq_dequeue(struct runqueue *rq, struct thread *thread)
+{
+	int level = sched_level(thread);
+
+	if (!list_empty(&thread->ready_list))
+	{
+		list_del_init(&thread->ready_list);
+		if (list_empty(&rq->queues[level]))
+		{
+			rq->levels &= ~(1UL << level);
+		}
+		rq->nr_queued--;
+	}
+}
+
+#ifdef ENABLE_TICKLESS
+/* Start enforcing the timeslice of the thread running on this processor.
+ * Called with the run queue locked */
+static void rq_restart_tick(struct runqueue *rq, struct thread *running)
+{
+	if (rq->tick_stopped)
+	{
+		rq->tick_stopped = 0;
+		running->resched_running_time = get_running_time() + running->timeslice;
+		set_timer_interrupt(running->timeslice);
+	}
+}
+
+void sched_restart_tick(void)
+{
+	struct runqueue *rq = &runqueues[smp_processor_id()];
+	long flags;
+
+	spin_lock_irqsave(&rq->lock, flags);
+	if (current != this_cpu(idle_thread))
+	{
+		rq_restart_tick(rq, current);
+	}
+	spin_unlock_irqrestore(&rq->lock, flags);
+}
+
+/* Program the one-shot timer for the earliest thing this processor has to
+ * do: the end of next's timeslice if anyone is queued behind it, and the
+ * first sleeper to expire. Deadlines within TIMER_SLACK share one interrupt */
+static void sched_arm_timer(struct thread *next, int cpu, u64 running_time)
+{
+	s_time_t deadline, expiry;
+
+	/* The idle thread programs the timer as it blocks */
+	if (next == per_cpu(cpu, idle_thread))
+	{
+		return;
+	}
+
+	deadline = LLONG_MAX;
+	if (runqueues[cpu].tick_stopped)
+	{
+		next->resched_running_time = 0;
+	}
+	else
+	{
+		next->resched_running_time = running_time + next->timeslice;
+		deadline = NOW() + next->timeslice;
+	}
+
+	expiry = timer_wheels[cpu].next_expiry;
+	if (expiry < deadline)
+	{
+		if (deadline - expiry > TIMER_SLACK)
+		{
+			deadline = expiry;
+		}
+	}
+	else if (expiry - deadline <= TIMER_SLACK)
+	{
+		deadline = expiry;
+	}
+
+	if (deadline != LLONG_MAX)
+	{
+		set_timer_deadline(deadline);
+	}
+}
+#endif
+
+int sched_timers_due(void)
+{
+	return NOW() >= timer_wheels[smp_processor_id()].next_expiry;
+}
+
+/* LLONG_MAX while no sleeper is queued here, including before init_sched() */
+s_time_t sched_next_expiry(void)
+{
+	struct timer_wheel *w = &timer_wheels[smp_processor_id()];
+	return w->count != 0 ? w->next_expiry : LLONG_MAX;
+}
+
+/* Lock two run queues in address order. Interrupts must be off */
+static inline void rq_double_lock(struct runqueue *a, struct runqueue *b)
+{
+	if (a == b)
+	{
+		spin_lock(&a->lock);
+	}
+	else if (a < b)
+	{
+		spin_lock(&a->lock);
+		spin_lock(&b->lock);
+	}
+	else
+	{
+		spin_lock(&b->lock);
+		spin_lock(&a->lock);
+	}
+}
+
+static inline void rq_double_unlock(struct runqueue *a, struct runqueue *b)
+{
+	spin_unlock(&a->lock);
+	if (a != b)
+	{
+		spin_unlock(&b->lock);
+	}
+}
+
+/* A woken thread normally goes back to the processor whose cache it warmed.
+ * It is pulled over to the waker's processor instead when the waker tends
+ * to block right after its wakeups, as producer/consumer pairs do, or when
+ * its old processor is busy with somebody else and ours is less so */
+static int sched_wake_affine(struct thread *thread, int cpu)
+{
+	int prev = thread->cpu;
+
+	if (prev == cpu || in_irq() || is_running(thread) || per_cpu(cpu, cpu_state) != CPU_UP)
+	{
+		return 0;
+	}
+
+	if (current->wake_sync)
+	{
+		return 1;
+	}
+
+	return per_cpu(prev, current_thread) != per_cpu(prev, idle_thread) &&
+		runqueues[cpu].nr_queued < runqueues[prev].nr_queued;
+}
+
+/* thread_rq_lock() for a thread about to be woken, moving it over to this
+ * processor first if sched_wake_affine() says so */
+static struct runqueue *thread_rq_lock_wake(struct thread *thread, long *flags)
+{
+	struct runqueue *rq;
+
+	rq = thread_rq_lock(thread, flags);
+	if (!is_runnable(thread) && list_empty(&thread->ready_list) && sched_wake_affine(thread, smp_processor_id()))
+	{
+		sched_trace_event(SCHED_TRACE_MIGRATE, thread, thread->cpu, smp_processor_id());
+		thread->cpu = smp_processor_id();
+		spin_unlock_irqrestore(&rq->lock, *flags);
+		rq = thread_rq_lock(thread, flags);
+	}
+
+	return rq;
+}
+
+static inline void sched_note_wakeup(struct thread *thread)
+{
+	if (!in_irq())
+	{
+		current->woke_other = 1;
+		current->last_wakee = sched_thread_handle(thread);
+	}
+}
+
+/* Make the processor a thread was just queued on reschedule if the thread
+ * outranks whatever is running there. Called with the run queue locked */
+static void sched_check_preempt(struct thread *thread)
+{
+	struct thread *running;
+	int cpu = thread->cpu;
+
+	running = per_cpu(cpu, current_thread);
+	if (running == NULL || running == thread || running == per_cpu(cpu, idle_thread))
+	{
+		return;
+	}
+
+#ifdef ENABLE_TICKLESS
+	/* Let an idle processor come and steal the thread, unless it was queued
+	 * here because we are about to block */
+	if ((cpu != smp_processor_id() || !current->wake_sync) && (idle_cpus & ~(1UL << cpu)))
+	{
+		smp_notify_cpu(__ffs(idle_cpus & ~(1UL << cpu)));
+	}
+
+	if (sched_level(thread) >= sched_level(running))
+	{
+		/* The running thread's timeslice now matters again */
+		if (runqueues[cpu].tick_stopped)
+		{
+			if (cpu == smp_processor_id())
+			{
+				rq_restart_tick(&runqueues[cpu], running);
+			}
+			else
+			{
+				smp_restart_tick(cpu);
+			}
+		}
+		return;
+	}
+#else
+	if (sched_level(thread) >= sched_level(running))
+	{
+		return;
+	}
+#endif
+
+	if (cpu == smp_processor_id())
+	{
+		set_need_resched(current);
+	}
+	else
+	{
+		smp_preempt_cpu(cpu);
+	}
+}
+
+/* Makes a thread runnable. A thread woken by current is placed with
+ * sched_wake_affine() and remembered for directed yields; one whose timer
+ * expired was woken by nobody, so it stays where it was and current does
+ * not learn from it */
+static void sched_wake(struct thread *thread, int by_current)
+{
+    thread->regs = NULL;
+    BUG_ON(is_dying(thread));
+    if (!is_runnable(thread)) 
+	{
+        struct runqueue *rq;
+        long flags;
+        rq = by_current ? thread_rq_lock_wake(thread, &flags) : thread_rq_lock(thread, &flags);
+        if(!is_runnable(thread) && !(is_hibernating(thread) || is_suspended(thread)) ) 
+		{
+            BUG_ON(is_runnable(thread));
+            set_runnable(thread);
+            rq_enqueue(rq, thread);
+            sched_trace_wake(thread);
+            if (by_current)
+            {
+                sched_note_wakeup(thread);
+            }
+            sched_check_preempt(thread);
+        }
+        spin_unlock_irqrestore(&rq->lock, flags);
+        if (!(is_hibernating(thread) || is_suspended(thread)) && thread->cpu != smp_processor_id()) sched_kick_processor(thread->cpu);
+    }
+}
+
 void sched_print_ready_queue()
 {
 	struct list_head *it;
 	struct thread *th;
+	struct runqueue *rq;
 	long flags;
-	int i;
-	printk("Scheduler's ready queue [queue %lx, lock %lx, timestamp %ld]:\n", &ready_queue, &ready_lock, NOW());
+	int i, cpu, level;
+	printk("Scheduler's ready queues [timestamp %ld]:\n", NOW());
 	th = current;
 	printk("\tCurrent thread \"%s\", id=%d, flags %x, cpu %d\n", th->name, th->id, th->flags, th->cpu);
-	i =0 ;
-	spin_lock_irqsave(&ready_lock, flags);
-	list_for_each(it, &ready_queue)
+	for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++)
 	{
-		BUG_ON(++i > thread_id);
-		th = list_entry(it, struct thread, ready_list);
-		printk("\tThread \"%s\", id=%d, flags %x, cpu %d\n", th->name, th->id, th->flags, th->cpu);
+		rq = &runqueues[cpu];
+		if (rq->levels == 0)
+		{
+			continue;
+		}
+
+		i = 0;
+		spin_lock_irqsave(&rq->lock, flags);
+		printk("  cpu %d [levels %lx, %d threads]:\n", cpu, rq->levels, rq->nr_queued);
+		for (level = 0; level < SCHED_PRIO_LEVELS; level++)
+		{
+			list_for_each(it, &rq->queues[level])
+			{
+				BUG_ON(++i > MAX_THREADS);
+				th = list_entry(it, struct thread, ready_list);
+				printk("\tThread \"%s\", id=%d, flags %x, cpu %d, policy %d, prio %d\n", th->name, th->id, th->flags, th->cpu, th->policy, th->prio);
+			}
+		}
+		spin_unlock_irqrestore(&rq->lock, flags);
 	}
 	printk("\n");
-	spin_unlock_irqrestore(&ready_lock, flags);
 }
 
 void sched_print_sleep_queue()
@@ -159,20 +645,35 @@ void sched_print_sleep_queue()
 	struct list_head *it;
 	struct thread *th;
 	struct sleep_queue *sq;
-	int i;
+	struct timer_wheel *w;
+	int cpu, level, slot;
 	long flags;
-	printk("Scheduler's sleep queue [queue %lx, lock %lx, timestamp %ld]:\n", &sleep_queue, &sleep_lock, NOW());
-	i = 0;
-	spin_lock_irqsave(&sleep_lock, flags);
-	list_for_each(it, &sleep_queue)
+	printk("Scheduler's sleep queues [timestamp %ld]:\n", NOW());
+	for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++)
 	{
-		BUG_ON(++i > thread_id);
-		sq = list_entry(it, struct sleep_queue, list);
-		th = sq->thread;
-		printk("\tThread \"%s\", id=%d, flags %x, wakeup %ld, \n", th->name, th->id, th->flags, sq->timeout);
+		w = &timer_wheels[cpu];
+		if (w->count == 0)
+		{
+			continue;
+		}
+
+		spin_lock_irqsave(&w->lock, flags);
+		printk("  cpu %d [%d timers, tick %lu, next %ld]:\n", cpu, w->count, w->clk, w->next_expiry);
+		for (level = 0; level < WHEEL_LEVELS; level++)
+		{
+			for (slot = 0; slot < WHEEL_SIZE; slot++)
+			{
+				list_for_each(it, &w->slots[level][slot])
+				{
+					sq = list_entry(it, struct sleep_queue, list);
+					th = sq->thread;
+					printk("\tThread \"%s\", id=%d, flags %x, wakeup %ld, \n", th->name, th->id, th->flags, sq->timeout);
+				}
+			}
+		}
+		spin_unlock_irqrestore(&w->lock, flags);
 	}
 	printk("\n");
-	spin_unlock_irqrestore(&sleep_lock, flags);
 }
 
 void sched_print_threads()
@@ -204,22 +705,201 @@ void sched_print_hibernating_threads()
 	spin_unlock(&thread_list_lock);
 }
 
+static void wheel_enqueue(struct timer_wheel *w, struct sleep_queue *sq, u64 expires)
+{
+	u64 delta, slot_expires;
+	int level;
+
+	if ((s64)(expires - w->clk) < 0)
+	{
+		expires = w->clk;
+	}
+
+	/* Anything beyond the top level waits in its last slot and is
+	 * requeued from there when cascaded */
+	delta = expires - w->clk;
+	slot_expires = delta < WHEEL_RANGE ? expires : w->clk + WHEEL_RANGE - 1;
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+	{
+		if (delta < (1ULL << (WHEEL_BITS * (level + 1))))
+		{
+			break;
+		}
+	}
+
+	sq->expires = expires;
+	sq->level = level;
+	list_add_tail(&sq->list, &w->slots[level][(slot_expires >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+	w->pending[level]++;
+	w->count++;
+
+	if ((s_time_t)(expires << TIMER_TICK_SHIFT) < w->next_expiry)
+	{
+		w->next_expiry = expires << TIMER_TICK_SHIFT;
+	}
+}
+
+static inline void wheel_dequeue(struct timer_wheel *w, struct sleep_queue *sq)
+{
+	list_del_init(&sq->list);
+	w->pending[sq->level]--;
+	w->count--;
+}
+
+static void wheel_cascade(struct timer_wheel *w, int level, int slot)
+{
+	struct list_head *iterator, *tmp;
+	struct sleep_queue *sq;
+	LIST_HEAD(cascade);
+
+	list_splice(&w->slots[level][slot], &cascade);
+	INIT_LIST_HEAD(&w->slots[level][slot]);
+
+	list_for_each_safe(iterator, tmp, &cascade)
+	{
+		sq = list_entry(iterator, struct sleep_queue, list);
+		w->pending[level]--;
+		w->count--;
+		wheel_enqueue(w, sq, sq->expires);
+	}
+}
+
+/* Recompute the earliest deadline; only the first occupied slot of each
+ * level can hold it */
+static void wheel_update_next(struct timer_wheel *w)
+{
+	struct list_head *iterator;
+	struct sleep_queue *sq;
+	s_time_t next = LLONG_MAX;
+	int level, i, slot, start;
+
+	for (level = 0; level < WHEEL_LEVELS; level++)
+	{
+		if (w->pending[level] == 0)
+		{
+			continue;
+		}
+
+		start = (w->clk >> (WHEEL_BITS * level)) + (level > 0);
+		for (i = 0; i < WHEEL_SIZE; i++)
+		{
+			slot = (start + i) & WHEEL_MASK;
+			if (list_empty(&w->slots[level][slot]))
+			{
+				continue;
+			}
+
+			list_for_each(iterator, &w->slots[level][slot])
+			{
+				sq = list_entry(iterator, struct sleep_queue, list);
+				if ((s_time_t)(sq->expires << TIMER_TICK_SHIFT) < next)
+				{
+					next = sq->expires << TIMER_TICK_SHIFT;
+				}
+			}
+			break;
+		}
+	}
+
+	w->next_expiry = next;
+}
+
+static void wheel_expire(struct timer_wheel *w, int slot)
+{
+	struct list_head *iterator, *tmp;
+	struct sleep_queue *sq;
+	struct thread *thread;
+
+	list_for_each_safe(iterator, tmp, &w->slots[0][slot])
+	{
+		sq = list_entry(iterator, struct sleep_queue, list);
+		thread = sq->thread;
+		wheel_dequeue(w, sq);
+
+		/* wake() ignores these; retry on the next tick until it sticks */
+		if (is_hibernating(thread) || is_suspended(thread))
+		{
+			wheel_enqueue(w, sq, w->clk + 1);
+			continue;
+		}
+
+		clear_active(sq);
+		set_expired(sq);
+		if (thread->timer == sq)
+		{
+			thread->timer = NULL;
+		}
+		sched_wake(thread, 0);
+	}
+}
+
+static void wheel_run(struct timer_wheel *w, s_time_t now)
+{
+	u64 now_tick = now >> TIMER_TICK_SHIFT;
+	u64 next;
+	int level, slot;
+
+	while ((s64)(now_tick - w->clk) >= 0)
+	{
+		if (w->count == 0)
+		{
+			w->clk = now_tick + 1;
+			break;
+		}
+
+		if ((w->clk & WHEEL_MASK) == 0)
+		{
+			for (level = 1; level < WHEEL_LEVELS; level++)
+			{
+				slot = (w->clk >> (WHEEL_BITS * level)) & WHEEL_MASK;
+				wheel_cascade(w, level, slot);
+				if (slot != 0)
+				{
+					break;
+				}
+			}
+		}
+
+		/* Skip ahead to the next cascade while the lower levels are empty */
+		for (level = 0; level < WHEEL_LEVELS - 1 && w->pending[level] == 0; level++);
+
+		if (level > 0)
+		{
+			next = ((w->clk >> (WHEEL_BITS * level)) + 1) << (WHEEL_BITS * level);
+			w->clk = (s64)(next - now_tick) > 1 ? now_tick + 1 : next;
+			continue;
+		}
+
+		wheel_expire(w, w->clk & WHEEL_MASK);
+		w->clk++;
+	}
+
+	if (w->next_expiry <= now)
+	{
+		wheel_update_next(w);
+	}
+}
+
 s_time_t sched_blocking_time(int cpu) 
 {
+	struct timer_wheel *w = &timer_wheels[cpu];
 	s_time_t timeout, then;
-	struct sleep_queue *q;
 	long flags;
 	then = NOW();
+#ifdef ENABLE_TICKLESS
+	timeout = LLONG_MAX;
+#else
 	timeout = NOW() + SECONDS(DEFAULT_SLEEP_MS);
-	spin_lock_irqsave(&sleep_lock, flags);
+#endif
+	spin_lock_irqsave(&w->lock, flags);
 	
-	if (!list_empty(&sleep_queue)) 
+	if (w->count != 0 && w->next_expiry < timeout) 
 	{
-		q = list_entry(sleep_queue.next, struct sleep_queue, list);
-		timeout = q->timeout;
+		timeout = w->next_expiry;
 	}
 
-	spin_unlock_irqrestore(&sleep_lock, flags);
+	spin_unlock_irqrestore(&w->lock, flags);
 
 	if (timeout < then) 
 	{
@@ -240,80 +920,289 @@ void sched_kick_processor(int cpu)
 
 static void sched_wake_expired(void) 
 {
+	struct timer_wheel *w = &timer_wheels[smp_processor_id()];
+	s_time_t now = NOW();
+	long flags;
 
-	struct list_head *iterator;
+	if (now < w->next_expiry)
+	{
+		return;
+	}
+
+	spin_lock_irqsave(&w->lock, flags);
+	wheel_run(w, now);
+	spin_unlock_irqrestore(&w->lock, flags);
+}
+
+int join_thread(u32 handle)  
+{
+	struct thread *this_thread = current;
+	struct thread *joinee;
+    spin_lock(&dead_lock);
+
+	/* Reaping takes dead_lock too, so a joinee found here stays put until
+	 * we are on its joiners list */
+	joinee = sched_get_thread_handle(handle);
+
+	if (!is_dying(this_thread) && joinee != NULL)
+	{
+		this_thread->regs = NULL;
+		block(this_thread);
+		list_add_tail(&this_thread->ready_list, &joinee->joiners);
+		spin_unlock(&dead_lock);
+        set_joining(this_thread);
+		schedule();
+        clear_joining(this_thread);
+    }
+    else
+    {
+		spin_unlock(&dead_lock);
+		return -1;
+	}
+
+	return 0;
+}
+
+int sched_wake_joiner(struct thread *joiner) 
+{
+	list_del_init(&joiner->ready_list);
+	wake(joiner);
+	return 0;
+}
+
+static void sched_wake_joiners(struct thread *joinee) 
+{
+	struct list_head *iterator, *tmp;
 	struct thread *thread;
-	struct sleep_queue *sq;
+	list_for_each_safe(iterator, tmp, &joinee->joiners)
+	{
+		thread = list_entry(iterator, struct thread, ready_list);
+		list_del_init(&thread->ready_list);
+        wake(thread);
+	}
+}
+
+static struct fp_regs *alloc_fp_area(void)
+{
+	void *area, *first, *last;
+	unsigned long page, offset;
 	long flags;
-	s_time_t now = NOW();
-	spin_lock_irqsave(&sleep_lock, flags);
 
-	list_for_each(iterator, &sleep_queue)
+	spin_lock_irqsave(&fp_area_lock, flags);
+	area = fp_area_free;
+	if (area != NULL)
 	{
-		sq = list_entry(iterator, struct sleep_queue, list);
-		if(sq->timeout <= now) 
+		fp_area_free = *(void **)area;
+	}
+	spin_unlock_irqrestore(&fp_area_lock, flags);
+
+	if (area != NULL)
+	{
+		return (struct fp_regs *)area;
+	}
+
+	page = alloc_page();
+	if (page == 0)
+	{
+		return NULL;
+	}
+
+	/* Keep the first area and chain up the rest of the page */
+	first = NULL;
+	last = NULL;
+	for (offset = FP_AREA_SIZE; offset + FP_AREA_SIZE <= PAGE_SIZE; offset += FP_AREA_SIZE)
+	{
+		*(void **)(page + offset) = first;
+		if (first == NULL)
 		{
-			thread = sq->thread;
-			wake(thread);
-		} 
-		else 
+			last = (void *)(page + offset);
+		}
+		first = (void *)(page + offset);
+	}
+
+	if (first != NULL)
+	{
+		spin_lock_irqsave(&fp_area_lock, flags);
+		*(void **)last = fp_area_free;
+		fp_area_free = first;
+		spin_unlock_irqrestore(&fp_area_lock, flags);
+	}
+
+	return (struct fp_regs *)page;
+}
+
+static void free_fp_area(struct fp_regs *fpregs)
+{
+	long flags;
+
+	spin_lock_irqsave(&fp_area_lock, flags);
+	*(void **)fpregs = fp_area_free;
+	fp_area_free = fpregs;
+	spin_unlock_irqrestore(&fp_area_lock, flags);
+}
+
+/* Returns a thread with a clean FP save area and, if with_stack is set, a
+ * STACK_SIZE stack of its own. Threads with their own stack come from the
+ * cache of dead threads when there are any */
+struct thread *sched_alloc_thread(int with_stack)
+{
+	struct thread *thread = NULL;
+#ifdef ENABLE_THREAD_CACHE
+	long flags;
+
+	if (with_stack)
+	{
+		spin_lock_irqsave(&thread_cache_lock, flags);
+		if (!list_empty(&thread_cache))
 		{
-			break;
+			thread = list_entry(thread_cache.next, struct thread, ready_list);
+			list_del(&thread->ready_list);
+			thread_cache_count--;
+		}
+		spin_unlock_irqrestore(&thread_cache_lock, flags);
+	}
+#endif
+
+	if (thread == NULL)
+	{
+		thread = xmalloc(struct thread);
+		if (thread == NULL)
+		{
+			return NULL;
+		}
+
+		thread->fpregs = alloc_fp_area();
+		if (thread->fpregs == NULL)
+		{
+			xfree(thread);
+			return NULL;
+		}
+
+		thread->stack = NULL;
+		thread->stack_size = 0;
+		thread->stack_allocated = 0;
+		if (with_stack)
+		{
+			thread->stack = (char *)alloc_pages(STACK_SIZE_PAGE_ORDER);
+			if (thread->stack == NULL)
+			{
+				free_fp_area(thread->fpregs);
+				xfree(thread);
+				return NULL;
+			}
+			thread->stack_allocated = 1;
+			thread->stack_size = STACK_SIZE;
+		}
+	}
+
+	memset(thread->fpregs, 0, FP_AREA_SIZE);
+	thread->fpregs->mxcsr = MXCSRINIT;
+	return thread;
+}
+
+static void sched_free_thread(struct thread *thread)
+{
+#ifdef ENABLE_THREAD_CACHE
+	long flags;
+
+	if (thread->stack_allocated)
+	{
+		spin_lock_irqsave(&thread_cache_lock, flags);
+		if (thread_cache_count < THREAD_CACHE_SIZE)
+		{
+			list_add(&thread->ready_list, &thread_cache);
+			thread_cache_count++;
+			spin_unlock_irqrestore(&thread_cache_lock, flags);
+			return;
 		}
+		spin_unlock_irqrestore(&thread_cache_lock, flags);
+	}
+#endif
+
+	if (thread->stack_allocated)
+	{
+		free_pages(thread->stack, STACK_SIZE_PAGE_ORDER);
+	}
+
+	free_fp_area(thread->fpregs);
+	xfree(thread);
+}
+
+/* Called as a thread leaves the processor after running for ran ns.
+ * A thread that blocks early keeps a short slice, so it cannot hold up
+ * others for long when it does turn CPU-bound. A thread that keeps using
+ * its whole slice gets a longer one, up to ADAPTIVE_TIMESLICE_SCALE
+ * times the default */
+static void sched_update_timeslice(struct thread *thread, u64 ran)
+{
+#ifdef ENABLE_ADAPTIVE_TIMESLICE
+	u64 slice;
+#endif
+
+	if (thread->timeslice_fixed)
+	{
+		return;
 	}
 
-	spin_unlock_irqrestore(&sleep_lock, flags);
+#ifdef ENABLE_ADAPTIVE_TIMESLICE
+	thread->avg_run_time = (3 * thread->avg_run_time + ran) / 4;
+	slice = 2 * thread->avg_run_time;
+	if (slice < MIN_TIMESLICE)
+	{
+		slice = MIN_TIMESLICE;
+	}
+	else if (slice > ADAPTIVE_TIMESLICE_SCALE * timeslice)
+	{
+		slice = ADAPTIVE_TIMESLICE_SCALE * timeslice;
+	}
+	thread->timeslice = slice;
+#else
+	thread->timeslice = timeslice;
+#endif
 }
 
-int join_thread(struct thread *joinee)  
+/* Pins the thread's timeslice, or with 0 hands it back to the default
+ * (and adaptive) policy */
+int sched_set_timeslice(struct thread *thread, u64 slice)
 {
-	struct thread *this_thread = current;
-    spin_lock(&dead_lock);
-
-	/* TODO Jon & Ward
-	 * Need to fix the inefficient thread lookup here
-	 * The problem is, how do we detect at kernel level that the pointer we have to a
-	 * thread struct is no longer valid -- the kernel reaps dead threads, so the pntr could
-	 * already be pointing at something else -- possibly by maintaining a pntr back to PTE thread pntr
-	 * and checking whether its state is PThreadStateLast or similar.
-	 */
+	if (slice == 0)
+	{
+		thread->timeslice_fixed = 0;
+		thread->avg_run_time = timeslice / 2;
+		thread->timeslice = timeslice;
+		return 0;
+	}
 
-	if (!is_dying(this_thread) && sched_get_thread(joinee->id) != NULL)
+	if (slice < MIN_TIMESLICE || slice > MAX_TIMESLICE)
 	{
-		this_thread->regs = NULL;
-		block(this_thread);
-		list_add_tail(&this_thread->ready_list, &joinee->joiners);
-		spin_unlock(&dead_lock);
-        set_joining(this_thread);
-		schedule();
-        clear_joining(this_thread);
-    }
-    else
-    {
-		spin_unlock(&dead_lock);
 		return -1;
 	}
 
+	thread->timeslice = slice;
+	thread->timeslice_fixed = 1;
 	return 0;
 }
 
-int sched_wake_joiner(struct thread *joiner) 
+u64 sched_get_timeslice(struct thread *thread)
 {
-	list_del_init(&joiner->ready_list);
-	wake(joiner);
-	return 0;
+	return thread->timeslice;
 }
 
-static void sched_wake_joiners(struct thread *joinee) 
+/* Takes effect for each thread the next time it is switched out */
+int sched_set_default_timeslice(u64 slice)
 {
-	struct list_head *iterator, *tmp;
-	struct thread *thread;
-	list_for_each_safe(iterator, tmp, &joinee->joiners)
+	if (slice < MIN_TIMESLICE || slice > MAX_TIMESLICE)
 	{
-		thread = list_entry(iterator, struct thread, ready_list);
-		list_del_init(&thread->ready_list);
-        wake(thread);
+		return -1;
 	}
+
+	timeslice = slice;
+	return 0;
+}
+
+u64 sched_get_default_timeslice(void)
+{
+	return timeslice;
 }
 
 static void sched_reap_dead(void) 
@@ -335,13 +1224,8 @@ static void sched_reap_dead(void)
 					sched_wake_joiners(thread);
 				}
 
-				if (thread->stack_allocated)
-				{
-					free_pages(thread->stack, STACK_SIZE_PAGE_ORDER);
-				}
-
 				sched_del_thread_list(thread);
-				xfree(thread);
+				sched_free_thread(thread);
 			}
 		}
 	}
@@ -355,71 +1239,206 @@ void sched_switch_thread_in(struct thread *prev)
 	local_irq_enable();
 }
 
-static inline struct thread *pick_thread(struct thread *prev, int cpu)
+static struct thread *rq_pick(struct runqueue *rq)
 {
-	struct thread *next, *thread;
+	struct thread *thread;
 	struct list_head *t;
-	long flags;
-	int i;
+	unsigned long levels;
+	int level, i = 0;
 
-	next = NULL;
-	spin_lock_irqsave(&ready_lock, flags);
-
-	if(is_runnable(prev) && prev != this_cpu(idle_thread))
+	for (levels = rq->levels; levels != 0; levels &= ~(1UL << level))
 	{
-		list_del_init(&prev->ready_list);
-		list_add_tail(&prev->ready_list, &ready_queue);
+		level = __ffs(levels);
+		list_for_each(t, &rq->queues[level])
+		{
+			/* if the ready queue is corrupted then raise a bug */
+			BUG_ON(++i > MAX_THREADS);
+			thread = list_entry(t, struct thread, ready_list);
+
+			/* The thread running on this processor stays queued, skip it */
+			if (!is_running(thread) && is_runnable(thread))
+			{
+				return thread;
+			}
+		}
 	}
 
-	/* If there is a 'runnable' thread that is not running on some other processor, 
-	then it is the next thread to run */
+	return NULL;
+}
 
-	i = 0;
+/* Called by a processor that ran out of work: pull the thread that has been
+ * waiting longest off the most loaded run queue */
+static struct thread *sched_steal_thread(int cpu)
+{
+	struct runqueue *rq, *busiest;
+	struct thread *thread;
+	struct list_head *t;
+	unsigned long levels;
+	long flags;
+	int i, load, level;
 
-	list_for_each(t, &ready_queue)
-    {
-		if(++i > thread_id)
-		{ 
-			/* if the ready queue is corrupted then break and raise a bug */
-			spin_unlock_irqrestore(&ready_lock, flags);
-			BUG();
+	rq = &runqueues[cpu];
+	busiest = NULL;
+	load = 1;
+
+	for (i = 0; i < MAX_VIRT_CPUS; i++)
+	{
+		/* nr_queued includes the thread running over there */
+		if (i != cpu && runqueues[i].nr_queued > load)
+		{
+			busiest = &runqueues[i];
+			load = busiest->nr_queued;
 		}
+	}
+
+	if (busiest == NULL)
+	{
+		return NULL;
+	}
 
-		thread = list_entry(t, struct thread, ready_list);
+	local_irq_save(flags);
+	rq_double_lock(rq, busiest);
 
-		/* Jon and Ward: the original logic has been modified, we need a load balancer to deal 
-		with threads being assigned on processors */
-		if (!is_running(thread)) {
-			if(is_runnable(thread) && !(is_running(thread) && thread->cpu != cpu)) {
-				/* Comment out conditional statement to permit threads switching processors, each 
-				thread will only be scheduled on the processor it was first scheduled on (thread
-				affinity) */
-				if (thread->cpu == cpu || thread->cpu == -1) 
-				{
-					next = thread;
-					break;
-				}
+	thread = NULL;
+	for (levels = busiest->levels; levels != 0 && thread == NULL; levels &= ~(1UL << level))
+	{
+		level = __ffs(levels);
+		/* Threads are queued at the tail, so the oldest is at the head */
+		list_for_each(t, &busiest->queues[level])
+		{
+			thread = list_entry(t, struct thread, ready_list);
+			if (!is_running(thread) && is_runnable(thread))
+			{
+				break;
 			}
+			thread = NULL;
 		}
+	}
 
+	if (thread != NULL)
+	{
+		rq_dequeue(busiest, thread);
+		sched_trace_event(SCHED_TRACE_MIGRATE, thread, thread->cpu, cpu);
+		thread->cpu = cpu;
+		rq_enqueue(rq, thread);
+		set_running(thread);
+		rq->tick_stopped = rq->nr_queued <= 1;
 	}
 
-	if (next != NULL) 
+	rq_double_unlock(rq, busiest);
+	local_irq_restore(flags);
+
+	return thread;
+}
+
+/* Directed yield: give the processor to the thread with the given handle
+ * now, pulling it over from whichever run queue it is on. Returns -1
+ * without yielding if that thread is gone, not runnable, already running
+ * or less urgent than the caller */
+int sched_yield_to(u32 handle)
+{
+	struct runqueue *rq, *trq;
+	struct thread *thread;
+	unsigned long flags;
+	int cpu, ret = -1;
+
+	/* Reaping takes dead_lock, so the thread cannot be freed under us */
+	spin_lock(&dead_lock);
+	thread = sched_get_thread_handle(handle);
+	if (thread == NULL || thread == current || thread->cpu == -1)
+	{
+		spin_unlock(&dead_lock);
+		return -1;
+	}
+
+	local_irq_save(flags);
+	cpu = smp_processor_id();
+	rq = &runqueues[cpu];
+	for (;;)
 	{
-		/* Changing the logic here; this used to be:
-		if (is_running(next) && next->cpu != cpu) */
-		if (is_running(next)) 
+		trq = &runqueues[thread->cpu];
+		rq_double_lock(rq, trq);
+		if (trq == &runqueues[thread->cpu])
 		{
-			printk("Scheduling error, %d\n", next->id);
-			BUG();
+			break;
+		}
+		rq_double_unlock(rq, trq);
+	}
+
+	if (is_runnable(thread) && !is_running(thread) && !list_empty(&thread->ready_list) &&
+		(!is_runnable(current) || sched_level(thread) <= sched_level(current)))
+	{
+		/* At the head of its level, and ahead of us if we are still runnable */
+		rq_dequeue(trq, thread);
+		if (thread->cpu != cpu)
+		{
+			sched_trace_event(SCHED_TRACE_MIGRATE, thread, thread->cpu, cpu);
 		}
+		thread->cpu = cpu;
+		rq_enqueue_head(rq, thread);
+		ret = 0;
+	}
+
+	rq_double_unlock(rq, trq);
+	local_irq_restore(flags);
+	spin_unlock(&dead_lock);
+
+	if (ret == 0)
+	{
+		schedule();
+	}
+
+	return ret;
+}
+
+static inline struct thread *pick_thread(struct thread *prev, int cpu)
+{
+	struct runqueue *rq = &runqueues[cpu];
+	struct thread *next;
+	long flags;
+
+	spin_lock_irqsave(&rq->lock, flags);
+
+	/* A preempted SCHED_FIFO thread keeps its place at the head of its level */
+	if(is_runnable(prev) && prev != this_cpu(idle_thread) && prev->policy != SCHED_POLICY_FIFO)
+	{
+		rq_dequeue(rq, prev);
+		rq_enqueue(rq, prev);
+	}
+
+	/* If there is a 'runnable' thread on this processor that is not running,
+	then it is the next thread to run */
+	next = rq_pick(rq);
+
+	/* prev is still marked running, so rq_pick() passes over it. With
+	 * nothing else queued here it keeps the processor */
+	if (next == NULL && is_runnable(prev) && prev != this_cpu(idle_thread))
+	{
+		next = prev;
+	}
 
+	if (next != NULL) 
+	{
 		set_running(next);
-		spin_unlock_irqrestore(&ready_lock, flags);
+		/* Decided under the lock so that a racing wake() sees it */
+		rq->tick_stopped = rq->nr_queued <= 1;
+		spin_unlock_irqrestore(&rq->lock, flags);
 		return next;
 	}
 
-	spin_unlock_irqrestore(&ready_lock, flags);
+	rq->tick_stopped = 0;
+	spin_unlock_irqrestore(&rq->lock, flags);
+
+	/* Nothing local; unless prev is coming straight back, go steal some work */
+	if (!is_runnable(prev) || prev == this_cpu(idle_thread))
+	{
+		next = sched_steal_thread(cpu);
+		if (next != NULL)
+		{
+			return next;
+		}
+	}
+
 	next = this_cpu(idle_thread);
 	set_running(next);
 	return next;
@@ -445,6 +1464,16 @@ void schedule(void)
 
 	u64 running_time = get_running_time();
 	prev->cum_running_time += running_time - prev->start_running_time;
+	if (prev != this_cpu(idle_thread))
+	{
+		sched_update_timeslice(prev, running_time - prev->start_running_time);
+	}
+	if (prev->woke_other)
+	{
+		/* Blocking straight after a wakeup makes it a hand-off */
+		prev->wake_sync = !is_runnable(prev);
+		prev->woke_other = 0;
+	}
 
 	/* Check if there are any threads that need to be woken up. 
 	The overhead of checking it every schedule could be avoided if we check it from the timer interrupt handler */
@@ -472,8 +1501,12 @@ void schedule(void)
 
 	if (next->cpu != cpu) next->cpu = cpu;
 	clear_need_resched(prev);
+#ifdef ENABLE_TICKLESS
+	sched_arm_timer(next, cpu, running_time);
+#else
 	next->resched_running_time = running_time + next->timeslice;
 	set_timer_interrupt(next->timeslice);
+#endif
 	next->start_running_time = running_time;
 
 	if(prev != next) 
@@ -481,17 +1514,14 @@ void schedule(void)
 		BUG_ON(irqs_disabled());
 		local_irq_disable();
 		this_cpu(current_thread) = next;
-		if (1) 
-		{
-			struct fp_regs *fpregs = prev->fpregs;
-			asm (save_fp_regs_asm : : [fpr] "r"(fpregs));
-		}
+		next->nr_switches++;
+		sched_trace_switch(prev, next);
+		/* Eager, since -mfpmath=sse puts xmm registers in ordinary kernel
+		 * code and nearly every thread uses them. XSAVEOPT skips the
+		 * components that were not modified since the last restore */
+		fpu_save(prev->fpregs);
 		asm (save_r14 : [sr14] "=m" (prev->r14));
-		if (1) 
-		{
-			struct fp_regs *fpregs = next->fpregs;
-			asm (restore_fp_regs_asm : : [fpr] "r"(fpregs));
-		}
+		fpu_restore(next->fpregs);
 		asm (restore_r14 : : [sr14] "m" (next->r14));
 		switch_threads(prev, next, prev);
 		sched_switch_thread_in(prev);
@@ -550,7 +1580,7 @@ void preempt_schedule_irq(void)
 	}
 }
 
-static struct thread* create_thread_with_id_stack(char *name, void (*function)(void *), int flags, void *stack, unsigned long stack_size, void *data, uint16_t id)
+struct thread* create_thread_with_stack(char *name, void (*function)(void *), int flags, void *stack, unsigned long stack_size, void *data)
 {
 
 	struct thread *thread;
@@ -564,24 +1594,25 @@ static struct thread* create_thread_with_id_stack(char *name, void (*function)(v
 	
 	thread->flags = flags;
 	thread->regs = NULL;
-	thread->fpregs = (struct fp_regs *)alloc_page();
-	
-	if (thread->fpregs == (struct fp_regs *) 0) 
-	{
-		return NULL;
-	}
-	
-	thread->fpregs->mxcsr = MXCSRINIT;
 
-	if (stack == NULL ) 
-	{
-		thread->cpu = -1;
-	}
+	/* Placed on a run queue by start_thread() */
+	thread->cpu = -1;
+	thread->timer = NULL;
+	thread->prio = SCHED_PRIO_DEFAULT;
+	thread->policy = SCHED_POLICY_OTHER;
 
 	thread->preempt_count = 0;
 	thread->resched_running_time = 0;
 	thread->cum_running_time = 0;
+	thread->nr_switches = 0;
+	thread->ready_time = 0;
+	thread->ready_woken = 0;
 	thread->timeslice = timeslice;
+	thread->avg_run_time = timeslice / 2;
+	thread->timeslice_fixed = 0;
+	thread->last_wakee = 0;
+	thread->woke_other = 0;
+	thread->wake_sync = 0;
 	thread->lock_count = 0;
 	thread->appsched_id = -1;
 	clear_running(thread);
@@ -589,9 +1620,11 @@ static struct thread* create_thread_with_id_stack(char *name, void (*function)(v
 	INIT_LIST_HEAD(&thread->ready_list);
 	INIT_LIST_HEAD(&thread->thread_list);
 	INIT_LIST_HEAD(&thread->aux_thread_list);
-	thread->id = id;
-	sched_add_thread_list(thread);
-	BUG_ON(thread->id == 0);
+	if (sched_add_thread_list(thread) != 0)
+	{
+		sched_free_thread(thread);
+		return NULL;
+	}
 
 	if (thread->flags == UKERNEL_FLAG)
 	{
@@ -601,11 +1634,6 @@ static struct thread* create_thread_with_id_stack(char *name, void (*function)(v
 	return thread;
 }
 
-struct thread* create_thread_with_stack(char *name, void (*function)(void *), int flags, void *stack, unsigned long stack_size, void *data)
-{
-	return create_thread_with_id_stack(name, function, flags, stack, stack_size, data, thread_id++);
-}
-
 struct thread* create_thread(char *name, void (*function), int flags, void *data)
 {
 	return create_thread_with_stack(name, function, flags, NULL, 0, data);
@@ -620,11 +1648,21 @@ struct thread* create_idle_thread(unsigned int cpu)
 	thread = arch_create_thread(strdup(buf), idle_thread_fn, NULL, 0, (void *)(unsigned long)cpu);
 	thread->flags = UKERNEL_FLAG;
 	thread->regs = NULL;
-	thread->fpregs = (struct fp_regs *)alloc_page();
-	thread->fpregs->mxcsr = MXCSRINIT;
 	thread->cpu = cpu;
+	thread->prio = SCHED_PRIO_MIN;
+	thread->policy = SCHED_POLICY_OTHER;
+	thread->timer = NULL;
+	thread->timeslice = timeslice;
+	thread->timeslice_fixed = 1;
+	thread->last_wakee = 0;
+	thread->woke_other = 0;
+	thread->wake_sync = 0;
 	thread->preempt_count = 1;
 	thread->resched_running_time = 0;
+	thread->cum_running_time = 0;
+	thread->nr_switches = 0;
+	thread->ready_time = 0;
+	thread->ready_woken = 0;
 	thread->lock_count = 0;
 	thread->appsched_id = -1;
 	INIT_LIST_HEAD(&thread->joiners);
@@ -660,63 +1698,72 @@ void exit_current_thread(void)
 
 void hibernate(struct thread *thread)
 {
+	struct runqueue *rq;
 	long flags;
-	spin_lock_irqsave(&ready_lock, flags);
+	rq = thread_rq_lock(thread, &flags);
     clear_runnable(thread);
-	clear_running(thread);
 	set_hibernating(thread);
+	sched_trace_event(SCHED_TRACE_BLOCK, thread, 0, SCHED_TRACE_BLOCK_HIBERNATE);
 
 	if ( !(is_suspended(thread) || is_sleeping(thread)) ) 
 	{
-		list_del_init(&thread->ready_list);
+		rq_dequeue(rq, thread);
 	}
 
-	spin_unlock_irqrestore(&ready_lock, flags);
+	spin_unlock_irqrestore(&rq->lock, flags);
 }
 
 void restore(struct thread *thread) 
 {
+	struct runqueue *rq;
 	long flags;
-	spin_lock_irqsave(&ready_lock, flags);
+	rq = thread_rq_lock_wake(thread, &flags);
 	clear_hibernating(thread);
 	
 	if (!(is_suspended(thread) || is_sleeping(thread))) 
 	{
 	    set_runnable(thread);
-		list_add_tail(&thread->ready_list, &ready_queue);
+		rq_enqueue(rq, thread);
+		sched_trace_wake(thread);
+		sched_note_wakeup(thread);
+		sched_check_preempt(thread);
 	}
     
-	spin_unlock_irqrestore(&ready_lock, flags);
+	spin_unlock_irqrestore(&rq->lock, flags);
     if (!(is_suspended(thread) || is_sleeping(thread)) && thread->cpu != smp_processor_id()) sched_kick_processor(thread->cpu);
 }
 
 void suspend_thread (struct thread * thread) 
 {
+    struct runqueue *rq;
     long flags;
-    spin_lock_irqsave(&ready_lock, flags);
+    rq = thread_rq_lock(thread, &flags);
     clear_runnable(thread);
-    clear_running(thread);
     set_suspended(thread);
+    sched_trace_event(SCHED_TRACE_BLOCK, thread, 0, SCHED_TRACE_BLOCK_SUSPEND);
 
 	if ( !(is_hibernating(thread) || is_sleeping(thread) || is_joining(thread)) ) 
 	{
-        list_del_init(&thread->ready_list);
+        rq_dequeue(rq, thread);
     }
 
-    spin_unlock_irqrestore(&ready_lock, flags);
+    spin_unlock_irqrestore(&rq->lock, flags);
 }
 
 void wake_suspended_thread(struct thread * thread) 
 {
+    struct runqueue *rq;
     long flags;
-    spin_lock_irqsave(&ready_lock, flags);
+    rq = thread_rq_lock(thread, &flags);
     clear_suspended(thread);
     if ( !(is_hibernating(thread) || is_sleeping(thread) || is_joining(thread)) ) 
 	{
         set_runnable(thread);
-        list_add_tail(&thread->ready_list, &ready_queue);
+        rq_enqueue(rq, thread);
+        sched_trace_wake(thread);
+        sched_check_preempt(thread);
     }
-    spin_unlock_irqrestore(&ready_lock, flags);
+    spin_unlock_irqrestore(&rq->lock, flags);
     if ( !(is_hibernating(thread) || is_sleeping(thread) || is_joining(thread)) && thread->cpu != smp_processor_id()) sched_kick_processor(thread->cpu);
 }
 
@@ -724,14 +1771,16 @@ void block(struct thread *thread)
 {
     if (is_runnable(thread)) 
 	{
+        struct runqueue *rq;
         long flags;
-        spin_lock_irqsave(&ready_lock, flags);
+        rq = thread_rq_lock(thread, &flags);
         clear_runnable(thread);
+        sched_trace_event(SCHED_TRACE_BLOCK, thread, 0, SCHED_TRACE_BLOCK_WAIT);
         if (!(is_hibernating(thread) || is_suspended(thread) || is_joining(thread))) 
 		{
-            list_del_init(&thread->ready_list);
+            rq_dequeue(rq, thread);
         }
-        spin_unlock_irqrestore(&ready_lock, flags);
+        spin_unlock_irqrestore(&rq->lock, flags);
     } 
 	else 
 	{
@@ -743,64 +1792,108 @@ void block(struct thread *thread)
 
 void wake(struct thread *thread) 
 {
-    thread->regs = NULL;
-    BUG_ON(is_dying(thread));
-    if (!is_runnable(thread)) 
-	{
-        long flags;
-        spin_lock_irqsave(&ready_lock, flags);
-        if(!is_runnable(thread) && !(is_hibernating(thread) || is_suspended(thread)) ) 
-		{
-            BUG_ON(is_runnable(thread));
-            set_runnable(thread);
-            list_add_tail(&thread->ready_list, &ready_queue);
-        }
-        spin_unlock_irqrestore(&ready_lock, flags);
-        if (!(is_hibernating(thread) || is_suspended(thread)) && thread->cpu != smp_processor_id()) sched_kick_processor(thread->cpu);
-    }
+	sched_wake(thread, 1);
 }
 
 void start_thread(struct thread *thread)
 {
     thread->regs = NULL;
+    struct runqueue *rq;
     long flags;
-    spin_lock_irqsave(&ready_lock, flags);
+    rq = thread_rq_lock(thread, &flags);
     set_runnable(thread);
-    list_add_tail(&thread->ready_list, &ready_queue);
-    spin_unlock_irqrestore(&ready_lock, flags);
+    rq_enqueue(rq, thread);
+    sched_trace_wake(thread);
+    sched_check_preempt(thread);
+    spin_unlock_irqrestore(&rq->lock, flags);
     if (thread->cpu != smp_processor_id()) sched_kick_processor(thread->cpu);
 }
 
-void sleep_queue_add(struct sleep_queue *sq)
+int sched_set_priority(struct thread *thread, int policy, int prio)
 {
+	struct runqueue *rq;
 	long flags;
-	struct list_head *iterator;
-	struct sleep_queue *entry;
+	int queued;
 
-	spin_lock_irqsave(&sleep_lock, flags);
-	
-	list_for_each(iterator, &sleep_queue) 
+	if (policy < SCHED_POLICY_OTHER || policy > SCHED_POLICY_RR || prio < SCHED_PRIO_MIN || prio > SCHED_PRIO_MAX)
 	{
-		entry = list_entry(iterator, struct sleep_queue, list);
+		return -1;
+	}
 
-		if (entry->timeout > sq->timeout) 
-		{
-			break;
-		}
+	rq = thread_rq_lock(thread, &flags);
+	queued = is_runnable(thread) && !list_empty(&thread->ready_list);
+
+	if (queued)
+	{
+		rq_dequeue(rq, thread);
+	}
+
+	thread->policy = policy;
+	thread->prio = prio;
+
+	if (queued)
+	{
+		rq_enqueue(rq, thread);
+		sched_check_preempt(thread);
 	}
 
-	list_add_tail(&sq->list, iterator);
+	/* Dropping our own priority may leave someone else more deserving */
+	if (thread == current)
+	{
+		set_need_resched(current);
+	}
+
+	spin_unlock_irqrestore(&rq->lock, flags);
+	return 0;
+}
+
+void sleep_queue_add(struct sleep_queue *sq)
+{
+	struct timer_wheel *w;
+	long flags;
+	int cpu;
+
+	preempt_disable();
+	cpu = smp_processor_id();
+	w = &timer_wheels[cpu];
+	spin_lock_irqsave(&w->lock, flags);
+
+	if (w->count == 0 && (s64)((NOW() >> TIMER_TICK_SHIFT) - w->clk) > 0)
+	{
+		w->clk = NOW() >> TIMER_TICK_SHIFT;
+	}
+
+	sq->cpu = cpu;
+	wheel_enqueue(w, sq, (sq->timeout + TIMER_TICK - 1) >> TIMER_TICK_SHIFT);
 	set_active(sq);
-	spin_unlock_irqrestore(&sleep_lock, flags);
+	clear_expired(sq);
+	sq->thread->timer = sq;
+	spin_unlock_irqrestore(&w->lock, flags);
+	preempt_enable();
 }
 
 void sleep_queue_del(struct sleep_queue *sq)
 {
+	struct timer_wheel *w;
 	long flags;
-	spin_lock_irqsave(&sleep_lock, flags);
-	list_del_init(&sq->list);
-	clear_active(sq);
-	spin_unlock_irqrestore(&sleep_lock, flags);
+
+	if (!is_active(sq))
+	{
+		return;
+	}
+
+	w = &timer_wheels[sq->cpu];
+	spin_lock_irqsave(&w->lock, flags);
+	if (is_active(sq))
+	{
+		wheel_dequeue(w, sq);
+		clear_active(sq);
+		if (sq->thread->timer == sq)
+		{
+			sq->thread->timer = NULL;
+		}
+	}
+	spin_unlock_irqrestore(&w->lock, flags);
 }
 
 void *create_timer(void)
@@ -897,21 +1990,22 @@ static void check_suspend(int cpu)
 
 static int runnable_threads(int cpu)
 {
-	struct thread *thread;
-	struct list_head *iterator;
-	int retval = 0;
+	struct runqueue *rq = &runqueues[cpu];
+	int i, retval;
 	long flags;
-	spin_lock_irqsave(&ready_lock, flags);
-	list_for_each(iterator, &ready_queue) 
+	spin_lock_irqsave(&rq->lock, flags);
+	retval = rq_pick(rq) != NULL;
+	spin_unlock_irqrestore(&rq->lock, flags);
+
+	/* Do not block the processor while there is work left to steal */
+	for (i = 0; i < MAX_VIRT_CPUS && !retval; i++)
 	{
-		thread = list_entry(iterator, struct thread, ready_list);
-		if (!is_running(thread)) 
+		if (i != cpu && runqueues[i].nr_queued > 1)
 		{
 			retval = 1;
-			break;
 		}
 	}
-	spin_unlock_irqrestore(&ready_lock, flags);
+
 	return retval;
 }
 
@@ -922,12 +2016,16 @@ void idle_thread_fn(void *data)
 	unsigned long cpu = (unsigned long)data;
 	BUG_ON(cpu != smp_processor_id());
 	bind_virq(VIRQ_TIMER, cpu, timer_handler, NULL);
+#ifdef ENABLE_TICKLESS
+	stop_periodic_timer(cpu);
+#endif
 	per_cpu(cpu, cpu_state) = CPU_UP;
 
 	if(cpu > 0) 
 	{
 		trap_init();
 	}
+	fpu_init_cpu();
 
 	__sti();
 	preempt_enable();
@@ -939,6 +2037,11 @@ void idle_thread_fn(void *data)
 		check_suspend(cpu);
 		sched_reap_dead();
 		local_irq_disable();
+#ifdef ENABLE_TICKLESS
+		/* Advertise before looking for work, so that whoever queues some
+		 * afterwards sends the event that stops us blocking */
+		set_bit(cpu, &idle_cpus);
+#endif
 		s_time_t until = sched_blocking_time(cpu);
 		if (until > 0 && !runnable_threads(cpu)) 
 		{
@@ -949,39 +2052,85 @@ void idle_thread_fn(void *data)
 		{
 			local_irq_enable();
 		}
+#ifdef ENABLE_TICKLESS
+		clear_bit(cpu, &idle_cpus);
+#endif
 	}
 }
 
 void init_sched(char *cmd_line) 
 {
+	int cpu, level, slot;
+	char *arg;
+
+	fpu_init();
+
+	/* timeslice=<ms> */
+	arg = cmd_line != NULL ? strstr(cmd_line, "timeslice=") : NULL;
+	if (arg != NULL)
+	{
+		if (sched_set_default_timeslice(MILLISECS(simple_strtoul(arg + 10, NULL, 10))) != 0)
+		{
+			printk("Ignoring invalid timeslice on the command line\n");
+		}
+	}
+
+	for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++)
+	{
+		spin_lock_init(&runqueues[cpu].lock);
+		for (level = 0; level < SCHED_PRIO_LEVELS; level++)
+		{
+			INIT_LIST_HEAD(&runqueues[cpu].queues[level]);
+		}
+		runqueues[cpu].levels = 0;
+		runqueues[cpu].nr_queued = 0;
+
+		spin_lock_init(&timer_wheels[cpu].lock);
+		timer_wheels[cpu].clk = 0;
+		timer_wheels[cpu].next_expiry = LLONG_MAX;
+		timer_wheels[cpu].count = 0;
+		for (level = 0; level < WHEEL_LEVELS; level++)
+		{
+			timer_wheels[cpu].pending[level] = 0;
+			for (slot = 0; slot < WHEEL_SIZE; slot++)
+			{
+				INIT_LIST_HEAD(&timer_wheels[cpu].slots[level][slot]);
+			}
+		}
+	}
+
 	init_local_space();
 }
 
-void delete_thread_from_sleep_queue(struct thread * thread)
+#ifdef ENABLE_SPINLOCK_STATS
+USED static int init_sched_lock_stats(void)
 {
-	struct sleep_queue *found_sq;
-	struct list_head *it;
-	struct thread *th;
-	struct sleep_queue *sq;
-	int i;
-	long flags;
-
-	i = 0;
-	spin_lock_irqsave(&sleep_lock, flags);
+	int cpu;
 
-	list_for_each(it, &sleep_queue)
+	spin_lock_stats_register(&thread_list_lock, "thread_list_lock", -1);
+	spin_lock_stats_register(&dead_lock, "dead_lock", -1);
+	for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++)
 	{
-		BUG_ON(++i > thread->id);
-		sq = list_entry(it, struct sleep_queue, list);
-		th = sq->thread;
-		if (th->id == thread->id)
+		if (per_cpu(cpu, idle_thread) != NULL)
 		{
-			found_sq = sq;
+			spin_lock_stats_register(&runqueues[cpu].lock, "runqueue", cpu);
+			spin_lock_stats_register(&timer_wheels[cpu].lock, "timer_wheel", cpu);
 		}
 	}
+	return 0;
+}
+
+DECLARE_INIT(init_sched_lock_stats);
+#endif
+
+void delete_thread_from_sleep_queue(struct thread * thread)
+{
+	struct sleep_queue *sq = thread->timer;
 
-	spin_unlock_irqrestore(&sleep_lock, flags);
-	sleep_queue_del(found_sq);
+	if (sq != NULL)
+	{
+		sleep_queue_del(sq);
+	}
 }
 
 void wait_for_completion(struct completion *comp)
@@ -0,0 +1,480 @@
+/* Copyright (C) 2018, Ward Jaradat
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Scheduler tracing. Every processor records its switch, wake, block and
+ * migrate events in a ring of its own, stamped with the TSC, so recording
+ * takes no locks and the oldest events are simply overwritten. A thread is
+ * stamped with the system time when it becomes ready to run, and the time
+ * until it is switched in goes into one of two histograms: wakeup latency
+ * for threads that were woken, run queue wait for threads that were
+ * preempted. The system time, unlike the TSC, agrees between processors, so
+ * a thread woken on one processor and run on another is measured right.
+ *
+ * Writing to control/sched-trace prints the histograms, per thread switch
+ * counts and the most recent events on the console. Writing "binary" dumps
+ * the rings in the format described in schedtrace.h instead, and "reset"
+ * clears everything.
+ */
+
+#include <os/config.h>
+
+#ifdef ENABLE_SCHED_TRACE
+
+#include <os/kernel.h>
+#include <os/mm.h>
+#include <os/sched.h>
+#include <os/smp.h>
+#include <os/xenbus.h>
+#include <os/xmalloc.h>
+#include <os/schedtrace.h>
+
+/* Events per processor shown by the console dump */
+#define SCHED_TRACE_DUMP_EVENTS 32
+
+/* Bytes per line of the binary dump */
+#define SCHED_TRACE_LINE_BYTES 32
+
+#define SCHED_TRACE_NO_THREAD 0xffff
+
+struct sched_trace_cpu
+{
+	struct sched_trace_event *ring;
+	unsigned long head;
+	unsigned long wakeup_hist[SCHED_TRACE_BUCKETS];
+	unsigned long wait_hist[SCHED_TRACE_BUCKETS];
+} __attribute__((aligned(64)));
+
+static struct sched_trace_cpu sched_trace_cpus[MAX_VIRT_CPUS];
+
+static volatile int sched_trace_enabled;
+
+static const char *sched_trace_names[] = { "switch", "wake", "block", "migrate" };
+
+static inline int sched_trace_bucket(u64 ns)
+{
+	int bucket = ns == 0 ? 0 : 64 - __builtin_clzl(ns);
+	return bucket < SCHED_TRACE_BUCKETS ? bucket : SCHED_TRACE_BUCKETS - 1;
+}
+
+/* Called with interrupts disabled */
+static inline void sched_trace_record(struct sched_trace_cpu *tc, u64 tsc, int type, int thread, int other, int arg)
+{
+	struct sched_trace_event *event;
+
+	event = &tc->ring[tc->head & (SCHED_TRACE_ENTRIES - 1)];
+	event->tsc = tsc;
+	event->type = type;
+	event->cpu = tc - sched_trace_cpus;
+	event->thread = thread;
+	event->other = other;
+	event->arg = arg;
+	wmb();
+	tc->head++;
+}
+
+void sched_trace_event(int type, struct thread *thread, int other, int arg)
+{
+	struct sched_trace_cpu *tc;
+	unsigned long flags;
+	u64 now;
+
+	if (!sched_trace_enabled)
+	{
+		return;
+	}
+
+	/* A thread that is stopped before it got to run is no longer waiting */
+	if (type == SCHED_TRACE_BLOCK)
+	{
+		thread->ready_time = 0;
+	}
+
+	local_irq_save(flags);
+	tc = &sched_trace_cpus[smp_processor_id()];
+	if (tc->ring != NULL)
+	{
+		rdtscll(now);
+		sched_trace_record(tc, now, type, thread->id, other, arg);
+	}
+	local_irq_restore(flags);
+}
+
+/* Called under the run queue lock of a thread that was just made runnable */
+void sched_trace_wake(struct thread *thread)
+{
+	struct sched_trace_cpu *tc;
+	unsigned long flags;
+	u64 now;
+
+	if (!sched_trace_enabled)
+	{
+		return;
+	}
+
+	local_irq_save(flags);
+	thread->ready_time = NOW();
+	thread->ready_woken = 1;
+	rdtscll(now);
+	tc = &sched_trace_cpus[smp_processor_id()];
+	if (tc->ring != NULL)
+	{
+		sched_trace_record(tc, now, SCHED_TRACE_WAKE, thread->id, in_irq() ? SCHED_TRACE_NO_THREAD : current->id, thread->cpu);
+	}
+	local_irq_restore(flags);
+}
+
+/* Called by schedule() with interrupts disabled, just before switching */
+void sched_trace_switch(struct thread *prev, struct thread *next)
+{
+	struct sched_trace_cpu *tc;
+	s_time_t time, latency;
+	int preempted;
+	u64 now;
+
+	if (!sched_trace_enabled)
+	{
+		next->ready_time = 0;
+		return;
+	}
+
+	time = NOW();
+	rdtscll(now);
+	tc = &sched_trace_cpus[smp_processor_id()];
+	if (next->ready_time != 0)
+	{
+		/* Processors may read the system time a little apart */
+		latency = time > next->ready_time ? time - next->ready_time : 0;
+		if (next->ready_woken)
+		{
+			tc->wakeup_hist[sched_trace_bucket(latency)]++;
+		}
+		else
+		{
+			tc->wait_hist[sched_trace_bucket(latency)]++;
+		}
+		next->ready_time = 0;
+	}
+
+	/* prev stays marked running until next is in, so nobody can pick it
+	 * up before it is stamped */
+	preempted = is_runnable(prev) && prev != this_cpu(idle_thread);
+	if (preempted)
+	{
+		prev->ready_time = time;
+		prev->ready_woken = 0;
+	}
+
+	if (tc->ring != NULL)
+	{
+		sched_trace_record(tc, now, SCHED_TRACE_SWITCH, next->id, prev->id, preempted);
+	}
+}
+
+void sched_trace_reset(void)
+{
+	int cpu, enabled;
+
+	enabled = sched_trace_enabled;
+	sched_trace_enabled = 0;
+	for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++)
+	{
+		sched_trace_cpus[cpu].head = 0;
+		memset(sched_trace_cpus[cpu].wakeup_hist, 0, sizeof(sched_trace_cpus[cpu].wakeup_hist));
+		memset(sched_trace_cpus[cpu].wait_hist, 0, sizeof(sched_trace_cpus[cpu].wait_hist));
+	}
+	sched_trace_enabled = enabled;
+}
+
+static void sched_trace_print_hist(const char *name, unsigned long *hist)
+{
+	unsigned long total, seen;
+	int i, p50, p99, max;
+
+	total = 0;
+	for (i = 0; i < SCHED_TRACE_BUCKETS; i++)
+	{
+		total += hist[i];
+	}
+
+	if (total == 0)
+	{
+		printk("  %s: none\n", name);
+		return;
+	}
+
+	seen = 0;
+	p50 = p99 = max = -1;
+	for (i = 0; i < SCHED_TRACE_BUCKETS; i++)
+	{
+		seen += hist[i];
+		if (p50 < 0 && seen * 2 >= total)
+		{
+			p50 = i;
+		}
+		if (p99 < 0 && seen * 100 >= total * 99)
+		{
+			p99 = i;
+		}
+		if (hist[i] != 0)
+		{
+			max = i;
+		}
+	}
+
+	printk("  %s: %lu, p50 < %lu ns, p99 < %lu ns, max < %lu ns\n", name, total, 1UL << p50, 1UL << p99, 1UL << max);
+	for (i = 0; i < SCHED_TRACE_BUCKETS; i++)
+	{
+		if (hist[i] != 0)
+		{
+			printk("    < %10lu ns: %lu\n", 1UL << i, hist[i]);
+		}
+	}
+}
+
+static void sched_trace_print_event(int cpu, struct sched_trace_event *event, u64 last)
+{
+	printk("  %10lu ns %-7s %5u", tsc_to_nsec(cpu, last - event->tsc), sched_trace_names[event->type], event->thread);
+	switch (event->type)
+	{
+		case SCHED_TRACE_SWITCH:
+			printk(" from %u%s\n", event->other, event->arg ? " (preempted)" : "");
+			break;
+
+		case SCHED_TRACE_WAKE:
+			if (event->other == SCHED_TRACE_NO_THREAD)
+			{
+				printk(" by irq onto cpu %u\n", event->arg);
+			}
+			else
+			{
+				printk(" by %u onto cpu %u\n", event->other, event->arg);
+			}
+			break;
+
+		case SCHED_TRACE_BLOCK:
+			printk(" (%s)\n", event->arg == SCHED_TRACE_BLOCK_HIBERNATE ? "hibernate" : event->arg == SCHED_TRACE_BLOCK_SUSPEND ? "suspend" : "wait");
+			break;
+
+		case SCHED_TRACE_MIGRATE:
+			printk(" cpu %u -> %u\n", event->other, event->arg);
+			break;
+	}
+}
+
+void sched_trace_dump(void)
+{
+	struct sched_trace_cpu *tc;
+	struct list_head *it;
+	struct thread *th;
+	unsigned long i, first;
+	int cpu;
+
+	sched_trace_enabled = 0;
+
+	printk("Scheduler trace:\n");
+	for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++)
+	{
+		tc = &sched_trace_cpus[cpu];
+		if (tc->ring == NULL)
+		{
+			continue;
+		}
+
+		printk("cpu %d: %lu events\n", cpu, tc->head);
+		sched_trace_print_hist("wakeup latency", tc->wakeup_hist);
+		sched_trace_print_hist("run queue wait", tc->wait_hist);
+
+		if (tc->head == 0)
+		{
+			continue;
+		}
+
+		printk("  most recent events, time before the last one:\n");
+		first = tc->head > SCHED_TRACE_DUMP_EVENTS ? tc->head - SCHED_TRACE_DUMP_EVENTS : 0;
+		for (i = first; i < tc->head; i++)
+		{
+			sched_trace_print_event(cpu, &tc->ring[i & (SCHED_TRACE_ENTRIES - 1)], tc->ring[(tc->head - 1) & (SCHED_TRACE_ENTRIES - 1)].tsc);
+		}
+	}
+
+	printk("Thread switches:\n");
+	spin_lock(&thread_list_lock);
+	list_for_each(it, &thread_list)
+	{
+		th = list_entry(it, struct thread, thread_list);
+		printk("  \"%s\", id=%d: %lu switches, %lu ns running\n", th->name, th->id, th->nr_switches, th->cum_running_time);
+	}
+	spin_unlock(&thread_list_lock);
+
+	sched_trace_enabled = 1;
+}
+
+static void sched_trace_emit(const void *data, unsigned long len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char line[2 * SCHED_TRACE_LINE_BYTES + 1];
+	const uint8_t *bytes = data;
+	unsigned long i, n;
+
+	while (len > 0)
+	{
+		n = len < SCHED_TRACE_LINE_BYTES ? len : SCHED_TRACE_LINE_BYTES;
+		for (i = 0; i < n; i++)
+		{
+			line[2 * i] = hex[bytes[i] >> 4];
+			line[2 * i + 1] = hex[bytes[i] & 0xf];
+		}
+		line[2 * n] = '\0';
+		printk(SCHED_TRACE_PREFIX "%s\n", line);
+		bytes += n;
+		len -= n;
+	}
+}
+
+void sched_trace_dump_binary(void)
+{
+	struct sched_trace_header header;
+	struct sched_trace_cpu_header cpu_header;
+	struct sched_trace_cpu *tc;
+	struct shadow_time_info *shadow;
+	unsigned long first, start, count;
+	int cpu, i;
+
+	sched_trace_enabled = 0;
+
+	header.magic = SCHED_TRACE_MAGIC;
+	header.version = SCHED_TRACE_VERSION;
+	header.nr_cpus = 0;
+	header.entries = SCHED_TRACE_ENTRIES;
+	header.buckets = SCHED_TRACE_BUCKETS;
+	for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++)
+	{
+		if (sched_trace_cpus[cpu].ring != NULL)
+		{
+			header.nr_cpus++;
+		}
+	}
+
+	printk(SCHED_TRACE_PREFIX "begin\n");
+	sched_trace_emit(&header, sizeof(header));
+
+	for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++)
+	{
+		tc = &sched_trace_cpus[cpu];
+		if (tc->ring == NULL)
+		{
+			continue;
+		}
+
+		/* Lets the events be put on the hypervisor's system time, so that
+		 * rings from different processors can be merged */
+		shadow = &per_cpu(cpu, shadow_time);
+		cpu_header.tsc_timestamp = shadow->tsc_timestamp;
+		cpu_header.system_timestamp = shadow->system_timestamp;
+		cpu_header.tsc_to_nsec_mul = shadow->tsc_to_nsec_mul;
+		cpu_header.tsc_shift = shadow->tsc_shift;
+		cpu_header.cpu = cpu;
+		cpu_header.nr_events = tc->head < SCHED_TRACE_ENTRIES ? tc->head : SCHED_TRACE_ENTRIES;
+		cpu_header.dropped = tc->head - cpu_header.nr_events;
+		for (i = 0; i < SCHED_TRACE_BUCKETS; i++)
+		{
+			cpu_header.wakeup_hist[i] = tc->wakeup_hist[i];
+			cpu_header.wait_hist[i] = tc->wait_hist[i];
+		}
+		sched_trace_emit(&cpu_header, sizeof(cpu_header));
+
+		/* Oldest first, in at most two runs as the ring wraps */
+		first = tc->head - cpu_header.nr_events;
+		while (first < tc->head)
+		{
+			start = first & (SCHED_TRACE_ENTRIES - 1);
+			count = tc->head - first;
+			if (start + count > SCHED_TRACE_ENTRIES)
+			{
+				count = SCHED_TRACE_ENTRIES - start;
+			}
+			sched_trace_emit(&tc->ring[start], count * sizeof(struct sched_trace_event));
+			first += count;
+		}
+	}
+
+	printk(SCHED_TRACE_PREFIX "end\n");
+
+	sched_trace_enabled = 1;
+}
+
+static void sched_trace_watch_fn(void *data)
+{
+	char *path, *value, *err;
+
+	xenbus_watch_path(XBT_NIL, "control/sched-trace", "sched-trace");
+	for (;;)
+	{
+		path = xenbus_read_watch("sched-trace");
+		xfree(path);
+		err = xenbus_read(XBT_NIL, "control/sched-trace", &value);
+		if (err)
+		{
+			xfree(err);
+			continue;
+		}
+
+		if (!strcmp(value, "binary"))
+		{
+			sched_trace_dump_binary();
+		}
+		else if (!strcmp(value, "reset"))
+		{
+			sched_trace_reset();
+		}
+		else
+		{
+			sched_trace_dump();
+		}
+
+		xfree(value);
+		err = xenbus_rm(XBT_NIL, "control/sched-trace");
+		if (err) xfree(err);
+	}
+}
+
+USED static int init_sched_trace(void)
+{
+	int cpu;
+
+	/* Processors that came up have an idle thread */
+	for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++)
+	{
+		if (per_cpu(cpu, idle_thread) != NULL)
+		{
+			sched_trace_cpus[cpu].ring = (struct sched_trace_event *)alloc_pages(get_order(SCHED_TRACE_ENTRIES * sizeof(struct sched_trace_event)));
+			if (sched_trace_cpus[cpu].ring == NULL)
+			{
+				printk("sched-trace: no memory for the ring of cpu %d\n", cpu);
+			}
+		}
+	}
+
+	sched_trace_enabled = 1;
+	create_thread("sched_trace", sched_trace_watch_fn, UKERNEL_FLAG, NULL);
+	return 0;
+}
+
+DECLARE_INIT(init_sched_trace);
+
+#endif
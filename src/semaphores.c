@@ -17,120 +17,241 @@
 
 #include <os/semaphores.h>
 
-semaphore_list_t * semaphore_list_create(struct thread * thread, semaphore_list_t * next)
+/*
+ * The count lives in value and is taken with a compare and swap, so pends
+ * and posts that do not have to wait never take the lock. A pend that finds
+ * the count at zero queues a waiter on its own stack, counts itself in
+ * nr_waiters and sleeps. A post that sees waiters takes the token it just
+ * added back out and hands it to the first of them, so a woken waiter never
+ * has to compete for it.
+ */
+
+struct semaphore_waiter
 {
-	struct semaphore_list_t *node = (struct semaphore_list_t *)xmalloc(struct semaphore_list_t);
-	node->next = next;
-	node->thread = thread;
-	return node;
-}
+	struct list_head list;
+	struct thread *thread;
+	int granted;
+};
 
-semaphore_list_t * semaphore_list_append(struct thread * thread, semaphore_list_t * head)
+static inline int semaphore_take(semaphore_t *sem)
 {
-	semaphore_list_t *new_node =  semaphore_list_create(thread, NULL);
-	if(head == NULL)
+	int value;
+
+	while ((value = sem->value) > 0)
 	{
-		return new_node;
+		if (synch_cmpxchg(&sem->value, value, value - 1) == value)
+		{
+			return 1;
+		}
 	}
-	semaphore_list_t *cursor = head;
-	while(cursor->next != NULL)
+	return 0;
+}
+
+static inline void semaphore_give(semaphore_t *sem)
+{
+	int value;
+
+	do
 	{
-		cursor = cursor->next;
+		value = sem->value;
 	}
-	cursor->next = new_node;
-	return head;
+	while (synch_cmpxchg(&sem->value, value, value + 1) != value);
 }
 
-semaphore_list_t * semaphore_list_delete_first(semaphore_list_t * head)
+/* Sleeps until we are handed a token or, unless it is 0, the deadline
+ * passes. A cancellable pend also gives up once the thread is cancelled;
+ * pte_osThreadCancel() wakes threads that are in one */
+static int semaphore_pend_slow(semaphore_t *sem, s_time_t deadline, int cancellable)
 {
-	if(head == NULL)
+	struct thread *thread = current;
+	struct semaphore_waiter waiter;
+	DEFINE_SLEEP_QUEUE(sq);
+	int result;
+
+	waiter.thread = thread;
+	waiter.granted = 0;
+
+	spin_lock(&sem->lock);
+	sem->nr_waiters++;
+	if (cancellable)
+	{
+		set_cancellable_wait(thread);
+	}
+	mb();
+
+	/* Retried after we are counted, so that a post that found no waiters
+	 * cannot slip past unnoticed */
+	if (semaphore_take(sem))
+	{
+		sem->nr_waiters--;
+		if (cancellable)
+		{
+			clear_cancellable_wait(thread);
+		}
+		spin_unlock(&sem->lock);
+		return SEMAPHORE_ACQUIRED;
+	}
+
+	list_add_tail(&waiter.list, &sem->waiters);
+	for (;;)
 	{
-		return NULL;
+		if (waiter.granted)
+		{
+			result = SEMAPHORE_ACQUIRED;
+			break;
+		}
+
+		if (cancellable && is_cancelled(thread))
+		{
+			result = SEMAPHORE_INTERRUPTED;
+			break;
+		}
+
+		if (deadline != 0 && NOW() >= deadline)
+		{
+			result = SEMAPHORE_TIMEOUT;
+			break;
+		}
+
+		block(thread);
+
+		/* A cancel that came in before we blocked found us runnable
+		 * and its wake went nowhere */
+		if (cancellable && is_cancelled(thread))
+		{
+			wake(thread);
+			result = SEMAPHORE_INTERRUPTED;
+			break;
+		}
+
+		if (deadline != 0)
+		{
+			sq.timeout = deadline;
+			set_sleeping(thread);
+			sleep_queue_add(&sq);
+		}
+		spin_unlock(&sem->lock);
+
+		/* Hand the processor straight to whoever we just posted to */
+		if (!thread->woke_other || sched_yield_to(thread->last_wakee) != 0)
+		{
+			schedule();
+		}
+
+		if (is_sleeping(thread))
+		{
+			clear_sleeping(thread);
+			sleep_queue_del(&sq);
+		}
+		spin_lock(&sem->lock);
 	}
-	semaphore_list_t *old_head = head;
-	head = head->next;
-	xfree(old_head);
-	return head;
+
+	if (!waiter.granted)
+	{
+		list_del(&waiter.list);
+		sem->nr_waiters--;
+	}
+	if (cancellable)
+	{
+		clear_cancellable_wait(thread);
+	}
+	spin_unlock(&sem->lock);
+
+	return result;
 }
 
-semaphore_t * semaphore_create(int value)
+void semaphore_init(semaphore_t *sem, int value)
 {
-	struct semaphore_t * sem = (struct semaphore_t*) xmalloc(struct semaphore_t);
-	sem->mutex = mutex_create();
 	sem->value = value;
-	sem->head = NULL;
-	return sem;
+	sem->nr_waiters = 0;
+	spin_lock_init(&sem->lock);
+	INIT_LIST_HEAD(&sem->waiters);
 }
 
-void hibernate_thread(semaphore_t *sem)
+semaphore_t * semaphore_create(int value)
 {
-	struct thread * thread = sched_current_thread();
-	sem->head = semaphore_list_append(thread, sem->head);
-    hibernate(thread);
-	mutex_unlock(sem->mutex);
-	schedule();
+	struct semaphore_t * sem = (struct semaphore_t*) xmalloc(struct semaphore_t);
+	semaphore_init(sem, value);
+	return sem;
 }
 
-void restore_thread(semaphore_t *sem)
+void semaphore_pend(semaphore_t *sem)
 {
-	struct thread * thread;
-	thread = sem->head->thread;
-	if (thread)
+	if (!semaphore_take(sem))
 	{
-		sem->head = semaphore_list_delete_first(sem->head);
-		restore(thread);
+		semaphore_pend_slow(sem, 0, 0);
 	}
 }
 
-void semaphore_pend(semaphore_t *sem)
+void semaphore_post(semaphore_t *sem)
 {
-	mutex_lock(sem->mutex);
-	sem->value--;
-	if (sem->value<0)
-	{
-        hibernate_thread(sem);
-	}
-	else
+	struct semaphore_waiter *waiter;
+
+	semaphore_give(sem);
+	if (sem->nr_waiters == 0)
 	{
-		mutex_unlock(sem->mutex);
+		return;
 	}
-}
 
-void semaphore_post(semaphore_t *sem)
-{
-	mutex_lock(sem->mutex);
-	sem->value++;
-	if (sem->value <= 0)
+	spin_lock(&sem->lock);
+	if (!list_empty(&sem->waiters) && semaphore_take(sem))
 	{
-        restore_thread(sem);
+		waiter = list_entry(sem->waiters.next, struct semaphore_waiter, list);
+		list_del(&waiter->list);
+		sem->nr_waiters--;
+		waiter->granted = 1;
+		wake(waiter->thread);
 	}
-	mutex_unlock(sem->mutex);
+	spin_unlock(&sem->lock);
 }
 
 int semaphore_count(semaphore_t *sem)
 {
-	int count;
-	mutex_lock(sem->mutex);
-	count = sem->value;
-	mutex_unlock(sem->mutex);
-	return count;
+	return sem->value;
 }
 
 int semaphore_try_pend(semaphore_t *sem)
 {
-	mutex_lock(sem->mutex);
-	if (sem->value<=0)
+	return semaphore_take(sem);
+}
+
+int semaphore_timed_pend(semaphore_t *sem, unsigned int timeout)
+{
+	if (semaphore_take(sem))
+	{
+		return 1;
+	}
+	if (timeout == 0)
 	{
-		mutex_unlock(sem->mutex);
 		return 0;
 	}
-	sem->value--;
-	mutex_unlock(sem->mutex);
-	return 1;
+	return semaphore_pend_slow(sem, NOW() + MILLISECS(timeout), 0) == SEMAPHORE_ACQUIRED;
+}
+
+/* Waits forever if timeout is NULL */
+int semaphore_cancellable_pend(semaphore_t *sem, unsigned int *timeout)
+{
+	if (semaphore_take(sem))
+	{
+		return SEMAPHORE_ACQUIRED;
+	}
+	if (is_cancelled(current))
+	{
+		return SEMAPHORE_INTERRUPTED;
+	}
+	if (timeout == NULL)
+	{
+		return semaphore_pend_slow(sem, 0, 1);
+	}
+	if (*timeout == 0)
+	{
+		return SEMAPHORE_TIMEOUT;
+	}
+	return semaphore_pend_slow(sem, NOW() + MILLISECS(*timeout), 1);
 }
 
 void semaphore_delete(semaphore_t *sem)
 {
-	mutex_delete(sem->mutex);
+	BUG_ON(sem->nr_waiters != 0);
 	xfree(sem);
 }
@@ -48,11 +48,31 @@ extern void idle_thread_starter(void);
 
 static void ipi_handler(evtchn_port_t port, void *unused) 
 {
-	if(per_cpu(smp_processor_id(), cpu_state) == CPU_SUSPENDING) set_need_resched(current);
+	int cpu = smp_processor_id();
+	if(per_cpu(cpu, cpu_state) == CPU_SUSPENDING) set_need_resched(current);
+	if(per_cpu(cpu, preempt_pending))
+	{
+		per_cpu(cpu, preempt_pending) = 0;
+		set_need_resched(current);
+	}
+#ifdef ENABLE_TICKLESS
+	if(per_cpu(cpu, tick_pending))
+	{
+		per_cpu(cpu, tick_pending) = 0;
+		sched_restart_tick();
+	}
+#endif
 }
 
+#ifdef ENABLE_PV_SPINLOCKS
+static void spin_kick_handler(evtchn_port_t port, void *data)
+{
+}
+#endif
+
 static void init_cpu_pda(unsigned int cpu) 
 {
+	struct vcpu_register_runstate_memory_area area;
 	unsigned long *irqstack;
 	irqstack = (unsigned long *)alloc_pages(STACK_SIZE_PAGE_ORDER);
 
@@ -74,6 +94,19 @@ static void init_cpu_pda(unsigned int cpu)
 	per_cpu(cpu, ipi_port) = evtchn_alloc_ipi(ipi_handler, cpu, NULL);
 	per_cpu(cpu, cpu_state) = cpu == 0 ? CPU_UP : CPU_SLEEPING;
 	per_cpu(cpu, db_support) = NULL;
+	per_cpu(cpu, preempt_pending) = 0;
+#ifdef ENABLE_TICKLESS
+	per_cpu(cpu, tick_pending) = 0;
+#endif
+	/* Lets spinlock waiters see whether a lock holder's vCPU is running. If
+	 * Xen refuses, the runstate stays zeroed, which reads as running */
+	area.addr.v = &per_cpu(cpu, runstate);
+	HYPERVISOR_vcpu_op(VCPUOP_register_runstate_memory_area, cpu, &area);
+#ifdef ENABLE_PV_SPINLOCKS
+	/* Never delivered, spinlock waiters only poll it */
+	per_cpu(cpu, spin_kick_port) = evtchn_alloc_ipi(spin_kick_handler, cpu, NULL);
+	mask_evtchn(per_cpu(cpu, spin_kick_port));
+#endif
 }
 
 void smp_signal_cpu(int cpu) 
@@ -84,6 +117,30 @@ void smp_signal_cpu(int cpu)
 	}
 }
 
+/* Unlike smp_signal_cpu() this does not look at cpu_state, so a processor
+ * that is busy, or just about to block, still takes the event */
+void smp_notify_cpu(int cpu) 
+{
+	if (smp_init_completed && cpu != smp_processor_id()) 
+	{
+		notify_remote_via_evtchn(per_cpu(cpu, ipi_port));
+	}
+}
+
+void smp_preempt_cpu(int cpu) 
+{
+	per_cpu(cpu, preempt_pending) = 1;
+	smp_notify_cpu(cpu);
+}
+
+#ifdef ENABLE_TICKLESS
+void smp_restart_tick(int cpu) 
+{
+	per_cpu(cpu, tick_pending) = 1;
+	smp_notify_cpu(cpu);
+}
+#endif
+
 static DEFINE_SPINLOCK(cpu_lock);
 
 static int suspend_count = 0;
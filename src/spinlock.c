@@ -18,96 +18,238 @@
 
 #include <os/spinlock.h>
 #include <os/kernel.h>
+#include <os/hypervisor.h>
 #include <os/sched.h>
+#include <os/smp.h>
 #include <os/xmalloc.h>
+#include <os/events.h>
+#include <os/atomic.h>
 
-#define BUILD_LOCK_OPS(op, locktype)												\
-void 																				\
-os_##op##_lock(locktype##_t *lock)			                						\
-{																					\
-	for (;;) {																		\
-		preempt_disable();															\
-		if (likely(_raw_##op##_trylock(lock)))										\
-			break;																	\
-		preempt_enable();															\
-																					\
-		if (!(lock)->break_lock)													\
-			(lock)->break_lock = 1;													\
-		while (!op##_can_lock(lock) && (lock)->break_lock)							\
-                {                                                  					\
-                        (lock)->spin_count++;                       				\
-						relax();												\
-                }                                                       			\
-	}																				\
-	(lock)->break_lock = 0;															\
-        (lock)->spin_count = 0;                                         			\
-        (lock)->owner = current;                                      				\
-        current->lock_count++;                                      				\
-}																					\
-																					\
-																					\
-unsigned long 																		\
-os_##op##_lock_irqsave(locktype##_t *lock)											\
-{																					\
-	unsigned long flags;															\
-																					\
-	for (;;) {																		\
-		preempt_disable();															\
-		local_irq_save(flags);														\
-		if (likely(_raw_##op##_trylock(lock)))										\
-			break;																	\
-		local_irq_restore(flags);													\
-		preempt_enable();															\
-																					\
-		if (!(lock)->break_lock)													\
-			(lock)->break_lock = 1;													\
-		while (!op##_can_lock(lock) && (lock)->break_lock)							\
-                {                                                       			\
-                        (lock)->spin_count++;	 	                  				\
-						relax();												\
-                }                                                       			\
-	}																				\
-	(lock)->break_lock = 0;															\
-        (lock)->spin_count = 0;                                         			\
-        (lock)->owner = current;                                      				\
-        current->lock_count++;                                          			\
-	return flags;																	\
-}																					\
-
-BUILD_LOCK_OPS(spin, spinlock);
+/* Whether Xen has taken the processor away from the vCPU holding the lock,
+ * in which case spinning for it is wasted until that vCPU runs again */
+static inline int spin_holder_preempted(spinlock_t *lock)
+{
+	int cpu = lock->owner_cpu;
+	return cpu != smp_processor_id() && per_cpu(cpu, runstate).state != RUNSTATE_running;
+}
 
-void
-os_spin_unlock(spinlock_t *lock)
+#ifdef ENABLE_PV_SPINLOCKS
+/* Blocks in the hypervisor until the unlocker kicks us because our ticket
+ * is up, or something else wakes us. An interrupt handler may come in and
+ * wait for another lock meanwhile; it puts back what it found and leaves
+ * the kick port pending, so that a kick it swallowed is not lost */
+static void spin_poll(spinlock_t *lock, unsigned short ticket)
 {
-	BUG_ON(lock->owner != current);
-    current->lock_count--;
-    lock->owner = NULL;
-    _raw_spin_unlock(lock);
-#ifdef DEBUG_LOCKS
-    if (current->lock_count < 0)
-    {
-    	printk("spinlock count is negative\n");
-    	BUG();
-    }
+	struct spinlock *prev_lock;
+	unsigned short prev_ticket;
+	evtchn_port_t port;
+	sched_poll_t poll;
+
+	port = this_cpu(spin_kick_port);
+	prev_lock = this_cpu(spin_poll_lock);
+	prev_ticket = this_cpu(spin_poll_ticket);
+	this_cpu(spin_poll_ticket) = ticket;
+	wmb();
+	this_cpu(spin_poll_lock) = lock;
+
+	/* Locked, so the unlocker sees us before we look at the lock again */
+	atomic_increment(&lock->poll_waiters);
+	synch_clear_bit(port, &HYPERVISOR_shared_info->evtchn_pending[0]);
+	if (spin_ticket_head(lock->slock) != ticket)
+	{
+		set_xen_guest_handle(poll.ports, &port);
+		poll.nr_ports = 1;
+		poll.timeout = 0;
+		HYPERVISOR_sched_op(SCHEDOP_poll, &poll);
+	}
+	atomic_decrement(&lock->poll_waiters);
+
+	this_cpu(spin_poll_lock) = prev_lock;
+	this_cpu(spin_poll_ticket) = prev_ticket;
+	if (prev_lock != NULL)
+	{
+		synch_set_bit(port, &HYPERVISOR_shared_info->evtchn_pending[0]);
+	}
+}
+
+/* Wakes the processor polling for the ticket that now holds the lock */
+static void spin_kick(spinlock_t *lock, unsigned short ticket)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < MAX_VIRT_CPUS; cpu++)
+	{
+		if (per_cpu(cpu, spin_poll_lock) == lock && per_cpu(cpu, spin_poll_ticket) == ticket)
+		{
+			notify_remote_via_evtchn(per_cpu(cpu, spin_kick_port));
+			break;
+		}
+	}
+}
+#endif
+
+static void spin_wait(spinlock_t *lock, unsigned short ticket)
+{
+	unsigned long spins, stalled, yields;
+	unsigned short head, last;
+#ifdef ENABLE_SPINLOCK_STATS
+	unsigned long start = 0, cycles;
+
+	if (lock->stats != NULL)
+	{
+		rdtscll(start);
+	}
+#endif
+
+	last = spin_ticket_head(lock->slock);
+	stalled = 0;
+	yields = 0;
+	for (spins = 1; ; spins++)
+	{
+		relax();
+		head = spin_ticket_head(lock->slock);
+		if (head == ticket)
+		{
+			break;
+		}
+
+		if ((spins & (SPIN_CHECK_INTERVAL - 1)) == 0)
+		{
+			if (head != last)
+			{
+				last = head;
+				stalled = 0;
+			}
+			else
+			{
+				stalled += SPIN_CHECK_INTERVAL;
+			}
+
+			if (spin_holder_preempted(lock) || stalled >= SPIN_YIELD_THRESHOLD)
+			{
+#ifdef ENABLE_PV_SPINLOCKS
+				spin_poll(lock, ticket);
+#else
+				HYPERVISOR_sched_op(SCHEDOP_yield, NULL);
+#endif
+				yields++;
+				stalled = 0;
+			}
+		}
+	}
+
+#ifdef ENABLE_SPINLOCK_STATS
+	/* The lock is ours now, so are its counters */
+	if (lock->stats != NULL)
+	{
+		rdtscll(cycles);
+		cycles -= start;
+		lock->stats->contended++;
+		lock->stats->spins += spins;
+		lock->stats->yields += yields;
+		lock->stats->wait_cycles += cycles;
+		if (cycles > lock->stats->max_wait_cycles)
+		{
+			lock->stats->max_wait_cycles = cycles;
+		}
+	}
 #endif
-    preempt_enable();
 }
 
-void
-os_spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags)
+static inline void spin_acquire(spinlock_t *lock)
+{
+	unsigned int slock;
+
+	slock = _raw_spin_take_ticket(lock);
+	if (unlikely(spin_ticket_head(slock) != spin_ticket_tail(slock)))
+	{
+		spin_wait(lock, spin_ticket_tail(slock));
+	}
+
+	lock->owner = current;
+	lock->owner_cpu = smp_processor_id();
+	current->lock_count++;
+#ifdef ENABLE_SPINLOCK_STATS
+	if (unlikely(lock->stats != NULL))
+	{
+		lock->stats->acquisitions++;
+		rdtscll(lock->stats->hold_start);
+	}
+#endif
+}
+
+static inline void spin_release(spinlock_t *lock)
 {
+#ifdef ENABLE_SPINLOCK_STATS
+	unsigned long cycles;
+#endif
+#ifdef ENABLE_PV_SPINLOCKS
+	unsigned short next = spin_ticket_head(lock->slock) + 1;
+#endif
+
 	BUG_ON(lock->owner != current);
+#ifdef ENABLE_SPINLOCK_STATS
+	if (unlikely(lock->stats != NULL))
+	{
+		rdtscll(cycles);
+		cycles -= lock->stats->hold_start;
+		lock->stats->hold_cycles += cycles;
+		if (cycles > lock->stats->max_hold_cycles)
+		{
+			lock->stats->max_hold_cycles = cycles;
+		}
+	}
+#endif
 	current->lock_count--;
 	lock->owner = NULL;
 	_raw_spin_unlock(lock);
-	local_irq_restore(flags);
-	#ifdef DEBUG_LOCKS
+#ifdef ENABLE_PV_SPINLOCKS
+	if (unlikely(lock->poll_waiters != 0))
+	{
+		spin_kick(lock, next);
+	}
+#endif
+#ifdef DEBUG_LOCKS
 	if (current->lock_count < 0)
 	{
 		printk("spinlock count is negative\n");
 		BUG();
-    }
-	#endif
+	}
+#endif
+}
+
+/* A waiter holds a place in the queue, so it must not be preempted while
+ * it spins */
+void
+os_spin_lock(spinlock_t *lock)
+{
+	preempt_disable();
+	spin_acquire(lock);
+}
+
+unsigned long
+os_spin_lock_irqsave(spinlock_t *lock)
+{
+	unsigned long flags;
+
+	preempt_disable();
+	local_irq_save(flags);
+	spin_acquire(lock);
+	return flags;
+}
+
+void
+os_spin_unlock(spinlock_t *lock)
+{
+	spin_release(lock);
+	preempt_enable();
+}
+
+void
+os_spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags)
+{
+	spin_release(lock);
+	local_irq_restore(flags);
 	preempt_enable();
 }
 